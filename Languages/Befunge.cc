@@ -1,6 +1,12 @@
 #include "Befunge.hh"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
@@ -11,8 +17,79 @@ using namespace std;
 
 
 
+Field::AxisOccupancy::AxisOccupancy() : least(-1), greatest(-1) { }
+
+void Field::AxisOccupancy::add(ssize_t index) {
+  if (this->counts.size() <= static_cast<size_t>(index)) {
+    this->counts.resize(index + 1, 0);
+  }
+  this->counts[index]++;
+
+  if (this->least < 0) {
+    this->least = index;
+    this->greatest = index;
+  } else if (index < this->least) {
+    this->least = index;
+  } else if (index > this->greatest) {
+    this->greatest = index;
+  }
+}
+
+void Field::AxisOccupancy::remove(ssize_t index) {
+  if (--this->counts[index]) {
+    return;
+  }
+
+  // if this was the last cell at one of the bounds, move the bound inward to
+  // the next nonzero count. every cell is added before it's removed, so this
+  // scanning is amortized over the writes that added the cells
+  if (index == this->least) {
+    while ((this->least <= this->greatest) && !this->counts[this->least]) {
+      this->least++;
+    }
+  }
+  if (index == this->greatest) {
+    while ((this->greatest >= this->least) && !this->counts[this->greatest]) {
+      this->greatest--;
+    }
+  }
+  if (this->least > this->greatest) {
+    this->least = -1;
+    this->greatest = -1;
+  }
+}
+
 Field::Field() : w(0), h(0) { }
 
+void Field::update_occupancy(ssize_t x, ssize_t y, ssize_t z, char old_value,
+    char new_value) {
+  if ((old_value == ' ') && (new_value != ' ')) {
+    this->x_occupancy.add(x);
+    this->y_occupancy.add(y);
+    this->z_occupancy.add(z);
+  } else if ((old_value != ' ') && (new_value == ' ')) {
+    this->x_occupancy.remove(x);
+    this->y_occupancy.remove(y);
+    this->z_occupancy.remove(z);
+  }
+}
+
+void Field::get_bounds(ssize_t* least_x, ssize_t* least_y, ssize_t* least_z,
+    ssize_t* greatest_x, ssize_t* greatest_y, ssize_t* greatest_z) const {
+  // the axes are all empty or all nonempty, so checking one is enough
+  if (this->x_occupancy.least < 0) {
+    *least_x = *least_y = *least_z = 0;
+    *greatest_x = *greatest_y = *greatest_z = 0;
+    return;
+  }
+  *least_x = this->x_occupancy.least;
+  *least_y = this->y_occupancy.least;
+  *least_z = this->z_occupancy.least;
+  *greatest_x = this->x_occupancy.greatest;
+  *greatest_y = this->y_occupancy.greatest;
+  *greatest_z = this->z_occupancy.greatest;
+}
+
 char Field::get(ssize_t x, ssize_t y, ssize_t z) const {
   try {
     return this->planes.at(this->wrap_z(z)).at(this->wrap_y(y)).at(this->wrap_x(x));
@@ -45,6 +122,7 @@ void Field::set(ssize_t x, ssize_t y, ssize_t z, char value) {
   while (line.size() <= x) {
     line.push_back(' ');
   }
+  this->update_occupancy(x, y, z, line[x], value);
   line[x] = value;
 
   if (x >= this->w) {
@@ -55,6 +133,134 @@ void Field::set(ssize_t x, ssize_t y, ssize_t z, char value) {
   }
 }
 
+Field::Region Field::write_region(ssize_t x, ssize_t y, ssize_t z,
+    const char* data, size_t size, bool binary) {
+  if (x < 0) {
+    x = this->wrap_x(x);
+  }
+  if (y < 0) {
+    y = this->wrap_y(y);
+  }
+  if (z < 0) {
+    z = this->wrap_z(z);
+  }
+
+  Region region = {x, y, z, 0, 0};
+  while (this->planes.size() <= static_cast<size_t>(z)) {
+    this->planes.emplace_back();
+  }
+  vector<string>& plane = this->planes[z];
+
+  // split the data into rows first, so each affected line in the field only
+  // has to be resized once
+  const char* data_end = data + size;
+  ssize_t row_y = y;
+  for (const char* row_start = data; row_start < data_end; row_y++) {
+    const char* row_end = binary ? data_end : reinterpret_cast<const char*>(
+        memchr(row_start, '\n', data_end - row_start));
+    if (!row_end) {
+      row_end = data_end;
+    }
+
+    // in text mode, ignore trailing \r characters (and any others in the row)
+    size_t row_size = row_end - row_start;
+    bool has_cr = !binary && memchr(row_start, '\r', row_size);
+    bool has_space = memchr(row_start, ' ', row_size);
+    size_t row_width = row_size;
+    if (has_cr) {
+      row_width = 0;
+      for (const char* ch = row_start; ch != row_end; ch++) {
+        row_width += (*ch != '\r');
+      }
+    }
+
+    if (row_width) {
+      while (plane.size() <= static_cast<size_t>(row_y)) {
+        plane.emplace_back();
+      }
+      string& line = plane[row_y];
+      if (line.size() < x + row_width) {
+        line.resize(x + row_width, ' ');
+      }
+
+      if (!has_cr && !has_space) {
+        for (size_t offset = 0; offset < row_width; offset++) {
+          this->update_occupancy(x + offset, row_y, z, line[x + offset],
+              row_start[offset]);
+        }
+        memcpy(const_cast<char*>(line.data()) + x, row_start, row_width);
+      } else {
+        size_t write_x = x;
+        for (const char* ch = row_start; ch != row_end; ch++) {
+          if (has_cr && (*ch == '\r')) {
+            continue;
+          }
+          if (*ch != ' ') {
+            this->update_occupancy(write_x, row_y, z, line[write_x], *ch);
+            line[write_x] = *ch;
+          }
+          write_x++;
+        }
+      }
+
+      if (x + static_cast<ssize_t>(row_width) > this->w) {
+        this->w = x + row_width;
+      }
+      if (row_y >= this->h) {
+        this->h = row_y + 1;
+      }
+      if (static_cast<ssize_t>(row_width) > region.w) {
+        region.w = row_width;
+      }
+      region.h = row_y - y + 1;
+    }
+
+    row_start = row_end + 1;
+  }
+
+  return region;
+}
+
+Field::Region Field::load_region(const string& filename, ssize_t x, ssize_t y,
+    ssize_t z, bool binary) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw runtime_error(string_printf("can\'t open %s: %s", filename.c_str(),
+        strerror(errno)));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    int error = errno;
+    close(fd);
+    throw runtime_error(string_printf("can\'t stat %s: %s", filename.c_str(),
+        strerror(error)));
+  }
+
+  // empty files can't be mapped, but there's nothing to write anyway
+  if (st.st_size == 0) {
+    close(fd);
+    return this->write_region(x, y, z, NULL, 0, binary);
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw runtime_error(string_printf("can\'t map %s: %s", filename.c_str(),
+        strerror(errno)));
+  }
+
+  try {
+    Region ret = this->write_region(x, y, z,
+        reinterpret_cast<const char*>(data), st.st_size, binary);
+    munmap(data, st.st_size);
+    return ret;
+  } catch (...) {
+    munmap(data, st.st_size);
+    throw;
+  }
+}
+
 size_t Field::width() const {
   return this->w;
 }
@@ -106,13 +312,17 @@ Field Field::load(const string& filename) {
 
   plane.emplace_back(code.substr(line_start_offset));
 
-  for (string& line : plane) {
+  for (size_t y = 0; y < plane.size(); y++) {
+    string& line = plane[y];
     if (!line.empty() && (line[line.size() - 1] == '\r')) {
       line.pop_back();
     }
     if (line.size() > f.w) {
       f.w = line.size();
     }
+    for (size_t x = 0; x < line.size(); x++) {
+      f.update_occupancy(x, y, 0, ' ', line[x]);
+    }
   }
   f.h = plane.size();
 
@@ -206,23 +416,69 @@ Position& Position::wrap_modulus(const Field& f) {
   return *this;
 }
 
+// the wrapping math is done with 128-bit integers because the intermediate
+// values (like t * delta) can overflow 64 bits even though the wrapped position
+// is always within the field
+typedef __int128 int128_t;
+
+static int128_t floor_div(int128_t a, int128_t b) {
+  int128_t q = a / b;
+  return ((a % b) && ((a < 0) != (b < 0))) ? (q - 1) : q;
+}
+
+static int128_t ceil_div(int128_t a, int128_t b) {
+  return -floor_div(-a, b);
+}
+
+// narrows [*t_min, *t_max] to the values of t for which position - t * delta
+// is within [0, size) on one axis. returns false if there are none
+static bool restrict_wrap_steps(int128_t position, int128_t delta,
+    int128_t size, int128_t* t_min, int128_t* t_max) {
+  if (delta == 0) {
+    return (position >= 0) && (position < size);
+  }
+
+  int128_t lower, upper;
+  if (delta > 0) {
+    lower = ceil_div(position - (size - 1), delta);
+    upper = floor_div(position, delta);
+  } else {
+    lower = ceil_div(-position, -delta);
+    upper = floor_div(size - 1 - position, -delta);
+  }
+  if (lower > *t_min) {
+    *t_min = lower;
+  }
+  if (upper < *t_max) {
+    *t_max = upper;
+  }
+  return *t_min <= *t_max;
+}
+
 Position& Position::wrap_lahey(const Field& f) {
   // if the current position is within the field, no wrapping is necessary
   if (this->is_within_field(f)) {
     return *this;
   }
 
-  // move back into the field, and keep moving until we reach the other end of
-  // the field
-  while (!this->is_within_field(f)) {
-    this->move_backward();
-  }
-  while (this->is_within_field(f)) {
-    this->move_backward();
+  // the cells on the IP's line that are within the field are position -
+  // t * delta for a contiguous range of t. wrapping goes to the end of that
+  // range farthest behind the IP (or, if the field is ahead of the IP, the
+  // nearest cell in front of it), which is the greatest t. the range is
+  // unbounded only on axes where delta is zero, which contribute nothing
+  int128_t t_min = -(static_cast<int128_t>(1) << 126);
+  int128_t t_max = static_cast<int128_t>(1) << 126;
+  if (!restrict_wrap_steps(this->x, this->dx, f.width(), &t_min, &t_max) ||
+      !restrict_wrap_steps(this->y, this->dy, f.height(), &t_min, &t_max) ||
+      !restrict_wrap_steps(this->z, this->dz, f.depth(), &t_min, &t_max)) {
+    throw runtime_error(string_printf(
+        "IP at %" PRId64 " %" PRId64 " %" PRId64 " will never reenter the field",
+        this->x, this->y, this->z));
   }
 
-  // move forward so we're back in the field
-  this->move_forward();
+  this->x = static_cast<int64_t>(this->x - t_max * this->dx);
+  this->y = static_cast<int64_t>(this->y - t_max * this->dy);
+  this->z = static_cast<int64_t>(this->z - t_max * this->dz);
   return *this;
 }
 
@@ -282,3 +538,23 @@ bool Position::operator<(const Position& other) const {
   }
   return (this->stack_aligned < other.stack_aligned);
 }
+
+
+
+RandomGenerator::RandomGenerator(uint64_t seed) : state(seed) {
+  // xorshift never leaves the zero state, so don't start there
+  if (!this->state) {
+    this->state = 0x9E3779B97F4A7C15;
+  }
+}
+
+uint64_t RandomGenerator::next() {
+  this->state ^= this->state << 13;
+  this->state ^= this->state >> 7;
+  this->state ^= this->state << 17;
+  return this->state;
+}
+
+uint64_t RandomGenerator::next_below(uint64_t count) {
+  return ((this->next() >> 32) * count) >> 32;
+}
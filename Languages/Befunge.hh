@@ -12,11 +12,54 @@ struct Field {
   ssize_t w;
   ssize_t h;
 
+  // describes the area written by write_region or load_region. the origin is
+  // the least point after wrapping negative coordinates; w and h are the size
+  // of the written area (suitable as the Vb vector for the 'i' opcode)
+  struct Region {
+    ssize_t x;
+    ssize_t y;
+    ssize_t z;
+    ssize_t w;
+    ssize_t h;
+  };
+
+  // the number of non-space cells at each coordinate along one axis, and the
+  // least and greatest coordinates where that number is nonzero. these are
+  // updated on every write, so the bounds of the non-space cells are always
+  // available without scanning the field
+  struct AxisOccupancy {
+    std::vector<size_t> counts;
+    ssize_t least; // -1 if there are no non-space cells
+    ssize_t greatest;
+
+    AxisOccupancy();
+
+    void add(ssize_t index);
+    void remove(ssize_t index);
+  };
+  AxisOccupancy x_occupancy;
+  AxisOccupancy y_occupancy;
+  AxisOccupancy z_occupancy;
+
   Field();
 
   char get(ssize_t x, ssize_t y, ssize_t z) const;
   void set(ssize_t x, ssize_t y, ssize_t z, char value);
 
+  // returns the least and greatest points containing non-space cells, or the
+  // origin for both if there are none
+  void get_bounds(ssize_t* least_x, ssize_t* least_y, ssize_t* least_z,
+      ssize_t* greatest_x, ssize_t* greatest_y, ssize_t* greatest_z) const;
+
+  // writes a block of data into the field with its least point at (x, y, z).
+  // spaces in the data don't overwrite existing cells. in text mode, newlines
+  // start a new row and carriage returns are ignored; in binary mode, the data
+  // is written as a single row
+  Region write_region(ssize_t x, ssize_t y, ssize_t z, const char* data,
+      size_t size, bool binary);
+  Region load_region(const std::string& filename, ssize_t x, ssize_t y,
+      ssize_t z, bool binary);
+
   size_t width() const;
   size_t height() const;
   size_t depth() const;
@@ -27,6 +70,10 @@ struct Field {
 
   static Field load(const std::string& filename);
   void save(const std::string& filename);
+
+private:
+  void update_occupancy(ssize_t x, ssize_t y, ssize_t z, char old_value,
+      char new_value);
 };
 
 struct Position {
@@ -62,3 +109,16 @@ struct Position {
 
   bool operator<(const Position& other) const;
 };
+
+// xorshift64 generator used by the ? opcode. the JIT compiler generates the
+// same steps inline, so the interpreter and compiled code produce the same
+// directions for a given seed
+struct RandomGenerator {
+  uint64_t state;
+
+  explicit RandomGenerator(uint64_t seed);
+
+  uint64_t next();
+  // returns a value in [0, count), computed from the high bits of next()
+  uint64_t next_below(uint64_t count);
+};
@@ -0,0 +1,467 @@
+#include "BefungeFingerprints.hh"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <phosg/Time.hh>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+
+
+FungeStackView::FungeStackView(int64_t* top, int64_t* end) : top(top),
+    end(end) { }
+
+bool FungeStackView::empty() const {
+  return this->top > this->end;
+}
+
+int64_t FungeStackView::pop() {
+  if (this->empty()) {
+    return 0;
+  }
+  return *(this->top++);
+}
+
+void FungeStackView::push(int64_t value) {
+  *(--this->top) = value;
+}
+
+string FungeStackView::pop_string() {
+  string ret;
+  for (int64_t ch = this->pop(); ch; ch = this->pop()) {
+    ret.push_back(ch);
+  }
+  return ret;
+}
+
+void FungeStackView::push_string(const string& s) {
+  this->push(0);
+  for (auto it = s.rbegin(); it != s.rend(); it++) {
+    this->push(*it);
+  }
+}
+
+void FungeStackView::pop_vector(uint8_t dimensions, int64_t* x, int64_t* y,
+    int64_t* z) {
+  *z = (dimensions > 2) ? this->pop() : 0;
+  *y = (dimensions > 1) ? this->pop() : 0;
+  *x = this->pop();
+}
+
+
+
+FingerprintEnvironment::FingerprintEnvironment(Field* field,
+    uint8_t dimensions) : field(field), dimensions(dimensions),
+    storage_offset_x(0), storage_offset_y(0), storage_offset_z(0),
+    hrti_mark_set(false), hrti_mark(0) { }
+
+FingerprintSemantic::FingerprintSemantic(Type type, int64_t value,
+    FingerprintFunction function) : type(type), value(value),
+    function(function) { }
+
+
+
+// MODU: modulo variants. division by zero results in zero, like / and %
+
+static bool modu_signed(FingerprintEnvironment&, FungeStackView& s) {
+  int64_t b = s.pop();
+  int64_t a = s.pop();
+  if (b == 0 || b == -1) {
+    s.push(0);
+  } else {
+    // the result has the same sign as the divisor
+    int64_t r = a % b;
+    if (r && ((r < 0) != (b < 0))) {
+      r += b;
+    }
+    s.push(r);
+  }
+  return true;
+}
+
+static bool modu_unsigned(FingerprintEnvironment&, FungeStackView& s) {
+  int64_t b = s.pop();
+  int64_t a = s.pop();
+  if (b == 0 || b == -1) {
+    s.push(0);
+  } else {
+    int64_t r = a % b;
+    s.push((r < 0) ? -r : r);
+  }
+  return true;
+}
+
+static bool modu_remainder(FingerprintEnvironment&, FungeStackView& s) {
+  int64_t b = s.pop();
+  int64_t a = s.pop();
+  s.push((b == 0 || b == -1) ? 0 : (a % b));
+  return true;
+}
+
+
+
+// FPDP: double-precision floating point. cells are 64 bits wide here, so each
+// double occupies a single cell (rather than two as in 32-bit interpreters)
+
+static double pop_double(FungeStackView& s) {
+  int64_t v = s.pop();
+  double ret;
+  memcpy(&ret, &v, sizeof(ret));
+  return ret;
+}
+
+static void push_double(FungeStackView& s, double v) {
+  int64_t cell;
+  memcpy(&cell, &v, sizeof(cell));
+  s.push(cell);
+}
+
+template <double (*Fn)(double)>
+static bool fpdp_unary(FingerprintEnvironment&, FungeStackView& s) {
+  push_double(s, Fn(pop_double(s)));
+  return true;
+}
+
+static double fpdp_negate_value(double v) {
+  return -v;
+}
+
+static bool fpdp_add(FingerprintEnvironment&, FungeStackView& s) {
+  double b = pop_double(s);
+  double a = pop_double(s);
+  push_double(s, a + b);
+  return true;
+}
+
+static bool fpdp_subtract(FingerprintEnvironment&, FungeStackView& s) {
+  double b = pop_double(s);
+  double a = pop_double(s);
+  push_double(s, a - b);
+  return true;
+}
+
+static bool fpdp_multiply(FingerprintEnvironment&, FungeStackView& s) {
+  double b = pop_double(s);
+  double a = pop_double(s);
+  push_double(s, a * b);
+  return true;
+}
+
+static bool fpdp_divide(FingerprintEnvironment&, FungeStackView& s) {
+  double b = pop_double(s);
+  double a = pop_double(s);
+  push_double(s, a / b);
+  return true;
+}
+
+static bool fpdp_power(FingerprintEnvironment&, FungeStackView& s) {
+  double b = pop_double(s);
+  double a = pop_double(s);
+  push_double(s, pow(a, b));
+  return true;
+}
+
+static bool fpdp_from_int(FingerprintEnvironment&, FungeStackView& s) {
+  push_double(s, static_cast<double>(s.pop()));
+  return true;
+}
+
+static bool fpdp_to_int(FingerprintEnvironment&, FungeStackView& s) {
+  s.push(static_cast<int64_t>(pop_double(s)));
+  return true;
+}
+
+static bool fpdp_from_string(FingerprintEnvironment&, FungeStackView& s) {
+  string str = s.pop_string();
+  push_double(s, strtod(str.c_str(), NULL));
+  return true;
+}
+
+static bool fpdp_print(FingerprintEnvironment&, FungeStackView& s) {
+  printf("%f ", pop_double(s));
+  return true;
+}
+
+
+
+// STRN: string operations. all strings are 0gnirts-ordered on the stack
+
+static bool strn_append(FingerprintEnvironment&, FungeStackView& s) {
+  string a = s.pop_string();
+  string b = s.pop_string();
+  s.push_string(a + b);
+  return true;
+}
+
+static bool strn_compare(FingerprintEnvironment&, FungeStackView& s) {
+  string a = s.pop_string();
+  string b = s.pop_string();
+  int cmp = a.compare(b);
+  s.push((cmp > 0) - (cmp < 0));
+  return true;
+}
+
+static bool strn_display(FingerprintEnvironment&, FungeStackView& s) {
+  string str = s.pop_string();
+  fwrite(str.data(), 1, str.size(), stdout);
+  return true;
+}
+
+static bool strn_find(FingerprintEnvironment&, FungeStackView& s) {
+  string haystack = s.pop_string();
+  string needle = s.pop_string();
+  size_t offset = haystack.find(needle);
+  s.push_string((offset == string::npos) ? "" : haystack.substr(offset));
+  return true;
+}
+
+static bool strn_get(FingerprintEnvironment& env, FungeStackView& s) {
+  int64_t x, y, z;
+  s.pop_vector(env.dimensions, &x, &y, &z);
+  x += env.storage_offset_x;
+  y += env.storage_offset_y;
+  z += env.storage_offset_z;
+
+  // read along +x until a zero cell; reflect if the string runs off the edge
+  // of the field without being terminated
+  string str;
+  int64_t max_x = max<int64_t>(x, 0) + env.field->width();
+  for (; x < max_x; x++) {
+    char ch = env.field->get(x, y, z);
+    if (!ch) {
+      s.push_string(str);
+      return true;
+    }
+    str.push_back(ch);
+  }
+  return false;
+}
+
+static bool strn_input(FingerprintEnvironment&, FungeStackView& s) {
+  string str;
+  for (int ch = getchar(); (ch != EOF) && (ch != '\n'); ch = getchar()) {
+    str.push_back(ch);
+  }
+  s.push_string(str);
+  return true;
+}
+
+static bool strn_left(FingerprintEnvironment&, FungeStackView& s) {
+  int64_t n = s.pop();
+  string str = s.pop_string();
+  if (n < 0) {
+    return false;
+  }
+  s.push_string(str.substr(0, n));
+  return true;
+}
+
+static bool strn_middle(FingerprintEnvironment&, FungeStackView& s) {
+  int64_t n = s.pop();
+  int64_t start = s.pop();
+  string str = s.pop_string();
+  if ((n < 0) || (start < 0) || (static_cast<size_t>(start) > str.size())) {
+    return false;
+  }
+  s.push_string(str.substr(start, n));
+  return true;
+}
+
+static bool strn_length(FingerprintEnvironment&, FungeStackView& s) {
+  string str = s.pop_string();
+  s.push_string(str);
+  s.push(str.size());
+  return true;
+}
+
+static bool strn_put(FingerprintEnvironment& env, FungeStackView& s) {
+  int64_t x, y, z;
+  s.pop_vector(env.dimensions, &x, &y, &z);
+  x += env.storage_offset_x;
+  y += env.storage_offset_y;
+  z += env.storage_offset_z;
+  string str = s.pop_string();
+
+  // the terminating zero is written too
+  for (size_t offset = 0; offset <= str.size(); offset++) {
+    char ch = (offset < str.size()) ? str[offset] : 0;
+    env.field->set(x + offset, y, z, ch);
+    env.modified_cells.emplace_back(x + offset, y, z, 0, 0, 0);
+  }
+  return true;
+}
+
+static bool strn_right(FingerprintEnvironment&, FungeStackView& s) {
+  int64_t n = s.pop();
+  string str = s.pop_string();
+  if (n < 0) {
+    return false;
+  }
+  s.push_string((static_cast<size_t>(n) >= str.size()) ? str :
+      str.substr(str.size() - n));
+  return true;
+}
+
+static bool strn_from_number(FingerprintEnvironment&, FungeStackView& s) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%" PRId64, s.pop());
+  s.push_string(buffer);
+  return true;
+}
+
+static bool strn_to_number(FingerprintEnvironment&, FungeStackView& s) {
+  string str = s.pop_string();
+  s.push(strtoll(str.c_str(), NULL, 10));
+  return true;
+}
+
+
+
+// HRTI: high-resolution timer. times are in microseconds
+
+static bool hrti_granularity(FingerprintEnvironment&, FungeStackView& s) {
+  s.push(1);
+  return true;
+}
+
+static bool hrti_mark(FingerprintEnvironment& env, FungeStackView&) {
+  env.hrti_mark = now();
+  env.hrti_mark_set = true;
+  return true;
+}
+
+static bool hrti_timer(FingerprintEnvironment& env, FungeStackView& s) {
+  if (!env.hrti_mark_set) {
+    return false;
+  }
+  s.push(now() - env.hrti_mark);
+  return true;
+}
+
+static bool hrti_erase_mark(FingerprintEnvironment& env, FungeStackView&) {
+  env.hrti_mark_set = false;
+  return true;
+}
+
+static bool hrti_second(FingerprintEnvironment&, FungeStackView& s) {
+  s.push(now() % 1000000);
+  return true;
+}
+
+
+
+int64_t fingerprint_id(const string& name) {
+  int64_t id = 0;
+  for (char ch : name) {
+    id = (id << 8) + ch;
+  }
+  return id;
+}
+
+static Fingerprint make_fingerprint(const string& name,
+    const unordered_map<char, FingerprintSemantic>& semantics) {
+  return Fingerprint({fingerprint_id(name), name, semantics});
+}
+
+static FingerprintSemantic constant(int64_t value) {
+  return FingerprintSemantic(FingerprintSemantic::Type::PushConstant, value);
+}
+
+static FingerprintSemantic function(FingerprintFunction fn) {
+  return FingerprintSemantic(FingerprintSemantic::Type::CallFunction, 0, fn);
+}
+
+static unordered_map<int64_t, Fingerprint> create_fingerprints() {
+  vector<Fingerprint> fingerprints;
+
+  fingerprints.emplace_back(make_fingerprint("ROMA", {
+    {'I', constant(1)},
+    {'V', constant(5)},
+    {'X', constant(10)},
+    {'L', constant(50)},
+    {'C', constant(100)},
+    {'D', constant(500)},
+    {'M', constant(1000)},
+  }));
+
+  fingerprints.emplace_back(make_fingerprint("MODU", {
+    {'M', function(modu_signed)},
+    {'U', function(modu_unsigned)},
+    {'R', function(modu_remainder)},
+  }));
+
+  {
+    unordered_map<char, FingerprintSemantic> null_semantics;
+    for (char ch = 'A'; ch <= 'Z'; ch++) {
+      null_semantics.emplace(ch, FingerprintSemantic());
+    }
+    fingerprints.emplace_back(make_fingerprint("NULL", null_semantics));
+  }
+
+  fingerprints.emplace_back(make_fingerprint("FPDP", {
+    {'A', function(fpdp_add)},
+    {'B', function(fpdp_unary<sin>)},
+    {'C', function(fpdp_unary<cos>)},
+    {'D', function(fpdp_divide)},
+    {'E', function(fpdp_unary<asin>)},
+    {'F', function(fpdp_from_int)},
+    {'G', function(fpdp_unary<atan>)},
+    {'H', function(fpdp_unary<acos>)},
+    {'I', function(fpdp_to_int)},
+    {'K', function(fpdp_unary<log>)},
+    {'L', function(fpdp_unary<log10>)},
+    {'M', function(fpdp_multiply)},
+    {'N', function(fpdp_unary<fpdp_negate_value>)},
+    {'P', function(fpdp_print)},
+    {'Q', function(fpdp_unary<sqrt>)},
+    {'R', function(fpdp_from_string)},
+    {'S', function(fpdp_subtract)},
+    {'T', function(fpdp_unary<tan>)},
+    {'V', function(fpdp_unary<fabs>)},
+    {'X', function(fpdp_unary<exp>)},
+    {'Y', function(fpdp_power)},
+  }));
+
+  fingerprints.emplace_back(make_fingerprint("STRN", {
+    {'A', function(strn_append)},
+    {'C', function(strn_compare)},
+    {'D', function(strn_display)},
+    {'F', function(strn_find)},
+    {'G', function(strn_get)},
+    {'I', function(strn_input)},
+    {'L', function(strn_left)},
+    {'M', function(strn_middle)},
+    {'N', function(strn_length)},
+    {'P', function(strn_put)},
+    {'R', function(strn_right)},
+    {'S', function(strn_from_number)},
+    {'V', function(strn_to_number)},
+  }));
+
+  fingerprints.emplace_back(make_fingerprint("HRTI", {
+    {'G', function(hrti_granularity)},
+    {'M', function(hrti_mark)},
+    {'T', function(hrti_timer)},
+    {'E', function(hrti_erase_mark)},
+    {'S', function(hrti_second)},
+  }));
+
+  unordered_map<int64_t, Fingerprint> ret;
+  for (auto& fp : fingerprints) {
+    ret.emplace(fp.id, move(fp));
+  }
+  return ret;
+}
+
+const Fingerprint* find_fingerprint(int64_t id) {
+  static const unordered_map<int64_t, Fingerprint> fingerprints =
+      create_fingerprints();
+  auto it = fingerprints.find(id);
+  return (it == fingerprints.end()) ? NULL : &it->second;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Befunge.hh"
+
+
+
+// a view of a Funge stack as the compiled code stores it: top is the address of
+// the top item and end is the address of the bottom item (so the stack is empty
+// if top > end). popping from an empty stack yields zeroes. pushing writes
+// below top, so the caller must not be using that memory (native fingerprint
+// functions run on a separate stack for this reason)
+struct FungeStackView {
+  int64_t* top;
+  int64_t* end;
+
+  FungeStackView(int64_t* top, int64_t* end);
+
+  bool empty() const;
+  int64_t pop();
+  void push(int64_t value);
+
+  // strings are stored in 0gnirts order (first character on top)
+  std::string pop_string();
+  void push_string(const std::string& s);
+
+  // vectors are popped in reverse order (the last component is on top);
+  // components beyond the given dimension count are set to zero
+  void pop_vector(uint8_t dimensions, int64_t* x, int64_t* y, int64_t* z);
+};
+
+// everything a native fingerprint function can access other than the stack
+struct FingerprintEnvironment {
+  Field* field;
+  uint8_t dimensions;
+  int64_t storage_offset_x;
+  int64_t storage_offset_y;
+  int64_t storage_offset_z;
+
+  // HRTI state
+  bool hrti_mark_set;
+  uint64_t hrti_mark;
+
+  // cells written by the function (with zero delta). the caller must reset any
+  // compiled code that depends on them
+  std::vector<Position> modified_cells;
+
+  FingerprintEnvironment(Field* field, uint8_t dimensions);
+};
+
+// returns false if the instruction should reflect
+typedef bool (*FingerprintFunction)(FingerprintEnvironment& env,
+    FungeStackView& stack);
+
+struct FingerprintSemantic {
+  enum class Type {
+    Reflect = 0,
+    PushConstant,
+    CallFunction,
+  };
+
+  Type type;
+  int64_t value; // for PushConstant
+  FingerprintFunction function; // for CallFunction
+
+  FingerprintSemantic(Type type = Type::Reflect, int64_t value = 0,
+      FingerprintFunction function = NULL);
+};
+
+struct Fingerprint {
+  int64_t id;
+  std::string name;
+  // letters that aren't in this map aren't affected by loading the fingerprint
+  std::unordered_map<char, FingerprintSemantic> semantics;
+};
+
+// computes the id of a fingerprint the same way ( and ) do
+int64_t fingerprint_id(const std::string& name);
+
+// returns NULL if the fingerprint isn't implemented
+const Fingerprint* find_fingerprint(int64_t id);
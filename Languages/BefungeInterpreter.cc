@@ -2,10 +2,14 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include <phosg/Strings.hh>
-#include <map>
-#include <set>
+#include <phosg/Time.hh>
 #include <string>
 #include <vector>
 
@@ -15,272 +19,1415 @@ using namespace std;
 
 
 
-BefungeInterpreter::BefungeInterpreter(const string& filename,
-    uint8_t dimensions) : pos(0, 0, 0, 1, 0, 0), dimensions(dimensions) {
-  this->ss.push(Stack<int64_t>());
-  this->s = &this->ss.at(0);
+template <uint8_t Dimensions>
+const uint16_t BefungeInterpreter<Dimensions>::wrap_marker;
+
+// the same size compiled code uses for each thread's stack
+static const size_t stack_region_size = 0x1000000; // 16MB
+static const size_t stack_guard_size = 0x1000;
+
+template <uint8_t Dimensions>
+BefungeInterpreter<Dimensions>::StackRegion::StackRegion(size_t size) :
+    size(size) {
+  this->data = mmap(NULL, this->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (this->data == MAP_FAILED) {
+    throw runtime_error("can\'t allocate stack region");
+  }
+
+  // the lowest page is a guard, so a stack overflow crashes instead of
+  // silently corrupting memory
+  mprotect(this->data, stack_guard_size, PROT_NONE);
+}
+
+template <uint8_t Dimensions>
+BefungeInterpreter<Dimensions>::StackRegion::~StackRegion() {
+  munmap(this->data, this->size);
+}
+
+template <uint8_t Dimensions>
+BefungeInterpreter<Dimensions>::InstructionPointer::InstructionPointer(
+    int64_t id) : id(id), index(0), dx(1), dy(0), dz(0), stride(1), unit_delta(true),
+    string_mode(false), storage_offset{0, 0, 0},
+    region(new StackRegion(stack_region_size)) {
+  this->end_of_last_stack = reinterpret_cast<int64_t*>(
+      reinterpret_cast<uint8_t*>(this->region->data) + this->region->size) - 1;
+  this->stack_end = this->end_of_last_stack;
+  this->stack_top = this->stack_end + 1;
+}
+
+template <uint8_t Dimensions>
+BefungeInterpreter<Dimensions>::BefungeInterpreter(const string& filename,
+    uint64_t random_seed) : random(random_seed),
+    fingerprint_env(&this->field, Dimensions), current_ip(0), next_ip_id(1) {
   this->field = Field::load(filename);
+  this->rebuild_grid();
+
+  this->ips.emplace_back(new InstructionPointer(0));
+  this->set_position(*this->ips.back(), Position(0, 0, 0, 1, 0, 0));
+  this->set_delta(*this->ips.back(), 1, 0, 0);
 }
 
 
 
-void BefungeInterpreter::execute() {
-  for (;;) {
-    int16_t opcode = -1;
-    try {
-      opcode = this->field.get(pos.x, pos.y, pos.z);
-    } catch (const out_of_range&) { }
-
-    this->execute_opcode(opcode);
-  }
-}
-
-
-void BefungeInterpreter::execute_opcode(int16_t opcode) {
-  switch (opcode) {
-    case -1:
-      // boundary cell. figure out what's missing and fix it
-      throw invalid_argument(string_printf(
-          "interpreter executed boundary cell at x=%zd y=%zd z=%zd",
-          pos.x, pos.y, pos.z));
-
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-      this->s->push(opcode - '0');
-      break;
+static inline int64_t cell_value(uint16_t opcode) {
+  // cells are chars, so values read from the field are sign-extended, as in
+  // compiled code
+  return static_cast<char>(opcode);
+}
 
-    case 'a':
-    case 'b':
-    case 'c':
-    case 'd':
-    case 'e':
-    case 'f':
-      this->s->push(opcode - 'a' + 10);
-      break;
+static inline int64_t wrapping_add(int64_t a, int64_t b) {
+  return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+}
 
-    case '+':
-      this->s->push(this->s->pop() + this->s->pop());
-      break;
-    case '-': {
-      int64_t a = this->s->pop();
-      int64_t b = this->s->pop();
-      this->s->push(b - a);
-      break;
-    }
-    case '*':
-      this->s->push(this->s->pop() * this->s->pop());
-      break;
-    case '/': {
-      int64_t a = this->s->pop();
-      int64_t b = this->s->pop();
-      if (a == 0) {
-        this->s->push(0);
-      } else {
-        this->s->push(b / a);
-      }
-      break;
+static inline int64_t wrapping_sub(int64_t a, int64_t b) {
+  return static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b));
+}
+
+static inline int64_t wrapping_mul(int64_t a, int64_t b) {
+  return static_cast<int64_t>(static_cast<uint64_t>(a) * static_cast<uint64_t>(b));
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::execute() {
+  // opcodes are dispatched through these tables with computed gotos. string
+  // mode uses its own table, so it doesn't cost anything outside of strings
+  const void* handlers[0x101];
+  const void* string_handlers[0x101];
+  for (size_t x = 0; x < 0x101; x++) {
+    handlers[x] = &&op_reflect;
+    string_handlers[x] = &&op_string_char;
+  }
+  handlers[wrap_marker] = &&op_wrap;
+  string_handlers[wrap_marker] = &&op_wrap;
+  string_handlers[static_cast<uint8_t>('\"')] = &&op_string_end;
+  string_handlers[static_cast<uint8_t>(' ')] = &&op_string_space;
+
+  auto set_handler = [&](char ch, const void* label) {
+    handlers[static_cast<uint8_t>(ch)] = label;
+  };
+
+  set_handler(' ', &&op_space);
+  set_handler(';', &&op_jump_over);
+  for (size_t x = '0'; x <= '9'; x++) {
+    handlers[x] = &&op_digit;
+  }
+  for (size_t x = 'a'; x <= 'f'; x++) {
+    handlers[x] = &&op_hex_digit;
+  }
+  for (size_t x = 'A'; x <= 'Z'; x++) {
+    handlers[x] = &&op_letter;
+  }
+  set_handler('+', &&op_add);
+  set_handler('-', &&op_subtract);
+  set_handler('*', &&op_multiply);
+  set_handler('/', &&op_divide);
+  set_handler('%', &&op_modulus);
+  set_handler('!', &&op_not);
+  set_handler('`', &&op_greater);
+  set_handler(':', &&op_duplicate);
+  set_handler('\\', &&op_swap);
+  set_handler('$', &&op_discard);
+  set_handler('n', &&op_clear);
+  set_handler('>', &&op_east);
+  set_handler('<', &&op_west);
+  set_handler('?', &&op_random);
+  set_handler('_', &&op_horizontal_if);
+  set_handler('r', &&op_reverse);
+  set_handler('x', &&op_set_delta);
+  set_handler('#', &&op_trampoline);
+  set_handler('j', &&op_jump);
+  set_handler('k', &&op_iterate);
+  set_handler('z', &&op_nop);
+  set_handler('@', &&op_end);
+  set_handler('q', &&op_quit);
+  set_handler('\"', &&op_string_begin);
+  set_handler('\'', &&op_fetch);
+  set_handler('s', &&op_store);
+  set_handler('g', &&op_get);
+  set_handler('p', &&op_put);
+  set_handler('.', &&op_output_int);
+  set_handler(',', &&op_output_char);
+  set_handler('&', &&op_input_int);
+  set_handler('~', &&op_input_char);
+  set_handler('{', &&op_open_block);
+  set_handler('}', &&op_close_block);
+  set_handler('u', &&op_stack_under_stack);
+  set_handler('y', &&op_sysinfo);
+  set_handler('i', &&op_input_file);
+  set_handler('o', &&op_output_file);
+  set_handler('=', &&op_execute);
+  set_handler('(', &&op_load_fingerprint);
+  set_handler(')', &&op_unload_fingerprint);
+  set_handler('t', &&op_split);
+  if (Dimensions > 1) {
+    set_handler('^', &&op_north);
+    set_handler('v', &&op_south);
+    set_handler('|', &&op_vertical_if);
+    set_handler('[', &&op_turn_left);
+    set_handler(']', &&op_turn_right);
+    set_handler('w', &&op_compare);
+  }
+  if (Dimensions > 2) {
+    set_handler('h', &&op_high);
+    set_handler('l', &&op_low);
+    set_handler('m', &&op_depth_if);
+  }
+
+  // the current IP's most-used state is kept in locals. it's written back to
+  // the IP before calling anything that uses it and reloaded afterward
+  InstructionPointer* ip;
+  const uint16_t* cells;
+  const void** dispatch;
+  size_t index;
+  int64_t stride;
+  int64_t* top;
+  int64_t* end;
+  bool far; // the delta isn't a unit delta, so moves need bounds checks
+  uint16_t opcode;
+
+  // slow is true if anything other than moving forward must happen between
+  // instructions: switching IPs, or continuing an iterated instruction
+  bool slow;
+  int64_t iterate_count = 0;
+  uint16_t iterate_opcode = 0;
+  // for kk: the number of times the inner k has yet to run, and its index
+  int64_t iterate_k_count = 0;
+  size_t iterate_k_index = 0;
+
+#define POP() ((top <= end) ? *(top++) : 0)
+#define PUSH(v) (*(--top) = (v))
+
+#define SAVE_STATE() do { \
+    ip->index = index; \
+    ip->stride = stride; \
+    ip->stack_top = top; \
+    ip->stack_end = end; \
+  } while (0)
+
+#define RELOAD_STATE() do { \
+    cells = this->grid.data(); \
+    index = ip->index; \
+    stride = ip->stride; \
+    top = ip->stack_top; \
+    end = ip->stack_end; \
+    far = !ip->unit_delta; \
+  } while (0)
+
+#define LOAD_IP() do { \
+    ip = this->ips[this->current_ip].get(); \
+    dispatch = ip->string_mode ? string_handlers : handlers; \
+    slow = (this->ips.size() > 1) || iterate_count; \
+    RELOAD_STATE(); \
+  } while (0)
+
+#define DISPATCH() do { \
+    opcode = cells[index]; \
+    goto *dispatch[opcode]; \
+  } while (0)
+
+#define MOVE() do { \
+    if (__builtin_expect(far, 0)) { \
+      ip->index = index; \
+      this->move(*ip); \
+      index = ip->index; \
+    } else { \
+      index += stride; \
+    } \
+  } while (0)
+
+  // after moving with a unit delta, the IP may be on the border
+#define MOVE_WRAPPED() do { \
+    MOVE(); \
+    if (cells[index] == wrap_marker) { \
+      ip->index = index; \
+      this->wrap(*ip); \
+      index = ip->index; \
+    } \
+  } while (0)
+
+  // ends an instruction (which takes one tick)
+#define NEXT() do { \
+    if (__builtin_expect(slow, 0)) { \
+      goto finish_slow; \
+    } \
+    MOVE(); \
+    DISPATCH(); \
+  } while (0)
+
+#define SET_DELTA(new_dx, new_dy, new_dz, new_stride) do { \
+    ip->dx = (new_dx); \
+    ip->dy = (new_dy); \
+    ip->dz = (new_dz); \
+    ip->unit_delta = true; \
+    stride = (new_stride); \
+    far = false; \
+  } while (0)
+
+#define REFLECT() do { \
+    ip->dx = -ip->dx; \
+    ip->dy = -ip->dy; \
+    ip->dz = -ip->dz; \
+    stride = -stride; \
+  } while (0)
+
+  LOAD_IP();
+  DISPATCH();
+
+finish_slow:
+  if (iterate_count) {
+    if (--iterate_count) {
+      opcode = iterate_opcode;
+      goto *handlers[opcode];
     }
-    case '%': {
-      int64_t a = this->s->pop();
-      int64_t b = this->s->pop();
-      if (a == 0) {
-        this->s->push(0);
-      } else {
-        this->s->push(b % a);
-      }
-      break;
+    if (iterate_k_count) {
+      goto iterate_inner_k;
     }
+    slow = (this->ips.size() > 1);
+  }
+  if (this->ips.size() > 1) {
+    SAVE_STATE();
+    this->current_ip = (this->current_ip + 1) % this->ips.size();
+    LOAD_IP();
+  }
+  MOVE();
+  DISPATCH();
 
-    case '!': // logical not
-      this->s->push(!this->s->pop());
-      break;
+op_wrap: // zero ticks
+  ip->index = index;
+  this->wrap(*ip);
+  index = ip->index;
+  DISPATCH();
 
-    case '`': {
-      int64_t a = this->s->pop();
-      int64_t b = this->s->pop();
-      this->s->push(b > a);
-      break;
-    }
+op_space: // zero ticks
+  MOVE();
+  DISPATCH();
+
+op_jump_over: // zero ticks
+  do {
+    MOVE_WRAPPED();
+  } while (cells[index] != ';');
+  MOVE();
+  DISPATCH();
+
+op_digit:
+  PUSH(opcode - '0');
+  NEXT();
+
+op_hex_digit:
+  PUSH(opcode - 'a' + 10);
+  NEXT();
+
+op_add: {
+  int64_t a = POP();
+  int64_t b = POP();
+  PUSH(wrapping_add(b, a));
+  NEXT();
+}
+
+op_subtract: {
+  int64_t a = POP();
+  int64_t b = POP();
+  PUSH(wrapping_sub(b, a));
+  NEXT();
+}
+
+op_multiply: {
+  int64_t a = POP();
+  int64_t b = POP();
+  PUSH(wrapping_mul(b, a));
+  NEXT();
+}
+
+op_divide: { // division by zero pushes zero
+  int64_t a = POP();
+  int64_t b = POP();
+  PUSH((a == 0) ? 0 : ((a == -1) ? wrapping_sub(0, b) : (b / a)));
+  NEXT();
+}
+
+op_modulus: {
+  int64_t a = POP();
+  int64_t b = POP();
+  PUSH(((a == 0) || (a == -1)) ? 0 : (b % a));
+  NEXT();
+}
+
+op_not: {
+  int64_t a = POP();
+  PUSH(!a);
+  NEXT();
+}
+
+op_greater: {
+  int64_t a = POP();
+  int64_t b = POP();
+  PUSH(b > a);
+  NEXT();
+}
+
+op_duplicate: {
+  int64_t a = POP();
+  PUSH(a);
+  PUSH(a);
+  NEXT();
+}
+
+op_swap: {
+  int64_t a = POP();
+  int64_t b = POP();
+  PUSH(a);
+  PUSH(b);
+  NEXT();
+}
+
+op_discard:
+  if (top <= end) {
+    top++;
+  }
+  NEXT();
+
+op_clear:
+  top = end + 1;
+  NEXT();
+
+op_east:
+  SET_DELTA(1, 0, 0, 1);
+  NEXT();
 
-    case '<': // move left
-      pos.face(-1, 0, 0);
+op_west:
+  SET_DELTA(-1, 0, 0, -1);
+  NEXT();
+
+op_north:
+  SET_DELTA(0, -1, 0, -this->grid_w);
+  NEXT();
+
+op_south:
+  SET_DELTA(0, 1, 0, this->grid_w);
+  NEXT();
+
+op_high:
+  SET_DELTA(0, 0, -1, -(this->grid_w * this->grid_h));
+  NEXT();
+
+op_low:
+  SET_DELTA(0, 0, 1, (this->grid_w * this->grid_h));
+  NEXT();
+
+op_random:
+  // this order matches compiled code's
+  switch (this->random.next_below(Dimensions * 2)) {
+    case 0:
+      SET_DELTA(-1, 0, 0, -1);
       break;
-    case '>': // move right
-      pos.face(1, 0, 0);
+    case 1:
+      SET_DELTA(1, 0, 0, 1);
       break;
-    case '^': // move up
-      if (this->dimensions < 2) {
-        throw runtime_error("opcode only implemented in 2 or more dimensions");
-      }
-      pos.face(0, -1, 0);
+    case 2:
+      SET_DELTA(0, -1, 0, -this->grid_w);
       break;
-    case 'v': // move down
-      if (this->dimensions < 2) {
-        throw runtime_error("opcode only implemented in 2 or more dimensions");
-      }
-      pos.face(0, 1, 0);
+    case 3:
+      SET_DELTA(0, 1, 0, this->grid_w);
       break;
-    case '[': // turn left
-      if (this->dimensions < 2) {
-        throw runtime_error("opcode only implemented in 2 or more dimensions");
-      }
-      pos.turn_left();
+    case 4:
+      SET_DELTA(0, 0, -1, -(this->grid_w * this->grid_h));
       break;
-    case ']': // turn right
-      if (this->dimensions < 2) {
-        throw runtime_error("opcode only implemented in 2 or more dimensions");
-      }
-      pos.turn_right();
+    case 5:
+      SET_DELTA(0, 0, 1, (this->grid_w * this->grid_h));
       break;
+  }
+  NEXT();
 
-    case '?': // move randomly
-      switch (rand() % (this->dimensions * 2)) {
-        case 0:
-          pos.face(-1, 0, 0);
-          break;
-        case 1:
-          pos.face(1, 0, 0);
-          break;
-        case 2:
-          pos.face(0, -1, 0);
-          break;
-        case 3:
-          pos.face(0, 1, 0);
-          break;
-        case 4:
-          pos.face(0, 0, 1);
-          break;
-        case 5:
-          pos.face(0, 0, -1);
-          break;
-      }
-      break;
+op_horizontal_if: { // right if zero, left if not
+  int64_t a = POP();
+  if (a) {
+    SET_DELTA(-1, 0, 0, -1);
+  } else {
+    SET_DELTA(1, 0, 0, 1);
+  }
+  NEXT();
+}
 
-    case '_': // right if zero, left if not
-      pos.face(this->s->pop() ? -1 : 1, 0, 0);
-      break;
+op_vertical_if: { // down if zero, up if not
+  int64_t a = POP();
+  if (a) {
+    SET_DELTA(0, -1, 0, -this->grid_w);
+  } else {
+    SET_DELTA(0, 1, 0, this->grid_w);
+  }
+  NEXT();
+}
 
-    case '|': // down if zero, up if not
-      if (this->dimensions < 2) {
-        throw runtime_error("opcode only implemented in 2 or more dimensions");
-      }
-      pos.face(0, this->s->pop() ? -1 : 1, 0);
+op_depth_if: { // below if zero, above if not
+  int64_t a = POP();
+  if (a) {
+    SET_DELTA(0, 0, -1, -(this->grid_w * this->grid_h));
+  } else {
+    SET_DELTA(0, 0, 1, (this->grid_w * this->grid_h));
+  }
+  NEXT();
+}
+
+op_turn_left: {
+  Position p = Position(0, 0, 0, ip->dx, ip->dy, ip->dz).turn_left();
+  this->set_delta(*ip, p.dx, p.dy, p.dz);
+  stride = ip->stride;
+  NEXT();
+}
+
+op_turn_right: {
+  Position p = Position(0, 0, 0, ip->dx, ip->dy, ip->dz).turn_right();
+  this->set_delta(*ip, p.dx, p.dy, p.dz);
+  stride = ip->stride;
+  NEXT();
+}
+
+op_compare: { // turn left if less, right if greater
+  int64_t b = POP();
+  int64_t a = POP();
+  if (a != b) {
+    Position p(0, 0, 0, ip->dx, ip->dy, ip->dz);
+    if (a < b) {
+      p.turn_left();
+    } else {
+      p.turn_right();
+    }
+    this->set_delta(*ip, p.dx, p.dy, p.dz);
+    stride = ip->stride;
+  }
+  NEXT();
+}
+
+op_reverse:
+  REFLECT();
+  NEXT();
+
+op_reflect: // unimplemented opcodes act like r
+  REFLECT();
+  NEXT();
+
+op_set_delta: {
+  int64_t dz = (Dimensions > 2) ? POP() : 0;
+  int64_t dy = (Dimensions > 1) ? POP() : 0;
+  int64_t dx = POP();
+  this->set_delta(*ip, dx, dy, dz);
+  stride = ip->stride;
+  far = !ip->unit_delta;
+  NEXT();
+}
+
+op_trampoline:
+  MOVE_WRAPPED();
+  NEXT();
+
+op_jump: {
+  int64_t distance = POP();
+  ip->index = index;
+  this->move(*ip, distance);
+  index = ip->index;
+  NEXT();
+}
+
+op_iterate: {
+  int64_t count = POP();
+
+  // find the instruction to iterate, skipping spaces and ;-delimited regions
+  // (which take no time). the instruction executes with the IP on the k
+  size_t k_index = index;
+  bool in_semicolon = false;
+  for (;;) {
+    MOVE_WRAPPED();
+    if (cells[index] == ';') {
+      in_semicolon = !in_semicolon;
+    } else if (!in_semicolon && (cells[index] != ' ')) {
       break;
+    }
+  }
 
-    case '\"': { // push an entire string
-      pos.move_forward();
-      for (;;) {
-        int16_t value = this->field.get(pos.x, pos.y, pos.z);
-        if (value == '\"') {
-          break;
-        }
+  // zero and negative counts skip the instruction
+  if (count <= 0) {
+    NEXT();
+  }
+  opcode = cells[index];
+  if (opcode == 'k') {
+    // each iteration of the inner k pops its own count and iterates the
+    // instruction after it, still with the IP on the outer k
+    iterate_k_count = count;
+    iterate_k_index = index;
+    index = k_index;
+    goto iterate_inner_k;
+  }
+  index = k_index;
+  iterate_count = count;
+  iterate_opcode = opcode;
+  slow = true;
+  goto *handlers[opcode];
+}
+
+iterate_inner_k: {
+  size_t k_index = index;
+  while (iterate_k_count) {
+    iterate_k_count--;
+    int64_t count = POP();
+    if (count <= 0) {
+      continue;
+    }
 
-        this->s->push(value);
-        pos.move_forward();
+    index = iterate_k_index;
+    bool in_semicolon = false;
+    for (;;) {
+      MOVE_WRAPPED();
+      if (cells[index] == ';') {
+        in_semicolon = !in_semicolon;
+      } else if (!in_semicolon && (cells[index] != ' ')) {
+        break;
       }
+    }
+    if (cells[index] == 'k') {
+      throw runtime_error("k cannot iterate kk");
+    }
+    opcode = cells[index];
+    index = k_index;
+    iterate_count = count;
+    iterate_opcode = opcode;
+    slow = true;
+    goto *handlers[opcode];
+  }
+  index = k_index;
+  slow = (this->ips.size() > 1);
+  NEXT();
+}
+
+op_nop:
+  NEXT();
 
-      // pos now points to the terminal quote; we'll automatically move
-      // forward after this loop
+op_end:
+  // this only ends the current IP, unless it's the last one
+  iterate_count = 0;
+  iterate_k_count = 0;
+  this->ips.erase(this->ips.begin() + this->current_ip);
+  if (this->ips.empty()) {
+    return;
+  }
+  this->current_ip %= this->ips.size();
+  LOAD_IP();
+  MOVE();
+  DISPATCH();
+
+op_quit: {
+  int64_t code = POP();
+  fflush(stdout);
+  exit(code);
+}
+
+op_string_begin:
+  ip->string_mode = true;
+  dispatch = string_handlers;
+  NEXT();
+
+op_string_end:
+  ip->string_mode = false;
+  dispatch = handlers;
+  NEXT();
+
+op_string_char:
+  PUSH(cell_value(opcode));
+  NEXT();
+
+op_string_space:
+  // consecutive spaces are pushed as a single space, which takes one tick
+  PUSH(' ');
+  for (;;) {
+    size_t prev_index = index;
+    MOVE_WRAPPED();
+    if (cells[index] != ' ') {
+      index = prev_index;
       break;
     }
+  }
+  NEXT();
+
+op_fetch:
+  MOVE_WRAPPED();
+  PUSH(cell_value(cells[index]));
+  NEXT();
+
+op_store: {
+  MOVE_WRAPPED();
+  int64_t value = POP();
+  SAVE_STATE();
+  Position p = this->grid_position(*ip);
+  this->write_cell(p.x, p.y, p.z, value);
+  RELOAD_STATE();
+  NEXT();
+}
+
+op_get: {
+  int64_t z = (Dimensions > 2) ? POP() : 0;
+  int64_t y = (Dimensions > 1) ? POP() : 0;
+  int64_t x = POP();
+  x += ip->storage_offset[0];
+  y += ip->storage_offset[1];
+  z += ip->storage_offset[2];
+  if ((x >= 0) && (y >= 0) && (z >= 0) &&
+      (x < this->grid_w - 2) && (y < this->grid_h - 2) &&
+      (z < this->grid_d - 2 * this->z_border)) {
+    PUSH(cell_value(cells[this->grid_index(x, y, z)]));
+  } else {
+    int64_t value = this->field.get(x, y, z);
+    PUSH(value);
+  }
+  NEXT();
+}
+
+op_put: {
+  int64_t z = (Dimensions > 2) ? POP() : 0;
+  int64_t y = (Dimensions > 1) ? POP() : 0;
+  int64_t x = POP();
+  int64_t value = POP();
+  SAVE_STATE();
+  this->write_cell(x + ip->storage_offset[0], y + ip->storage_offset[1],
+      z + ip->storage_offset[2], value);
+  RELOAD_STATE();
+  NEXT();
+}
+
+op_output_int: {
+  int64_t a = POP();
+  printf("%" PRId64 " ", a);
+  NEXT();
+}
+
+op_output_char: {
+  int64_t a = POP();
+  putchar(a);
+  NEXT();
+}
+
+op_input_int: { // at end of input, these act like r
+  int64_t value;
+  if (scanf("%" PRId64, &value) < 1) {
+    REFLECT();
+  } else {
+    PUSH(value);
+  }
+  NEXT();
+}
+
+op_input_char: {
+  int ch = getchar();
+  if (ch == EOF) {
+    REFLECT();
+  } else {
+    PUSH(ch);
+  }
+  NEXT();
+}
+
+op_open_block:
+  SAVE_STATE();
+  this->open_block(*ip);
+  RELOAD_STATE();
+  NEXT();
+
+op_close_block:
+  SAVE_STATE();
+  if (!this->close_block(*ip)) {
+    REFLECT();
+    ip->stride = stride;
+  }
+  RELOAD_STATE();
+  NEXT();
 
-    case ';': { // skip over a segment
-      pos.move_forward();
-      for (;;) {
-        int16_t value = this->field.get(pos.x, pos.y, pos.z);
-        if (value == ';') {
-          break;
+op_stack_under_stack:
+  SAVE_STATE();
+  if (!this->stack_under_stack(*ip)) {
+    REFLECT();
+    ip->stride = stride;
+  }
+  RELOAD_STATE();
+  NEXT();
+
+op_sysinfo:
+  SAVE_STATE();
+  this->push_sysinfo(*ip);
+  RELOAD_STATE();
+  NEXT();
+
+op_input_file:
+  SAVE_STATE();
+  if (!this->read_file(*ip)) {
+    REFLECT();
+    ip->stride = stride;
+  }
+  RELOAD_STATE();
+  NEXT();
+
+op_output_file:
+  SAVE_STATE();
+  if (!this->write_file(*ip)) {
+    REFLECT();
+    ip->stride = stride;
+  }
+  RELOAD_STATE();
+  NEXT();
+
+op_execute:
+  SAVE_STATE();
+  this->execute_command(*ip);
+  RELOAD_STATE();
+  NEXT();
+
+op_load_fingerprint:
+  SAVE_STATE();
+  if (!this->load_fingerprint(*ip)) {
+    REFLECT();
+    ip->stride = stride;
+  }
+  RELOAD_STATE();
+  NEXT();
+
+op_unload_fingerprint:
+  SAVE_STATE();
+  if (!this->unload_fingerprint(*ip)) {
+    REFLECT();
+    ip->stride = stride;
+  }
+  RELOAD_STATE();
+  NEXT();
+
+op_letter:
+  SAVE_STATE();
+  if (!this->execute_letter(*ip, opcode)) {
+    REFLECT();
+    ip->stride = stride;
+  }
+  RELOAD_STATE();
+  NEXT();
+
+op_split:
+  SAVE_STATE();
+  this->fork_ip(*ip);
+  slow = true;
+  NEXT();
+
+#undef POP
+#undef PUSH
+#undef SAVE_STATE
+#undef RELOAD_STATE
+#undef LOAD_IP
+#undef DISPATCH
+#undef MOVE
+#undef MOVE_WRAPPED
+#undef NEXT
+#undef SET_DELTA
+#undef REFLECT
+}
+
+
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::rebuild_grid() {
+  // the IPs' indexes refer to the old grid, so get their positions first
+  vector<Position> ip_positions;
+  for (const auto& ip : this->ips) {
+    ip_positions.emplace_back(this->grid_position(*ip));
+  }
+
+  this->z_border = (Dimensions > 2) ? 1 : 0;
+  this->grid_w = this->field.width() + 2;
+  this->grid_h = this->field.height() + 2;
+  this->grid_d = this->field.depth() + 2 * this->z_border;
+  this->grid.assign(this->grid_w * this->grid_h * this->grid_d, wrap_marker);
+
+  for (size_t z = 0; z < this->field.planes.size(); z++) {
+    const auto& plane = this->field.planes[z];
+    for (size_t y = 0; y < this->field.height(); y++) {
+      uint16_t* row = &this->grid[this->grid_index(0, y, z)];
+      size_t x = 0;
+      if (y < plane.size()) {
+        for (; x < plane[y].size(); x++) {
+          row[x] = static_cast<uint8_t>(plane[y][x]);
         }
-        pos.move_forward();
       }
+      for (; x < this->field.width(); x++) {
+        row[x] = ' ';
+      }
+    }
+  }
 
-      // pos now points to the terminal semicolon; we'll automatically move
-      // forward after this loop
-      break;
+  for (size_t x = 0; x < this->ips.size(); x++) {
+    auto& ip = *this->ips[x];
+    this->set_position(ip, ip_positions[x]);
+    this->set_delta(ip, ip.dx, ip.dy, ip.dz);
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::update_grid_cell(int64_t x, int64_t y,
+    int64_t z) {
+  this->grid[this->grid_index(x, y, z)] =
+      static_cast<uint8_t>(this->field.get(x, y, z));
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::write_cell(int64_t x, int64_t y, int64_t z,
+    int64_t value) {
+  // negative coordinates wrap around the field (as in Field::set); anything
+  // else outside the field makes it grow, so the grid has to be rebuilt
+  if (x < 0) {
+    x = this->field.wrap_x(x);
+  }
+  if (y < 0) {
+    y = this->field.wrap_y(y);
+  }
+  if (z < 0) {
+    z = this->field.wrap_z(z);
+  }
+  bool grows = (x >= static_cast<int64_t>(this->field.width())) ||
+      (y >= static_cast<int64_t>(this->field.height())) ||
+      (z >= static_cast<int64_t>(this->field.depth()));
+
+  this->field.set(x, y, z, value);
+  if (grows) {
+    this->rebuild_grid();
+  } else {
+    this->grid[this->grid_index(x, y, z)] = static_cast<uint8_t>(value);
+  }
+}
+
+template <uint8_t Dimensions>
+size_t BefungeInterpreter<Dimensions>::grid_index(int64_t x, int64_t y,
+    int64_t z) const {
+  return ((z + this->z_border) * this->grid_h + (y + 1)) * this->grid_w + (x + 1);
+}
+
+template <uint8_t Dimensions>
+Position BefungeInterpreter<Dimensions>::grid_position(
+    const InstructionPointer& ip) const {
+  int64_t row = ip.index / this->grid_w;
+  return Position((ip.index % this->grid_w) - 1, (row % this->grid_h) - 1,
+      (row / this->grid_h) - this->z_border, ip.dx, ip.dy, ip.dz);
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::set_position(InstructionPointer& ip,
+    const Position& pos) {
+  ip.index = this->grid_index(pos.x, pos.y, pos.z);
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::set_delta(InstructionPointer& ip,
+    int64_t dx, int64_t dy, int64_t dz) {
+  ip.dx = dx;
+  ip.dy = dy;
+  ip.dz = dz;
+  ip.stride = dx + this->grid_w * (dy + this->grid_h * dz);
+  ip.unit_delta = (dx >= -1) && (dx <= 1) && (dy >= -1) && (dy <= 1) &&
+      (dz >= -1) && (dz <= 1);
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::move(InstructionPointer& ip,
+    int64_t distance) {
+  Position pos = this->grid_position(ip);
+  pos.x += distance * ip.dx;
+  pos.y += distance * ip.dy;
+  pos.z += distance * ip.dz;
+  if (!pos.is_within_field(this->field)) {
+    pos.wrap_lahey(this->field);
+  }
+  this->set_position(ip, pos);
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::wrap(InstructionPointer& ip) {
+  Position pos = this->grid_position(ip);
+  pos.wrap_lahey(this->field);
+  this->set_position(ip, pos);
+}
+
+template <uint8_t Dimensions>
+int64_t BefungeInterpreter<Dimensions>::pop(InstructionPointer& ip) {
+  return (ip.stack_top <= ip.stack_end) ? *(ip.stack_top++) : 0;
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::push(InstructionPointer& ip,
+    int64_t value) {
+  *(--ip.stack_top) = value;
+}
+
+
+
+template <uint8_t Dimensions>
+int64_t BefungeInterpreter<Dimensions>::stack_space(
+    const InstructionPointer& ip, const int64_t* top) const {
+  const int64_t* bottom = reinterpret_cast<const int64_t*>(
+      reinterpret_cast<const uint8_t*>(ip.region->data) + stack_guard_size);
+  return top - bottom;
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::open_block(InstructionPointer& ip) {
+  int64_t count = this->pop(ip);
+  int64_t size = ip.stack_end + 1 - ip.stack_top;
+
+  // the items that remain on the current stack become the second stack. if
+  // the count is negative, that many zeroes are pushed onto it instead of
+  // transferring anything
+  int64_t transfer_count = (count > 0) ? min(count, size) : 0;
+
+  // everything below the second stack's top has to fit in the region; this is
+  // checked before anything moves (see BefungeJITCompiler::open_block)
+  int64_t available = this->stack_space(ip, ip.stack_top) - Dimensions - 3;
+  if ((count > 0) ? (count - transfer_count > available) : (count < -available)) {
+    throw runtime_error("stack is too large to open a block");
+  }
+
+  int64_t* second_stack_top = ip.stack_top + transfer_count;
+  if (count < 0) {
+    second_stack_top += count;
+    fill(second_stack_top, ip.stack_top, 0);
+  }
+
+  // the new stack goes below the second stack's top and the pointers to the
+  // old stack; only the transferred items are moved there
+  int64_t new_size = (count > 0) ? count : 0;
+  int64_t* new_end = second_stack_top - Dimensions - 3;
+  int64_t* new_top = new_end + 1 - new_size;
+  memmove(new_top, ip.stack_top, transfer_count * sizeof(int64_t));
+  fill(new_top + transfer_count, new_end + 1, 0);
+
+  // push the storage offset onto the second stack, and link the stacks
+  second_stack_top -= Dimensions;
+  for (uint8_t d = 0; d < Dimensions; d++) {
+    second_stack_top[Dimensions - d - 1] = ip.storage_offset[d];
+  }
+  new_end[1] = reinterpret_cast<int64_t>(ip.stack_end);
+  new_end[2] = reinterpret_cast<int64_t>(second_stack_top);
+
+  // the new storage offset is the position of the next cell
+  Position next_pos = this->grid_position(ip).move_forward();
+  ip.storage_offset[0] = next_pos.x;
+  ip.storage_offset[1] = next_pos.y;
+  ip.storage_offset[2] = next_pos.z;
+
+  ip.stack_top = new_top;
+  ip.stack_end = new_end;
+}
+
+template <uint8_t Dimensions>
+bool BefungeInterpreter<Dimensions>::close_block(InstructionPointer& ip) {
+  // if there's no second stack, reflect without popping anything
+  if (ip.stack_end == ip.end_of_last_stack) {
+    return false;
+  }
+
+  int64_t count = this->pop(ip);
+
+  // restore the storage offset from the second stack
+  FungeStackView second_stack(reinterpret_cast<int64_t*>(ip.stack_end[2]),
+      reinterpret_cast<int64_t*>(ip.stack_end[1]));
+  for (int8_t d = Dimensions - 1; d >= 0; d--) {
+    ip.storage_offset[d] = second_stack.pop();
+  }
+
+  if (count >= 0) {
+    // move the top count items onto the second stack in the same order,
+    // transferring zeroes for any that are missing
+    if (count > this->stack_space(ip, second_stack.top)) {
+      throw runtime_error("stack is too large to close the block");
     }
+    int64_t size = ip.stack_end + 1 - ip.stack_top;
+    int64_t transfer_count = min(count, size);
+    int64_t* new_top = second_stack.top - count;
+    memmove(new_top, ip.stack_top, transfer_count * sizeof(int64_t));
+    fill(new_top + transfer_count, second_stack.top, 0);
+    second_stack.top = new_top;
 
-    case ':': { // duplicate top of stack
-      int64_t i = this->s->pop();
-      this->s->push(i);
-      this->s->push(i);
-      break;
+  } else {
+    // discard -count items from the second stack
+    int64_t available = second_stack.end + 1 - second_stack.top;
+    second_stack.top += min(-count, available);
+  }
+
+  ip.stack_top = second_stack.top;
+  ip.stack_end = second_stack.end;
+  return true;
+}
+
+template <uint8_t Dimensions>
+bool BefungeInterpreter<Dimensions>::stack_under_stack(InstructionPointer& ip) {
+  if (ip.stack_end == ip.end_of_last_stack) {
+    return false;
+  }
+
+  int64_t count = this->pop(ip);
+  FungeStackView stack(ip.stack_top, ip.stack_end);
+  FungeStackView second_stack(reinterpret_cast<int64_t*>(ip.stack_end[2]),
+      reinterpret_cast<int64_t*>(ip.stack_end[1]));
+
+  // neither direction can move the current stack out of the region
+  int64_t space = this->stack_space(ip, stack.top);
+  if ((count > space) || (count < -space)) {
+    throw runtime_error("stack is too large to transfer items between stacks");
+  }
+
+  if (count > 0) {
+    for (; count > 0; count--) {
+      stack.push(second_stack.pop());
     }
 
-    case '\\': { // swap top 2 items on stack
-      int64_t a = this->s->pop();
-      int64_t b = this->s->pop();
-      this->s->push(a);
-      this->s->push(b);
-      break;
+  } else if (count < 0) {
+    // if there isn't enough unused space between the stacks, move the current
+    // stack down to make some (see BefungeJITCompiler::stack_under_stack)
+    int64_t available = second_stack.top - (stack.end + 3);
+    if (available < -count) {
+      int64_t size = stack.end + 1 - stack.top;
+      int64_t shift = -count - available + size + 0x10;
+      if (shift > space) {
+        throw runtime_error("stack is too large to transfer items between stacks");
+      }
+      memmove(stack.top - shift, stack.top,
+          (stack.end + 3 - stack.top) * sizeof(int64_t));
+      stack.top -= shift;
+      stack.end -= shift;
     }
+    for (; count < 0; count++) {
+      *(--second_stack.top) = stack.pop();
+    }
+  }
 
-    case '$': // discard top of stack
-      this->s->pop();
-      break;
+  stack.end[2] = reinterpret_cast<int64_t>(second_stack.top);
+  ip.stack_top = stack.top;
+  ip.stack_end = stack.end;
+  return true;
+}
 
-    case '.': // pop and print as integer followed by space
-      printf("%" PRId64 " ", this->s->pop());
-      break;
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::push_sysinfo(InstructionPointer& ip) {
+  int64_t arg = this->pop(ip);
 
-    case ',': // pop and print as ascii character
-      putchar(this->s->pop());
-      break;
+  // the items are collected in order from the top of the stack (the same order
+  // as in compiled code). stack sizes are measured after popping the argument
+  vector<int64_t> items({
+      0x0F, // flags: t, i, o, and = are implemented; I/O is buffered
+      8, // bytes per cell
+      0x5555555555555555, // handprint
+      0, // version
+      1, // operating paradigm (system())
+      '/', // path separator
+      Dimensions,
+      ip.id,
+      0, // team number
+  });
 
-    case ' ': // skip this cell
-      break;
+  // vectors have their last component on top
+  auto add_vector = [&](int64_t x, int64_t y, int64_t z) {
+    int64_t components[3] = {x, y, z};
+    for (int8_t d = Dimensions - 1; d >= 0; d--) {
+      items.emplace_back(components[d]);
+    }
+  };
+  Position pos = this->grid_position(ip);
+  add_vector(pos.x, pos.y, pos.z);
+  add_vector(ip.dx, ip.dy, ip.dz);
+  add_vector(ip.storage_offset[0], ip.storage_offset[1], ip.storage_offset[2]);
+  ssize_t lx, ly, lz, gx, gy, gz;
+  this->field.get_bounds(&lx, &ly, &lz, &gx, &gy, &gz);
+  add_vector(lx, ly, lz);
+  add_vector(gx - lx, gy - ly, gz - lz);
 
-    case '#': // skip this cell and next cell
-      pos.move_forward();
-      break;
+  time_t t_secs = now() / 1000000;
+  struct tm t_parsed;
+  gmtime_r(&t_secs, &t_parsed);
+  items.emplace_back((t_parsed.tm_year << 16) | ((t_parsed.tm_mon + 1) << 8) |
+      t_parsed.tm_mday);
+  items.emplace_back((t_parsed.tm_hour << 16) | (t_parsed.tm_min << 8) |
+      t_parsed.tm_sec);
 
-    case 'p': { // write program space
-      int64_t z = (dimensions > 2) ? this->s->pop() : 0;
-      int64_t y = (dimensions > 1) ? this->s->pop() : 0;
-      int64_t x = this->s->pop();
-      int64_t v = this->s->pop();
-      this->field.set(x, y, z, v);
+  // the number of stacks, then the size of each one from the TOSS to the BOSS
+  vector<int64_t> stack_sizes;
+  const int64_t* top = ip.stack_top;
+  const int64_t* end = ip.stack_end;
+  for (;;) {
+    stack_sizes.emplace_back(end + 1 - top);
+    if (end == ip.end_of_last_stack) {
       break;
     }
+    top = reinterpret_cast<const int64_t*>(end[2]);
+    end = reinterpret_cast<const int64_t*>(end[1]);
+  }
+  items.emplace_back(stack_sizes.size());
+  items.insert(items.end(), stack_sizes.begin(), stack_sizes.end());
+
+  // argv and env are empty
+  items.insert(items.end(), 5, 0);
 
-    case 'g': // read program space
-      try {
-        int64_t z = (dimensions > 2) ? this->s->pop() : 0;
-        int64_t y = (dimensions > 1) ? this->s->pop() : 0;
-        int64_t x = this->s->pop();
-        this->s->push(this->field.get(x, y, z));
-      } catch (const out_of_range&) {
-        this->s->push(' ');
+  if (arg > 0) {
+    // items beyond the end of the sysinfo come from the stack below it
+    int64_t value;
+    if (static_cast<size_t>(arg) <= items.size()) {
+      value = items[arg - 1];
+    } else {
+      const int64_t* item = ip.stack_top + (arg - items.size() - 1);
+      value = (item <= ip.stack_end) ? *item : 0;
+    }
+    this->push(ip, value);
+  } else {
+    for (auto it = items.rbegin(); it != items.rend(); it++) {
+      this->push(ip, *it);
+    }
+  }
+}
+
+template <uint8_t Dimensions>
+bool BefungeInterpreter<Dimensions>::read_file(InstructionPointer& ip) {
+  FungeStackView stack(ip.stack_top, ip.stack_end);
+  string filename = stack.pop_string();
+  int64_t flags = stack.pop();
+  int64_t x, y, z;
+  stack.pop_vector(Dimensions, &x, &y, &z);
+  ip.stack_top = stack.top;
+
+  Field::Region r;
+  try {
+    r = this->field.load_region(filename, x + ip.storage_offset[0],
+        y + ip.storage_offset[1], z + ip.storage_offset[2], flags & 1);
+  } catch (const exception&) {
+    return false;
+  }
+  this->rebuild_grid();
+
+  // push va and vb, suitable for passing to o
+  this->push(ip, x);
+  if (Dimensions > 1) {
+    this->push(ip, y);
+    if (Dimensions > 2) {
+      this->push(ip, z);
+    }
+  }
+  this->push(ip, r.w);
+  if (Dimensions > 1) {
+    this->push(ip, r.h);
+    if (Dimensions > 2) {
+      this->push(ip, (r.w && r.h) ? 1 : 0);
+    }
+  }
+  return true;
+}
+
+template <uint8_t Dimensions>
+bool BefungeInterpreter<Dimensions>::write_file(InstructionPointer& ip) {
+  FungeStackView stack(ip.stack_top, ip.stack_end);
+  string filename = stack.pop_string();
+  int64_t flags = stack.pop();
+  int64_t x, y, z, w, h, d;
+  stack.pop_vector(Dimensions, &x, &y, &z);
+  stack.pop_vector(Dimensions, &w, &h, &d);
+  ip.stack_top = stack.top;
+  x += ip.storage_offset[0];
+  y += ip.storage_offset[1];
+  z += ip.storage_offset[2];
+  if (Dimensions < 2) {
+    h = 1;
+  }
+  if (Dimensions < 3) {
+    d = 1;
+  }
+
+  // in text mode (flags & 1), trailing spaces on each line and trailing
+  // newlines at the end of each plane are omitted. planes are separated by
+  // form feeds
+  string data;
+  for (int64_t plane_z = z; plane_z < z + d; plane_z++) {
+    if (plane_z != z) {
+      data.push_back('\f');
+    }
+    string plane_data;
+    for (int64_t line_y = y; line_y < y + h; line_y++) {
+      string line;
+      for (int64_t line_x = x; line_x < x + w; line_x++) {
+        line.push_back(this->field.get(line_x, line_y, plane_z));
       }
-      break;
+      if (flags & 1) {
+        while (!line.empty() && (line.back() == ' ')) {
+          line.pop_back();
+        }
+      }
+      plane_data += line;
+      plane_data.push_back('\n');
+    }
+    if (flags & 1) {
+      while ((plane_data.size() > 1) &&
+             (plane_data[plane_data.size() - 2] == '\n')) {
+        plane_data.pop_back();
+      }
+    }
+    data += plane_data;
+  }
 
-    case '&': { // push user-supplied number
-      int64_t i;
-      scanf("%" PRId64, &i);
-      this->s->push(i);
-      break;
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+  bool success = (fwrite(data.data(), 1, data.size(), f) == data.size());
+  fclose(f);
+  return success;
+}
+
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::execute_command(InstructionPointer& ip) {
+  FungeStackView stack(ip.stack_top, ip.stack_end);
+  string command = stack.pop_string();
+  ip.stack_top = stack.top;
+
+  // the command's output has to come after ours
+  fflush(stdout);
+  int ret = system(command.c_str());
+  this->push(ip, (ret == -1) ? -1 : WEXITSTATUS(ret));
+}
+
+static int64_t pop_fingerprint_id(FungeStackView& stack, bool* valid) {
+  int64_t count = stack.pop();
+  int64_t id = 0;
+  for (int64_t x = 0; x < count; x++) {
+    id = (id << 8) + stack.pop();
+  }
+  *valid = (count > 0);
+  return id;
+}
+
+template <uint8_t Dimensions>
+bool BefungeInterpreter<Dimensions>::load_fingerprint(InstructionPointer& ip) {
+  FungeStackView stack(ip.stack_top, ip.stack_end);
+  bool valid;
+  int64_t id = pop_fingerprint_id(stack, &valid);
+  ip.stack_top = stack.top;
+  const Fingerprint* fp = valid ? find_fingerprint(id) : NULL;
+  if (!fp) {
+    return false;
+  }
+
+  for (const auto& it : fp->semantics) {
+    ip.letter_semantics[it.first - 'A'].emplace_back(&it.second);
+  }
+
+  this->push(ip, id);
+  this->push(ip, 1);
+  return true;
+}
+
+template <uint8_t Dimensions>
+bool BefungeInterpreter<Dimensions>::unload_fingerprint(
+    InstructionPointer& ip) {
+  FungeStackView stack(ip.stack_top, ip.stack_end);
+  bool valid;
+  int64_t id = pop_fingerprint_id(stack, &valid);
+  ip.stack_top = stack.top;
+  const Fingerprint* fp = valid ? find_fingerprint(id) : NULL;
+  if (!fp) {
+    return false;
+  }
+
+  // this pops the letter's current semantic even if a different fingerprint
+  // loaded it, as the spec requires
+  for (const auto& it : fp->semantics) {
+    auto& semantics = ip.letter_semantics[it.first - 'A'];
+    if (!semantics.empty()) {
+      semantics.pop_back();
     }
+  }
+  return true;
+}
 
-    case '~': // push user-supplied character
-      this->s->push(getchar());
-      break;
+template <uint8_t Dimensions>
+bool BefungeInterpreter<Dimensions>::execute_letter(InstructionPointer& ip,
+    char letter) {
+  const auto& semantics = ip.letter_semantics[letter - 'A'];
+  if (semantics.empty()) {
+    return false;
+  }
+
+  const FingerprintSemantic* semantic = semantics.back();
+  switch (semantic->type) {
+    case FingerprintSemantic::Type::Reflect:
+      return false;
+
+    case FingerprintSemantic::Type::PushConstant:
+      this->push(ip, semantic->value);
+      return true;
+
+    case FingerprintSemantic::Type::CallFunction: {
+      FingerprintEnvironment& env = this->fingerprint_env;
+      env.storage_offset_x = ip.storage_offset[0];
+      env.storage_offset_y = ip.storage_offset[1];
+      env.storage_offset_z = ip.storage_offset[2];
+
+      size_t w = this->field.width();
+      size_t h = this->field.height();
+      size_t d = this->field.depth();
+
+      FungeStackView stack(ip.stack_top, ip.stack_end);
+      bool success = semantic->function(env, stack);
+      ip.stack_top = stack.top;
+
+      if ((w != this->field.width()) || (h != this->field.height()) ||
+          (d != this->field.depth())) {
+        this->rebuild_grid();
+      } else {
+        for (const auto& pos : env.modified_cells) {
+          this->update_grid_cell(pos.x, pos.y, pos.z);
+        }
+      }
+      env.modified_cells.clear();
+      return success;
+    }
+  }
+  return false;
+}
 
-    case '@': // end program
-      return;
+template <uint8_t Dimensions>
+void BefungeInterpreter<Dimensions>::fork_ip(InstructionPointer& ip) {
+  unique_ptr<InstructionPointer> child(new InstructionPointer(
+      this->next_ip_id++));
 
-    // TODO: implement stack debug opcode (Y)
+  // copy the entire stack-of-stacks to the same offset from the end of the
+  // child's region, relocating the pointers that link the stacks
+  uint8_t* region_end = reinterpret_cast<uint8_t*>(ip.region->data) +
+      ip.region->size;
+  uint8_t* child_region_end = reinterpret_cast<uint8_t*>(child->region->data) +
+      child->region->size;
+  int64_t delta = child_region_end - region_end;
+  uint8_t* top = reinterpret_cast<uint8_t*>(ip.stack_top);
+  memcpy(top + delta, top, region_end - top);
+  for (int64_t* end = ip.stack_end; end != ip.end_of_last_stack;) {
+    int64_t* links = reinterpret_cast<int64_t*>(
+        reinterpret_cast<uint8_t*>(end) + delta);
+    end = reinterpret_cast<int64_t*>(links[1]);
+    links[1] += delta;
+    links[2] += delta;
+  }
+  child->stack_top = reinterpret_cast<int64_t*>(
+      reinterpret_cast<uint8_t*>(ip.stack_top) + delta);
+  child->stack_end = reinterpret_cast<int64_t*>(
+      reinterpret_cast<uint8_t*>(ip.stack_end) + delta);
 
-    default:
-      throw invalid_argument(string_printf(
-          "can\'t interpret character %02hX '%c' at (%zd, %zd)", opcode,
-          opcode, pos.x, pos.y));
+  // the child moves in the opposite direction, and runs immediately after the
+  // parent in each tick
+  child->index = ip.index;
+  this->set_delta(*child, -ip.dx, -ip.dy, -ip.dz);
+  memcpy(child->storage_offset, ip.storage_offset, sizeof(ip.storage_offset));
+  for (size_t x = 0; x < 26; x++) {
+    child->letter_semantics[x] = ip.letter_semantics[x];
   }
-  pos.move_forward();
+  this->ips.emplace(this->ips.begin() + this->current_ip + 1, std::move(child));
 }
+
+
+
+template class BefungeInterpreter<1>;
+template class BefungeInterpreter<2>;
+template class BefungeInterpreter<3>;
@@ -1,54 +1,115 @@
 #pragma once
 
+#include <inttypes.h>
+
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "Befunge.hh"
+#include "BefungeFingerprints.hh"
 
+// the interpreter is specialized for each dimension count, so checks on the
+// dimension count fold away. BefungeInterpreter.cc instantiates it for 1, 2,
+// and 3 dimensions (Unefunge, Befunge, and Trefunge)
+template <uint8_t Dimensions>
 class BefungeInterpreter {
 public:
   explicit BefungeInterpreter(const std::string& filename,
-      uint8_t dimensions = 2);
+      uint64_t random_seed = 0);
   ~BefungeInterpreter() = default;
 
   void execute();
 
 private:
-  template <typename T> struct Stack {
-    std::vector<T> stack;
-
-    void push(const T& i) {
-      this->stack.emplace_back(i);
-    }
-
-    void push(T&& i) {
-      this->stack.emplace_back(std::move(i));
-    }
-
-    T pop() {
-      if (this->stack.empty()) {
-        return 0;
-      }
-      T i = std::move(this->stack.back());
-      this->stack.pop_back();
-      return i;
-    }
-
-    size_t size() const {
-      return this->stack.size();
-    }
-
-    T& at(size_t x) {
-      return this->stack.at(this->stack.size() - x - 1);
-    }
+  // each IP's stack-of-stacks lives in a fixed-size region, laid out the same
+  // way compiled code lays it out: stacks grow downward, the TOSS is from
+  // stack_top to stack_end (inclusive; empty if stack_top > stack_end), and
+  // each stack's end is followed by pointers to the end and top of the stack
+  // below it. the second stack's top holds the storage offset pushed by {
+  struct StackRegion {
+    void* data;
+    size_t size;
+
+    explicit StackRegion(size_t size);
+    ~StackRegion();
   };
 
-  Stack<Stack<int64_t>> ss;
-  Stack<int64_t>* s;
+  struct InstructionPointer {
+    int64_t id;
+
+    // the IP's cell in the grid. the delta's stride is the distance between
+    // grid indexes of consecutive cells along the delta
+    size_t index;
+    int64_t dx;
+    int64_t dy;
+    int64_t dz;
+    int64_t stride;
+    bool unit_delta; // all components are -1, 0, or 1
+    bool string_mode;
+
+    int64_t storage_offset[3];
+
+    std::unique_ptr<StackRegion> region;
+    int64_t* stack_top;
+    int64_t* stack_end;
+    int64_t* end_of_last_stack;
+
+    std::vector<const FingerprintSemantic*> letter_semantics[26];
+
+    explicit InstructionPointer(int64_t id);
+  };
 
   Field field;
-  Position pos;
-  uint8_t dimensions;
+  RandomGenerator random;
+  FingerprintEnvironment fingerprint_env;
+
+  // the field is mirrored in a flat grid of opcodes surrounded by a border of
+  // wrap markers, so moving the IP with a unit delta never needs a bounds
+  // check. in fewer than 3 dimensions, there's no border on the z axis
+  static const uint16_t wrap_marker = 0x100;
+  std::vector<uint16_t> grid;
+  int64_t grid_w;
+  int64_t grid_h;
+  int64_t grid_d;
+  int64_t z_border;
+
+  // IPs run in this order, one instruction each per tick
+  std::vector<std::unique_ptr<InstructionPointer>> ips;
+  size_t current_ip;
+  int64_t next_ip_id;
+
+  void rebuild_grid();
+  void update_grid_cell(int64_t x, int64_t y, int64_t z);
+  void write_cell(int64_t x, int64_t y, int64_t z, int64_t value);
+
+  size_t grid_index(int64_t x, int64_t y, int64_t z) const;
+  Position grid_position(const InstructionPointer& ip) const;
+  void set_position(InstructionPointer& ip, const Position& pos);
+  void set_delta(InstructionPointer& ip, int64_t dx, int64_t dy, int64_t dz);
+  // moves the IP distance cells along its delta, wrapping if needed
+  void move(InstructionPointer& ip, int64_t distance = 1);
+
+  // wraps an IP that just moved onto the border
+  void wrap(InstructionPointer& ip);
+
+  int64_t pop(InstructionPointer& ip);
+  void push(InstructionPointer& ip, int64_t value);
+
+  // the number of items that fit in the IP's stack region below top
+  int64_t stack_space(const InstructionPointer& ip, const int64_t* top) const;
 
-  void execute_opcode(int16_t opcode);
+  // these implement the opcodes that the dispatch loop doesn't handle inline.
+  // the ones that return bool return false if the IP should reflect
+  void open_block(InstructionPointer& ip);
+  bool close_block(InstructionPointer& ip);
+  bool stack_under_stack(InstructionPointer& ip);
+  void push_sysinfo(InstructionPointer& ip);
+  bool read_file(InstructionPointer& ip);
+  bool write_file(InstructionPointer& ip);
+  void execute_command(InstructionPointer& ip);
+  bool load_fingerprint(InstructionPointer& ip);
+  bool unload_fingerprint(InstructionPointer& ip);
+  bool execute_letter(InstructionPointer& ip, char letter);
+  void fork_ip(InstructionPointer& ip);
 };
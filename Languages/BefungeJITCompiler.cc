@@ -1,5 +1,10 @@
 #include "BefungeJITCompiler.hh"
 
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
 #include <phosg/Time.hh>
 
 using namespace std;
@@ -14,16 +19,101 @@ using namespace std;
 //       two or more items on the stack, rsp == r13 means exactly one item,
 //       rsp > r13 means the stack is empty.
 
+// native fingerprint functions run on this stack instead of the Funge stack
+static const size_t helper_stack_size = 0x800000; // 8MB
+
+// the space left below each Funge stack's limit for native calls made by
+// compiled code, and the size assumed for the main thread's stack if the
+// system doesn't limit it
+static const size_t stack_reserve_size = 0x40000; // 256KB
+static const size_t default_main_stack_size = 0x800000; // 8MB
+
+// cells whose compiled code is reset this many times by writes become volatile
+static const uint64_t volatile_cell_rewrite_threshold = 4;
+
+// the background compiler follows jumps at most this many cells beyond cells
+// that were compiled on the main thread
+static const size_t max_speculation_depth = 16;
+
+// free code blocks are split when reused only if the rest is at least this big
+static const size_t min_split_code_block_size = 0x20;
+
+// templates have this value plus the exit index where slot addresses go. it
+// has to be too large for a 32-bit immediate, so the templates use the same
+// instruction encoding that real slot addresses do
+static const int64_t opcode_template_placeholder = 0x7E5107E5107E0000;
+
+// string literals at least this long are pushed by a loop over data stored in
+// the cell's code, rather than by a push instruction for each value
+static const size_t min_string_copy_loop_length = 16;
+
+
+
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::BefungeJITCompiler(const string& filename,
+    uint64_t debug_flags, uint64_t random_seed, uint64_t jit_threshold,
+    bool speculative_compile, size_t max_code_size, bool precompile) :
+    debug_flags(debug_flags),
+    jit_threshold(jit_threshold), tiered(false), precompile(precompile),
+    eager_compile_queue(NULL),
+    field(Field::load(filename)), random(random_seed),
+    recording_template(NULL), cold_as(NULL), num_cold_paths(0), next_token(1),
+    concurrent(false), warned_about_late_t(false), current_thread(NULL),
+    main_thread_frame(NULL),
+    stack_limit(NULL),
+    next_thread_id(1), fingerprint_env(&this->field, Dimensions),
+    helper_stack(new uint8_t[helper_stack_size]),
+    helper_return_stack_end(NULL), hot_code(&this->buf),
+    cold_code(&this->cold_buf),
+    max_code_size(max_code_size), live_code_size(0),
+    eviction_clock_hand(this->compiled_cells.end()),
+    speculative_compile(speculative_compile),
+    current_speculation_depth(0), defer_dependency_updates(false),
+    speculative_compile_thread_should_exit(false) {
+
+  // concurrency adds a yield to almost every cell, so only enable it if the
+  // program can actually create threads
+  this->concurrent = this->field_contains_opcode(this->field, 't');
+
+  // suspended IPs and the debugger can resume in the middle of compiled cells,
+  // which the background compiler doesn't account for. tiered mode avoids
+  // compiling cells until they've run several times, which speculation would
+  // defeat
+  if (this->concurrent || this->jit_threshold ||
+      (this->debug_flags & DebugFlag::InteractiveDebug)) {
+    this->speculative_compile = false;
+  }
 
+  // the interpreter doesn't yield or call the debug hook, so cells are always
+  // compiled when either is needed
+  this->tiered = (this->jit_threshold > 0) && !this->concurrent &&
+      !(this->debug_flags & DebugFlag::InteractiveDebug);
 
-BefungeJITCompiler::BefungeJITCompiler(const string& filename,
-    uint8_t dimensions, uint64_t debug_flags) : dimensions(dimensions),
-    debug_flags(debug_flags), field(Field::load(filename)), next_token(1) {
-
-  if (dimensions < 1 || dimensions > 3) {
-    throw runtime_error("dimensions must be 1, 2, or 3");
+  // tiered mode exists to avoid compiling cells that don't run often, so it
+  // doesn't compile anything ahead of time
+  if (this->jit_threshold ||
+      (this->debug_flags & DebugFlag::InteractiveDebug)) {
+    this->precompile = false;
   }
 
+  // the special functions below refer to these, so they have to be in the
+  // common object table before the functions are assembled
+  this->add_common_object("this", this);
+  this->add_common_object("current_thread_ptr", &this->current_thread);
+  this->add_common_object("stack_limit_ptr", &this->stack_limit);
+  this->add_common_object("main_thread_frame_ptr", &this->main_thread_frame);
+  this->add_common_object("random_state_ptr", &this->random.state);
+  this->add_common_object("helper_return_stack_end_ptr",
+      &this->helper_return_stack_end);
+  this->add_common_object("dispatch_resume_thread",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_resume_thread));
+  this->add_common_object("dispatch_inline_cache_miss",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_inline_cache_miss));
+  this->add_common_object("dispatch_enter_slot",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_enter_slot));
+  this->add_common_object("helper_stack_top",
+      this->helper_stack.get() + helper_stack_size);
+
   // initialiy, all cells are just calls to the compiler. but watch out: these
   // compiler calls might overwrite the cell that called them, so they can't
   // call the compiler normally - instead, they return to this fragment that
@@ -41,16 +131,91 @@ BefungeJITCompiler::BefungeJITCompiler(const string& filename,
     as.write_label("jump_return_0");
     as.write_jmp(rax);
 
+    // switches to the next thread. rax is the address where the current thread
+    // should resume. if there's only one thread, just resume it immediately
+    as.write_label("yield");
+    as.write_mov(rcx, this->common_object_reference("current_thread_ptr"));
+    as.write_mov(rdx, MemoryReference(rcx, 0));
+    as.write_mov(r8, MemoryReference(rdx, offsetof(ThreadContext, next)));
+    as.write_cmp(r8, rdx);
+    as.write_jne("yield_switch");
+    as.write_jmp(rax);
+    as.write_label("yield_switch");
+    as.write_mov(MemoryReference(rdx, offsetof(ThreadContext, stack_top)), rsp);
+    as.write_mov(MemoryReference(rdx, offsetof(ThreadContext, frame)), rbp);
+    as.write_mov(MemoryReference(rdx, offsetof(ThreadContext, stack_end)), r13);
+    as.write_mov(MemoryReference(rdx, offsetof(ThreadContext, resume)), rax);
+    as.write_mov(MemoryReference(rcx, 0), r8);
+    as.write_mov(r9, MemoryReference(r8, offsetof(ThreadContext, stack_limit)));
+    as.write_mov(r10, this->common_object_reference("stack_limit_ptr"));
+    as.write_mov(MemoryReference(r10, 0), r9);
+    as.write_mov(rsp, MemoryReference(r8, offsetof(ThreadContext, stack_top)));
+    as.write_mov(rbp, MemoryReference(r8, offsetof(ThreadContext, frame)));
+    as.write_mov(r13, MemoryReference(r8, offsetof(ThreadContext, stack_end)));
+    as.write_jmp(MemoryReference(r8, offsetof(ThreadContext, resume)));
+
+    // threads whose resume address was invalidated (because the cell they
+    // were suspended in was recompiled) resume here instead. the thread's
+    // registers have already been restored by the yield function
+    as.write_label("resume_thread");
+    as.write_mov(rdi, this->common_object_reference("this"));
+    as.write_mov(rsi, this->common_object_reference("current_thread_ptr"));
+    as.write_mov(rsi, MemoryReference(rsi, 0));
+    this->write_function_call_unknown_alignment(as,
+        this->common_object_reference("dispatch_resume_thread"));
+    as.write_jmp(rax);
+
+    // inline caches jump here on a miss, with the cache in rax and the key in
+    // r8, r9, and r10. this isn't part of the calling cell's code, so it's safe
+    // for the miss handler to recompile that cell
+    as.write_label("inline_cache_miss");
+    as.write_mov(rdi, this->common_object_reference("this"));
+    as.write_mov(rsi, rax);
+    as.write_mov(rdx, r8);
+    as.write_mov(rcx, r9);
+    as.write_mov(r8, r10);
+    this->write_function_call_unknown_alignment(as,
+        this->common_object_reference("dispatch_inline_cache_miss"));
+    as.write_jmp(rax);
+
+    // native helpers return here (on the helper stack) with the new Funge
+    // stack top in rax and the next cell's address in rdx
+    as.write_label("helper_return");
+    as.write_mov(rsp, rax);
+    as.write_mov(rcx, this->common_object_reference("helper_return_stack_end_ptr"));
+    as.write_mov(r13, MemoryReference(rcx, 0));
+    as.write_jmp(rdx);
+
+    // jumps between cells go through the target cell's slot; the slots of
+    // cells that have no code point here. the slot's address is in rax. in
+    // tiered mode the target may be interpreted instead of compiled, so this
+    // calls dispatch_enter_slot on the helper stack
+    as.write_label("slot_trampoline");
+    as.write_mov(rdi, this->common_object_reference("this"));
+    as.write_mov(rsi, rax);
+    as.write_mov(rdx, rsp);
+    as.write_mov(rcx, r13);
+    as.write_mov(r8, rbp);
+    as.write_mov(rsp, this->common_object_reference("helper_stack_top"));
+    as.write_mov(rax, "helper_return");
+    as.write_push(rax);
+    as.write_jmp(this->common_object_reference("dispatch_enter_slot"));
+
     unordered_set<size_t> patch_offsets;
     multimap<size_t, string> label_offsets;
     string data = as.assemble(&patch_offsets, &label_offsets);
-    const void* executable = this->buf.append(data);
+    const void* executable = this->buf.append(data, &patch_offsets);
 
     // extract the function addresses from the assembled code
     this->jump_return_40 = NULL;
     this->jump_return_38 = NULL;
     this->jump_return_8 = NULL;
     this->jump_return_0 = NULL;
+    this->yield_function = NULL;
+    this->resume_thread_function = NULL;
+    this->helper_return_function = NULL;
+    this->inline_cache_miss_function = NULL;
+    this->slot_trampoline_function = NULL;
     for (const auto& it : label_offsets) {
       const void* addr = reinterpret_cast<const void*>(
           reinterpret_cast<const char*>(executable) + it.first);
@@ -62,6 +227,16 @@ BefungeJITCompiler::BefungeJITCompiler(const string& filename,
         this->jump_return_8 = addr;
       } else if (it.second == "jump_return_0") {
         this->jump_return_0 = addr;
+      } else if (it.second == "yield") {
+        this->yield_function = addr;
+      } else if (it.second == "resume_thread") {
+        this->resume_thread_function = addr;
+      } else if (it.second == "helper_return") {
+        this->helper_return_function = addr;
+      } else if (it.second == "inline_cache_miss") {
+        this->inline_cache_miss_function = addr;
+      } else if (it.second == "slot_trampoline") {
+        this->slot_trampoline_function = addr;
       }
     }
 
@@ -106,10 +281,15 @@ BefungeJITCompiler::BefungeJITCompiler(const string& filename,
   this->add_common_object("jump_return_8", this->jump_return_8);
   this->add_common_object("jump_return_0", this->jump_return_0);
   this->add_common_object("compress_string", this->compress_string_function);
-  this->add_common_object("dispatch_compile_cell",
-      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_compile_cell));
+  this->add_common_object("yield", this->yield_function);
+  this->add_common_object("helper_return",
+      this->helper_return_function);
+  this->add_common_object("inline_cache_miss",
+      this->inline_cache_miss_function);
   this->add_common_object("dispatch_get_cell_code",
       reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_get_cell_code));
+  this->add_common_object("dispatch_volatile_cell",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_volatile_cell));
   this->add_common_object("dispatch_interactive_debug_hook",
       reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_interactive_debug_hook));
   this->add_common_object("dispatch_field_read",
@@ -120,16 +300,44 @@ BefungeJITCompiler::BefungeJITCompiler(const string& filename,
       reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_file_read));
   this->add_common_object("dispatch_throw_error",
       reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_throw_error));
-  this->add_common_object("dispatch_get_sysinfo_hl",
-      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_get_sysinfo_hl));
+  this->add_common_object("dispatch_sysinfo",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_sysinfo));
+  this->add_common_object("dispatch_get_sysinfo_item",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_get_sysinfo_item));
+  this->add_common_object("dispatch_fork_thread",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_fork_thread));
+  this->add_common_object("dispatch_fork_threads",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_fork_threads));
+  this->add_common_object("dispatch_end_thread",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_end_thread));
+  this->add_common_object("dispatch_fingerprint",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_fingerprint));
+  this->add_common_object("dispatch_load_fingerprint",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_load_fingerprint));
+  this->add_common_object("dispatch_unload_fingerprint",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_unload_fingerprint));
+  this->add_common_object("dispatch_open_block",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_open_block));
+  this->add_common_object("dispatch_close_block",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_close_block));
+  this->add_common_object("dispatch_stack_under_stack",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_stack_under_stack));
+  this->add_common_object("dispatch_iterated_opcode",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_iterated_opcode));
+  this->add_common_object("dispatch_iterated_fingerprint",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_iterated_fingerprint));
+  this->add_common_object("dispatch_letter",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_letter));
+  this->add_common_object("dispatch_iterated_letter",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_iterated_letter));
+  this->add_common_object("dispatch_fill_stack",
+      reinterpret_cast<const void*>(&BefungeJITCompiler::dispatch_fill_stack));
   this->add_common_object("fputs", reinterpret_cast<const void*>(&fputs));
   this->add_common_object("getchar", reinterpret_cast<const void*>(&getchar));
   this->add_common_object("printf", reinterpret_cast<const void*>(&printf));
   this->add_common_object("putchar", reinterpret_cast<const void*>(&putchar));
-  this->add_common_object("rand", reinterpret_cast<const void*>(&rand));
   this->add_common_object("scanf", reinterpret_cast<const void*>(&scanf));
   this->add_common_object("stdout", reinterpret_cast<const void*>(stdout));
-  this->add_common_object("this", this);
 
   // execution enters the initial cell with the stack misaligned (since the call
   // to that code pushed the return address onto the stack implicitly)
@@ -137,11 +345,17 @@ BefungeJITCompiler::BefungeJITCompiler(const string& filename,
       forward_as_tuple());
 }
 
-void BefungeJITCompiler::set_breakpoint(const Position& pos) {
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::set_breakpoint(const Position& pos) {
   this->breakpoint_positions.emplace(pos);
 }
 
-void BefungeJITCompiler::execute() {
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::execute() {
+  if (this->precompile) {
+    this->precompile_reachable_cells();
+  }
+
   Position start_pos(1, false);
   CompiledCell& start_cell = this->compiled_cells[start_pos];
 
@@ -149,441 +363,255 @@ void BefungeJITCompiler::execute() {
     this->compile_cell(start_pos);
   }
 
-  void (*start)() = reinterpret_cast<void(*)()>(start_cell.code);
-  start();
-}
-
-void BefungeJITCompiler::check_dimensions(uint8_t required_dimensions,
-    const Position& where, int16_t opcode) const {
-  if (this->dimensions < required_dimensions) {
-    string where_str = where.str();
-    throw invalid_argument(string_printf(
-        "opcode %c (at %s) only valid in %hhu or more dimensions", opcode,
-        where_str.c_str(), required_dimensions));
+  // the main thread's Funge stack is the native stack, which can grow until
+  // it reaches the system's stack size limit. the stack already in use is
+  // much smaller than the reserved space, so this is measured from here
+  {
+    size_t main_stack_size = default_main_stack_size;
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_STACK, &limit) && (limit.rlim_cur != RLIM_INFINITY)) {
+      main_stack_size = limit.rlim_cur;
+    }
+    uint8_t stack_marker;
+    uintptr_t here = reinterpret_cast<uintptr_t>(&stack_marker);
+    this->stack_limit = reinterpret_cast<const void*>(here -
+        ((main_stack_size > stack_reserve_size) ?
+          (main_stack_size - stack_reserve_size) : 0));
   }
-}
-
-BefungeJITCompiler::CompiledCell::CompiledCell() : code(NULL), code_size(0),
-    buffer_capacity(0) { }
-BefungeJITCompiler::CompiledCell::CompiledCell(void* code, size_t code_size) :
-    code(code), code_size(code_size), buffer_capacity(code_size) { }
-BefungeJITCompiler::CompiledCell::CompiledCell(const Position& dependency) :
-    code(NULL), code_size(0), buffer_capacity(0),
-    address_dependencies({dependency}) { }
-
-void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
-    int16_t opcode) {
-
-  CompiledCell& cell = this->compiled_cells[pos];
-
-  switch (opcode) {
-    case -1:
-      throw logic_error(string_printf(
-          "attempted to compile boundary cell %zd %zd", pos.x, pos.y));
-
-    case '{': // open a new stack
-      // secondary stacks are implemented by pushing r13 and resetting it to
-      // create a "new" empty stack
-
-      // before this operation, the stack is:
-      // rsp=count e1 e2 ... en f1 f2 ... r13=fn
-      // if count >= 0, after this operation, the stacks are:
-      // rsp=e1 e2 ... r13=en oldr13 [[oldSOz] oldSOy] oldSOx f1 f2 ... fn
-      // if count < 0, after this operation, the stacks are:
-      // r13=? rsp=oldr13 [[oldSOz] oldSOy] oldSOx 0 0 ... 0 f1 f2 ... fn
-
-      // TODO: currently this is O(n); can we make it faster somehow?
-      // (also with '}')
-      as.write_cmp(rsp, r13);
-      as.write_jg("stack_empty");
-
-      // get the count and make space for the storage offset on the second stack
-      as.write_mov(rcx, MemoryReference(rsp, 0)); // item count to copy
-      as.write_cmp(rcx, 0);
-      as.write_jge("count_nonnegative");
-
-      // keep track of stack alignment, sigh. we flip the alignment flag here
-      // because we'll pop the count below. but in even dimensions, it flips
-      // again when we push the storage offset and old r13 value, so only flip
-      // for odd dimensions.
-      if (this->dimensions & 1) {
-        as.write_lea(r10, MemoryReference(rcx, 1));
-      } else {
-        as.write_mov(r10, rcx);
-      }
-      as.write_and(r10, 1);
-
-      // if the count is negative, push that many zeroes onto the stack
-      as.write_add(rsp, 8); // "pop" the count
-      as.write_label("push_zero_again");
-      as.write_push(0);
-      as.write_inc(rcx);
-      as.write_js("push_zero_again");
-
-      // push the storage offset and original r13
-      for (uint8_t dimension = 0; dimension < this->dimensions; dimension++) {
-        as.write_push(this->storage_offset_reference(dimension));
-      }
-      as.write_push(r13);
-      as.write_lea(r13, MemoryReference(rsp, -8));
-
-      // set the storage offset to the next cell position
-      {
-        Position next_pos = pos.copy().move_forward();
-        as.write_mov(this->storage_offset_reference(0), next_pos.x);
-        if (this->dimensions > 1) {
-          as.write_mov(this->storage_offset_reference(1), next_pos.y);
-          if (this->dimensions > 2) {
-            as.write_mov(this->storage_offset_reference(2), next_pos.z);
-          }
-        }
-      }
 
-      // jump to the correct cell based on the alignment change
-      as.write_test(r10b, 1);
-      as.write_jz("opcode_end_alignment_unchanged");
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward().change_alignment());
+  if (this->concurrent) {
+    ThreadContext* main_thread = new ThreadContext(0, 0);
+    main_thread->stack_limit = this->stack_limit;
+    main_thread->next = main_thread;
+    main_thread->prev = main_thread;
+    this->threads.emplace(0, unique_ptr<ThreadContext>(main_thread));
+    this->current_thread = main_thread;
+  }
 
-      // now the common case: the count is nonnegative. in this case, we'll copy
-      // some items from the currentstack onto the new stack. really this just
-      // means moving them down in memory a few spaces, pushing the storage
-      // offset, and setting r13 appropriately for the new stack. the old r13
-      // value "replaces" the item count on the stack, so we only need to
-      // reserve space for the storage offset.
-      as.write_label("count_nonnegative");
-      as.write_sub(rsp, 8 * this->dimensions);
-      as.write_lea(rcx, MemoryReference(rsp, -8, rcx, 8)); // new r13 value
-
-      // can't copy more items than exist on the stack
-      // TODO: implement this. it should push extra zeroes instead of failing
-      as.write_cmp(rcx, r13);
-      as.write_jle("count_not_excessive");
-      this->write_throw_error(as,
-          "open-block opcode executed with count greater than stack size");
-      as.write_label("count_not_excessive");
-
-      as.write_mov(rdx, rsp); // pointer to item being written
-      as.write_label("copy_again");
-      as.write_cmp(rdx, rcx);
-      as.write_jg("copy_done");
-      as.write_mov(rax, MemoryReference(rdx, 8 + 8 * this->dimensions));
-      as.write_mov(MemoryReference(rdx, 0), rax);
-      as.write_add(rdx, 8);
-      as.write_jmp("copy_again");
-      as.write_label("copy_done");
-
-      // now rdx points to the element past the end of the new stack. here we
-      // should write the old r13 value (to restore the old setack later) and
-      // the current storage offset (so it's on the top of the second stack)
-
-      // write the old r13 value between the stacks
-      as.write_mov(MemoryReference(rdx, 0), r13);
-
-      // copy the storage offset onto the top of the second stack
-      // TODO: this should probably be a loop, lolz. but maybe it's more clear
-      // like this
-      if (this->dimensions == 1) {
-        as.write_mov(rax, this->storage_offset_reference(0));
-        as.write_mov(MemoryReference(rdx, 8), rax);
-      } else if (this->dimensions == 2) {
-        as.write_mov(rax, this->storage_offset_reference(0));
-        as.write_mov(MemoryReference(rdx, 16), rax);
-        as.write_mov(rax, this->storage_offset_reference(1));
-        as.write_mov(MemoryReference(rdx, 8), rax);
-      } else { // 3D
-        as.write_mov(rax, this->storage_offset_reference(0));
-        as.write_mov(MemoryReference(rdx, 24), rax);
-        as.write_mov(rax, this->storage_offset_reference(1));
-        as.write_mov(MemoryReference(rdx, 16), rax);
-        as.write_mov(rax, this->storage_offset_reference(2));
-        as.write_mov(MemoryReference(rdx, 8), rax);
-      }
+  if (this->speculative_compile) {
+    this->start_speculative_compile_thread();
+  }
 
-      // set the storage offset to the next cell position
-      {
-        Position next_pos = pos.copy().move_forward();
-        as.write_mov(this->storage_offset_reference(0), next_pos.x);
-        if (this->dimensions > 1) {
-          as.write_mov(this->storage_offset_reference(1), next_pos.y);
-          if (this->dimensions > 2) {
-            as.write_mov(this->storage_offset_reference(2), next_pos.z);
-          }
-        }
-      }
+  void (*start)() = reinterpret_cast<void(*)()>(start_cell.code);
+  start();
 
-      // set the end-of-stack pointer appropriately
-      as.write_mov(r13, rcx);
+  this->stop_speculative_compile_thread();
+}
 
-      // alignment doesn't change in this case because we popped one item (the
-      // count) and pushed one "item" (the previous r13 value)
-      as.write_label("opcode_end_alignment_unchanged");
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward());
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::~BefungeJITCompiler() {
+  this->stop_speculative_compile_thread();
+}
 
-      {
-        as.write_label("stack_empty");
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::CompilerLock::CompilerLock(BefungeJITCompiler* c) :
+    lock(c->compiler_mutex, defer_lock) {
+  if (c->speculative_compile) {
+    this->lock.lock();
+  }
+}
 
-        Position next_pos = pos.copy().move_forward();
-        for (uint8_t dimension = 0; dimension < this->dimensions; dimension++) {
-          as.write_push(this->storage_offset_reference(dimension));
-        }
-        if (!(this->dimensions & 1)) {
-          next_pos.change_alignment();
-        }
-        as.write_push(r13);
-        as.write_lea(r13, MemoryReference(rsp, -8));
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::start_speculative_compile_thread() {
+  this->speculative_compile_thread_should_exit = false;
+  this->speculative_compile_thread = thread(
+      &BefungeJITCompiler::speculative_compile_thread_routine, this);
+}
 
-        // set the storage offset to the next cell position
-        // TODO: reduce code duplication with the above (non-empty stack) case
-        as.write_mov(this->storage_offset_reference(0), next_pos.x);
-        if (this->dimensions > 1) {
-          as.write_mov(this->storage_offset_reference(1), next_pos.y);
-          if (this->dimensions > 2) {
-            as.write_mov(this->storage_offset_reference(2), next_pos.z);
-          }
-        }
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::stop_speculative_compile_thread() {
+  if (!this->speculative_compile_thread.joinable()) {
+    return;
+  }
+  {
+    lock_guard<recursive_mutex> g(this->compiler_mutex);
+    this->speculative_compile_thread_should_exit = true;
+  }
+  this->speculative_compile_cv.notify_all();
+  this->speculative_compile_thread.join();
+}
 
-        this->write_jump_to_cell(as, pos, next_pos);
-      }
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::speculative_compile_thread_routine() {
+  unique_lock<recursive_mutex> lock(this->compiler_mutex);
+  for (;;) {
+    this->speculative_compile_cv.wait(lock, [&]() {
+      return this->speculative_compile_thread_should_exit ||
+          !this->speculative_compile_queue.empty();
+    });
+    if (this->speculative_compile_thread_should_exit) {
       break;
+    }
 
-    case '}':
-      // first check if the stack stack is empty. if so, reflect
-      as.write_lea(r8, this->end_of_last_stack_reference());
-      as.write_cmp(r13, r8);
-      as.write_jl("second_stack_exists");
-      this->write_jump_to_cell(as, pos, pos.copy().turn_around().move_forward());
-      as.write_label("second_stack_exists");
-
-      // before this operation, the stacks are:
-      // count e1 e2 ... en f1 f2 ... r13=fn oldr13 [[oldSOz] oldSOy] oldSOx g1 g2 ... oldr13=gn
-      // after this operation, the stack is:
-      // e1 e2 ... en g1 g2 ... r13=gn
-
-      // get the count of items to copy
-      as.write_cmp(rsp, r13);
-      as.write_jle("stack_one_item");
-      as.write_label("stack_empty");
-      as.write_xor(r11, r11);
-      as.write_jmp("transfer_items");
-      as.write_label("stack_one_item");
-      as.write_pop(r11);
-      as.write_label("transfer_items");
+    auto item = move(this->speculative_compile_queue.front());
+    this->speculative_compile_queue.pop_front();
+    auto cell_it = this->compiled_cells.find(item.first);
+    if ((cell_it != this->compiled_cells.end()) && cell_it->second.code) {
+      continue;
+    }
 
-      // restore the old storage offset. watch out: the second stack may be
-      // short or empty! we have to check for this before reading from it
-      as.write_lea(r8, MemoryReference(r13, 16)); // top of second stack
-      as.write_mov(r9, MemoryReference(r13, 8)); // end (last valid cell) of SS
-      as.write_xor(rax, rax);
-      as.write_xor(rcx, rcx);
-      if (this->dimensions == 1) {
-        as.write_cmp(r8, r9);
-        as.write_cmovle(rax, MemoryReference(r8, 0));
-        as.write_mov(this->storage_offset_reference(0), rax);
-      } else if (this->dimensions == 2) {
-        as.write_cmp(r8, r9);
-        as.write_cmovle(rax, MemoryReference(r8, 0));
-        as.write_mov(this->storage_offset_reference(1), rax);
-        as.write_cmovl(rcx, MemoryReference(r8, 8));
-        as.write_mov(this->storage_offset_reference(0), rcx);
-      } else { // 3D
-        as.write_cmp(r8, r9);
-        as.write_cmovle(rax, MemoryReference(r8, 0));
-        as.write_mov(this->storage_offset_reference(2), rax);
-        as.write_cmovl(rcx, MemoryReference(r8, 8));
-        as.write_mov(this->storage_offset_reference(1), rcx);
-
-        as.write_lea(rcx, MemoryReference(r8, 16));
-        as.write_cmp(rcx, r9);
-        as.write_xor(rax, rax);
-        as.write_cmovle(rax, MemoryReference(r8, 16));
-        as.write_mov(this->storage_offset_reference(0), rax);
+    this->defer_dependency_updates = true;
+    this->current_speculation_depth = item.second;
+    try {
+      this->compile_cell(item.first);
+    } catch (const exception& e) {
+      // the cell may never be executed; if it is, compiling it on the main
+      // thread will fail the same way
+      if (this->debug_flags & DebugFlag::ShowCompilationEvents) {
+        string pos_str = item.first.str();
+        fprintf(stderr, "speculative compilation of %s failed: %s\n",
+            pos_str.c_str(), e.what());
       }
+    }
+    this->defer_dependency_updates = false;
+    this->current_speculation_depth = 0;
 
-      // behavior is different if the count is negative vs. positive
-      as.write_cmp(r11, 0);
-      as.write_jge("count_nonnegative");
-
-      as.write_label("count_negative");
+    // let the main thread in if it's waiting
+    lock.unlock();
+    this_thread::yield();
+    lock.lock();
+  }
+}
 
-      // remove the top stack
-      as.write_lea(rsp, MemoryReference(r13, 16));
-      as.write_mov(r13, MemoryReference(r13, 8));
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::apply_deferred_dependency_updates() {
+  if (this->deferred_dependency_updates.empty()) {
+    return;
+  }
 
-      // pop the storage offset and (-r11) more items off the stack, but don't
-      // allow it to underflow
-      as.write_neg(r11);
-      as.write_lea(rsp, MemoryReference(rsp, 8 * this->dimensions, r11, 8));
-      as.write_lea(rax, MemoryReference(r13, 8));
-      as.write_cmp(rsp, rax);
-      as.write_cmovg(rsp, rax);
-      as.write_jmp("opcode_end");
+  // cells that were reset since they were deferred don't need to be
+  // recompiled; they'll be compiled with the right addresses when they're
+  // next reached
+  set<Position> positions = move(this->deferred_dependency_updates);
+  this->deferred_dependency_updates.clear();
+  for (const auto& pos : positions) {
+    auto cell_it = this->compiled_cells.find(pos);
+    if ((cell_it != this->compiled_cells.end()) && cell_it->second.code) {
+      this->compile_cell(pos);
+    }
+  }
+}
 
-      as.write_label("count_nonnegative");
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::is_direction_independent_opcode(int16_t opcode) {
+  // these opcodes compile to the same code regardless of the direction from
+  // which the cell was entered, since they either set an absolute delta or
+  // don't move the IP at all
+  switch (opcode) {
+    case '<':
+    case '>':
+    case '^':
+    case 'v':
+    case 'h':
+    case 'l':
+    case '?':
+    case '_':
+    case '|':
+    case 'm':
+    case 'x':
+    case '@':
+      return true;
+    default:
+      return false;
+  }
+}
 
-      // check if the count is greater than the stack size.
-      // TODO: implement this. it should push extra zeroes
-      as.write_lea(rcx, MemoryReference(rsp, 0, r11, 8));
-      as.write_lea(r9, MemoryReference(r13, 8));
-      as.write_cmp(rcx, r9);
-      as.write_jle("count_not_excessive");
-      this->write_throw_error(as,
-          "close-block opcode executed with count greater than stack size");
-      as.write_label("count_not_excessive");
+template <uint8_t Dimensions>
+Position BefungeJITCompiler<Dimensions>::canonical_position(const Position& pos) const {
+  Position ret = pos.copy();
+  if (ret.special_cell_id) {
+    return ret;
+  }
+  ret.wrap_lahey(this->field);
+
+  // cells containing direction-independent opcodes are compiled only once per
+  // alignment; all entry directions share the code compiled for the east-facing
+  // position. if the cell's contents change, on_cell_contents_changed resets it
+  // and its dependencies are recompiled, which recomputes this mapping. this
+  // doesn't apply to volatile cells, which aren't reset when they change
+  if (is_direction_independent_opcode(this->field.get(ret.x, ret.y, ret.z)) &&
+      !this->volatile_cells.count(Position(ret.x, ret.y, ret.z, 0, 0, 0))) {
+    ret.face(1, 0, 0);
+  }
+  return ret;
+}
 
-      // the common case: the count is nonnegative. in this case, copy n items
-      // from the stack being destroyed onto the next stack
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::CellKeyLess::operator()(const Position& a,
+    const Position& b) const {
+  if (a.special_cell_id != b.special_cell_id) {
+    return a.special_cell_id < b.special_cell_id;
+  }
+  if (a.x != b.x) {
+    return a.x < b.x;
+  }
+  if ((Dimensions > 1) && (a.y != b.y)) {
+    return a.y < b.y;
+  }
+  if ((Dimensions > 2) && (a.z != b.z)) {
+    return a.z < b.z;
+  }
+  if (a.dx != b.dx) {
+    return a.dx < b.dx;
+  }
+  if ((Dimensions > 1) && (a.dy != b.dy)) {
+    return a.dy < b.dy;
+  }
+  if ((Dimensions > 2) && (a.dz != b.dz)) {
+    return a.dz < b.dz;
+  }
+  return a.stack_aligned < b.stack_aligned;
+}
 
-      // copy items from the top stack to the second stack.
-      // rdx = dest ptr, rcx = src ptr, r11 = count remaining
-      as.write_lea(rdx, MemoryReference(r13, (this->dimensions + 2) * 8));
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::check_dimensions(uint8_t required_dimensions,
+    const Position& where, int16_t opcode) const {
+  if (Dimensions < required_dimensions) {
+    string where_str = where.str();
+    throw invalid_argument(string_printf(
+        "opcode %c (at %s) only valid in %hhu or more dimensions", opcode,
+        where_str.c_str(), required_dimensions));
+  }
+}
 
-      // we're about to overwrite the old r13 value, so load it now
-      as.write_mov(r13, MemoryReference(r13, 8));
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::CompiledCell::CompiledCell() : code(NULL), code_size(0),
+    buffer_capacity(0), cold_path_code(NULL), cold_path_capacity(0),
+    resume_offset(0), body_offset(0), accessed(0) { }
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::CompiledCell::CompiledCell(void* code, size_t code_size) :
+    code(code), code_size(code_size), buffer_capacity(code_size),
+    cold_path_code(NULL), cold_path_capacity(0), resume_offset(0),
+    body_offset(0), accessed(0) { }
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::CompiledCell::CompiledCell(const Position& dependency) :
+    code(NULL), code_size(0), buffer_capacity(0), cold_path_code(NULL),
+    cold_path_capacity(0), resume_offset(0), body_offset(0), accessed(0),
+    address_dependencies({dependency}) { }
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::CompiledCell::Slot::Slot() : entry(NULL), pos(NULL) { }
 
-      // if the second stack is empty, rdx might point beyond the end, so check
-      // for underflow
-      as.write_lea(r9, MemoryReference(r13, 8));
-      as.write_cmp(rdx, r13);
-      as.write_cmovg(rdx, r9);
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::compile_opcode(AMD64Assembler& as, const Position& pos,
+    int16_t opcode) {
 
-      as.write_label("copy_again");
-      as.write_dec(r11);
-      as.write_js("copy_done");
-      as.write_sub(rdx, 8);
-      as.write_sub(rcx, 8);
-      as.write_mov(rax, MemoryReference(rcx, 0));
-      as.write_mov(MemoryReference(rdx, 0), rax);
-      as.write_jmp("copy_again");
-      as.write_label("copy_done");
+  CompiledCell& cell = this->compiled_cells[pos];
 
-      as.write_mov(rsp, rdx);
+  switch (opcode) {
+    case -1:
+      throw logic_error(string_printf(
+          "attempted to compile boundary cell %zd %zd", pos.x, pos.y));
 
-      as.write_label("opcode_end");
-      this->write_jump_to_cell_unknown_alignment(as, pos, pos.copy().move_forward());
+    case '{': // open a new stack
+      this->write_helper_call(as, cell, pos, "dispatch_open_block");
       break;
 
-    case 'u':
-      // if there's no second stack, reflect
-      as.write_lea(r8, this->end_of_last_stack_reference());
-      as.write_cmp(r13, r8);
-      as.write_jl("second_stack_exists");
-      this->write_jump_to_cell(as, pos, pos.copy().turn_around().move_forward());
-      as.write_label("second_stack_exists");
-
-      // if the top stack is empty, the count is zero, so do nothing
-      as.write_cmp(rsp, r13);
-      as.write_jle("stack_sufficient");
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward());
-      as.write_label("stack_sufficient");
-
-      // the action is different for positive vs. negative counts. if the count
-      // is zero, do nothing
-      as.write_pop(r11); // item count
-      as.write_cmp(r11, 0);
-      as.write_jg("transfer_to_top_stack");
-      as.write_jl("transfer_from_top_stack");
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward().change_alignment());
-
-      as.write_label("transfer_to_top_stack");
-
-      // before this opcode, the stack looked like:
-      //   rsp=count f1 f2 ... r13=fn oldr13 e1 e2 ... en g1 g2 ... gn
-      // but we already popped the count, so now it looks like:
-      //   rsp=f1 f2 ... r13=fn oldr13 e1 e2 ... en g1 g2 ... gn
-
-      // now push e1 ... en in that order:
-      //   rsp=en ... e2 e1 f1 f2 ... r13=fn oldr13 e1 e2 ... en rdx=g1 g2 ... gn
-      // rcx = source ptr
-      // rdx = past-the-end ptr
-      // r8 = r13 of second stack
-      as.write_lea(rcx, MemoryReference(r13, 0x10));
-      as.write_lea(rdx, MemoryReference(r13, 0x10, r11, 8));
-      as.write_mov(r8, MemoryReference(r13, 8));
-      as.write_label("push_again");
-      as.write_cmp(rcx, rdx);
-      as.write_jge("push_done");
-      as.write_cmp(rcx, r8);
-      as.write_jg("second_stack_empty");
-      as.write_push(MemoryReference(rcx, 0));
-      as.write_jmp("push_next_cell");
-      as.write_label("second_stack_empty");
-      as.write_push(0);
-      as.write_label("push_next_cell");
-      as.write_add(rcx, 8);
-      as.write_jmp("push_again");
-      as.write_label("push_done");
-
-      // move everything from rsp up to SOx (inclusive) up by (count) spaces,
-      // overwriting original e1 ... en, but don't underflow the second stack:
-      //   rsp=en ... e2 e1 f1 f2 ... r13=fn oldr13 rdx=g1 g2 ... gn
-      // rcx = dest item ptr
-      // rdx = past-the-end pointer
-      // r8 = destination delta
-      as.write_cmp(rdx, r8);
-      as.write_jle("end_pointer_ok");
-      as.write_lea(rdx, MemoryReference(r8, 8));
-      as.write_label("end_pointer_ok");
-      as.write_lea(r8, MemoryReference(rdx, -0x10));
-      as.write_sub(r8, r13);
-      as.write_lea(rcx, MemoryReference(rdx, -8));
-      as.write_sub(rcx, r8);
-      as.write_label("shift_forward_again");
-      as.write_mov(rax, MemoryReference(rcx, 0));
-      as.write_mov(MemoryReference(rcx, 0, r8), rax);
-      as.write_sub(rcx, 8);
-      as.write_cmp(rcx, rsp);
-      as.write_jge("shift_forward_again");
-
-      // shift the stack top and bottom pointers by the same amount
-      as.write_add(rsp, r8);
-      as.write_add(r13, r8);
-      as.write_jmp("opcode_end");
-
-      as.write_label("transfer_from_top_stack");
-
-      // before this opcode, the stack looked like:
-      //   rsp=-count e1 e2 ... en f1 f2 ... r13=fn oldr13 g1 g2 ... gn
-      // but we already popped the count, so now it looks like:
-      //   rsp=e1 e2 ... en f1 f2 ... r13=fn oldr13 g1 g2 ... gn
-
-      // move everything down to make room for the new items on the second stack
-      //   rsp=e1 e2 ... en f1 f2 ... r13=fn oldr13 ?1 ?2 ... ?n g1 g2 ... gn
-      // rsp = src item ptr
-      // rdx = new rsp (for after the loop is done)
-      // rcx = new r13 (for after the loop is done)
-      // r8 = past-tne-end pointer (to know when to terminate the loop)
-      // we will always shift at least one item (since oldr13 must be present)
-      // so we don't have to check before running the first loop iteration
-      // remember r11 is negative here, so these lea opcodes actually move
-      // rsp/r13 backward (which is what we want)
-      as.write_lea(rdx, MemoryReference(rsp, 0, r11, 8));
-      as.write_lea(rcx, MemoryReference(r13, 0, r11, 8));
-      as.write_lea(r8, MemoryReference(r13, 0x10));
-      as.write_label("shift_backward_again");
-      as.write_pop(rax);
-      as.write_mov(MemoryReference(rsp, -8, r11, 8), rax);
-      as.write_cmp(rsp, r8);
-      as.write_jl("shift_backward_again");
-      as.write_mov(rsp, rdx);
-      as.write_mov(r13, rcx);
+    case '}': // close the current stack
+      this->write_helper_call(as, cell, pos, "dispatch_close_block");
+      break;
 
-      // now pop those dudes onto the second stack
-      //   rsp=f1 f2 ... r13=fn oldr13 en ... e2 e1 g1 g2 ... gn
-      as.write_lea(rdx, MemoryReference(r13, 0x10));
-      as.write_label("pop_again");
-      as.write_cmp(rsp, r13);
-      as.write_jg("top_stack_empty");
-      as.write_pop(MemoryReference(rdx, 0));
-      as.write_jmp("pop_next_cell");
-      as.write_label("top_stack_empty");
-      as.write_mov(MemoryReference(rdx, 0), 0);
-      as.write_label("pop_next_cell");
-      as.write_add(rdx, 8);
-      as.write_inc(r11);
-      as.write_jnz("pop_again");
-
-      as.write_label("opcode_end");
-      this->write_jump_to_cell_unknown_alignment(as, pos, pos.copy().move_forward());
+    case 'u': // transfer items between the top two stacks
+      this->write_helper_call(as, cell, pos, "dispatch_stack_under_stack");
       break;
 
     case '0':
@@ -602,6 +630,10 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
     case 'd':
     case 'e':
     case 'f':
+      if (this->write_constant_sysinfo_item(as, pos,
+          (opcode >= 'a') ? (opcode - 'a' + 10) : (opcode - '0'))) {
+        break;
+      }
       if (opcode >= 'a') {
         as.write_push(opcode - 'a' + 10);
       } else {
@@ -614,27 +646,29 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       this->check_dimensions(2, pos, 'w');
 
       as.write_cmp(rsp, r13);
-      as.write_jl("stack_sufficient");
-      as.write_je("stack_one_item");
-
-      // if the stack is empty, do nothing (0 == 0)
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward());
-
-      // if there's one item on the stack. turn right if it's positive, left if
-      // it's negative
-      as.write_label("stack_one_item");
-      as.write_pop(rcx);
-      as.write_cmp(rcx, 0);
-      as.write_jl("stack_one_item_left");
-      as.write_jg("stack_one_item_right");
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward().change_alignment());
-      as.write_label("stack_one_item_left");
-      this->write_jump_to_cell(as, pos, pos.copy().turn_left().move_forward().change_alignment());
-      as.write_label("stack_one_item_right");
-      this->write_jump_to_cell(as, pos, pos.copy().turn_right().move_forward().change_alignment());
+      {
+        AMD64Assembler& cold = this->write_cold_path_jump(as,
+            ColdPathCondition::GreaterOrEqual);
+        cold.write_je("stack_one_item");
+
+        // if the stack is empty, do nothing (0 == 0)
+        this->write_jump_to_cell(cold, pos, pos.copy().move_forward());
+
+        // if there's one item on the stack. turn right if it's positive, left
+        // if it's negative
+        cold.write_label("stack_one_item");
+        cold.write_pop(rcx);
+        cold.write_cmp(rcx, 0);
+        cold.write_jl("stack_one_item_left");
+        cold.write_jg("stack_one_item_right");
+        this->write_jump_to_cell(cold, pos, pos.copy().move_forward().change_alignment());
+        cold.write_label("stack_one_item_left");
+        this->write_jump_to_cell(cold, pos, pos.copy().turn_left().move_forward().change_alignment());
+        cold.write_label("stack_one_item_right");
+        this->write_jump_to_cell(cold, pos, pos.copy().turn_right().move_forward().change_alignment());
+      }
 
       // if there are two or more items on the stack, operate on them
-      as.write_label("stack_sufficient");
       as.write_pop(rcx);
       as.write_pop(rax);
       as.write_cmp(rax, rcx);
@@ -654,8 +688,6 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
     case '/':
     case '%':
       as.write_cmp(rsp, r13);
-      as.write_jl("stack_sufficient");
-      as.write_jg("stack_empty");
 
       // if there's one item on the stack:
       //   +: leave it there (0 + x)
@@ -664,23 +696,26 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       //   /: replace it with zero (0 / x)
       //   %: replace it with zero (0 % x)
       //   `: push 1 if the top is negative, 0 otherwise
-      as.write_label("stack_one_item");
-      if (opcode == '`') {
-        as.write_xor(rdx, rdx);
-        as.write_cmp(MemoryReference(rsp, 0), 0);
-        as.write_setl(dl);
-        as.write_mov(MemoryReference(rsp, 0), rdx);
-      } else if (opcode == '-') {
-        as.write_neg(MemoryReference(rsp, 0));
-      } else if (opcode != '+') {
-        as.write_mov(MemoryReference(rsp, 0), 0);
-      }
+      {
+        AMD64Assembler& cold = this->write_cold_path_jump(as,
+            ColdPathCondition::GreaterOrEqual);
+        cold.write_jg("stack_empty");
+        if (opcode == '`') {
+          cold.write_xor(rdx, rdx);
+          cold.write_cmp(MemoryReference(rsp, 0), 0);
+          cold.write_setl(dl);
+          cold.write_mov(MemoryReference(rsp, 0), rdx);
+        } else if (opcode == '-') {
+          cold.write_neg(MemoryReference(rsp, 0));
+        } else if (opcode != '+') {
+          cold.write_mov(MemoryReference(rsp, 0), 0);
+        }
 
-      as.write_label("stack_empty");
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward());
+        cold.write_label("stack_empty");
+        this->write_jump_to_cell(cold, pos, pos.copy().move_forward());
+      }
 
       // if there are two or more items on the stack, operate on them
-      as.write_label("stack_sufficient");
       as.write_pop(rcx);
       if (opcode == '`') {
         as.write_xor(rdx, rdx);
@@ -696,27 +731,30 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
         as.write_imul(rcx, MemoryReference(rsp, 0));
         as.write_mov(MemoryReference(rsp, 0), rcx);
       } else {
-        as.write_xor(rdx, rdx);
         as.write_mov(rax, MemoryReference(rsp, 0));
+        as.write_mov(rdx, rax); // sign-extend the dividend into rdx
+        as.write_sar(rdx, 63);
         as.write_test(rcx, rcx);
-        as.write_jz("division_by_zero");
+        {
+          AMD64Assembler& cold = this->write_cold_path_jump(as,
+              ColdPathCondition::Zero);
+          cold.write_mov(MemoryReference(rsp, 0), 0);
+          this->write_jump_to_cell(cold, pos, pos.copy().move_forward().change_alignment());
+        }
         as.write_idiv(rcx);
         as.write_mov(MemoryReference(rsp, 0), (opcode == '%') ? rdx : rax);
-        as.write_jmp("division_complete");
-        as.write_label("division_by_zero");
-        as.write_mov(MemoryReference(rsp, 0), 0);
-        as.write_label("division_complete");
       }
       this->write_jump_to_cell(as, pos, pos.copy().move_forward().change_alignment());
       break;
 
     case '!': // logical not
       as.write_cmp(rsp, r13);
-      as.write_jle("stack_sufficient");
-      as.write_push(1);
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward().change_alignment());
-
-      as.write_label("stack_sufficient");
+      {
+        AMD64Assembler& cold = this->write_cold_path_jump(as,
+            ColdPathCondition::Greater);
+        cold.write_push(1);
+        this->write_jump_to_cell(cold, pos, pos.copy().move_forward().change_alignment());
+      }
       as.write_pop(rax);
       as.write_test(rax, rax);
       as.write_setz(al);
@@ -763,40 +801,11 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       break;
 
     case '?': // move randomly
-      this->write_function_call(as, this->common_object_reference("rand"),
-          pos.stack_aligned);
-
+      this->write_random_index(as, Dimensions * 2);
       as.write_mov(rcx, "jump_table");
-      if (this->dimensions == 1) {
-        as.write_and(rax, 1);
-        as.write_jmp(MemoryReference(rcx, 0, rax, 8));
-        this->write_jump_table(as, "jump_table", pos, {
-            pos.copy().face(-1, 0, 0).move_forward(),
-            pos.copy().face(1, 0, 0).move_forward()});
-
-      } else if (this->dimensions == 2) {
-        as.write_and(rax, 2);
-        as.write_jmp(MemoryReference(rcx, 0, rax, 8));
-        this->write_jump_table(as, "jump_table", pos, {
-            pos.copy().face(-1, 0, 0).move_forward(),
-            pos.copy().face(1, 0, 0).move_forward(),
-            pos.copy().face(0, -1, 0).move_forward(),
-            pos.copy().face(0, 1, 0).move_forward()});
-
-      } else { // 3 dimensions
-        as.write_xor(rdx, rdx);
-        as.write_mov(rcx, 6); // apparently there's no imm idiv
-        as.write_idiv(rcx);
-        as.write_mov(rax, rdx);
-        as.write_jmp(MemoryReference(rcx, 0, rax, 8));
-        this->write_jump_table(as, "jump_table", pos, {
-            pos.copy().face(-1, 0, 0).move_forward(),
-            pos.copy().face(1, 0, 0).move_forward(),
-            pos.copy().face(0, -1, 0).move_forward(),
-            pos.copy().face(0, 1, 0).move_forward(),
-            pos.copy().face(0, 0, -1).move_forward(),
-            pos.copy().face(0, 0, 1).move_forward()});
-      }
+      as.write_jmp(MemoryReference(rcx, 0, rax, 8));
+      this->write_jump_table(as, "jump_table", pos,
+          this->random_direction_positions(pos));
       break;
 
     case 'm': // below if zero, above if not
@@ -806,19 +815,11 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
     case '_': { // right if zero, left if not
       as.write_xor(rcx, rcx);
 
-      // if the stack is empty, don't read from it - the value is zero
+      // if the stack is empty, don't read from it - the value is zero. this
+      // case is written after the jump table, so the usual case falls through
       as.write_cmp(rsp, r13);
-      as.write_jle("stack_nonempty");
-
-      if (opcode == '_') {
-        this->write_jump_to_cell(as, pos, pos.copy().face(1, 0, 0).move_forward());
-      } else if (opcode == '|') {
-        this->write_jump_to_cell(as, pos, pos.copy().face(0, 1, 0).move_forward());
-      } else { // 'm'
-        this->write_jump_to_cell(as, pos, pos.copy().face(0, 0, 1).move_forward());
-      }
+      as.write_jg("stack_empty");
 
-      as.write_label("stack_nonempty");
       as.write_pop(rax);
       as.write_test(rax, rax);
       as.write_setnz(rcx);
@@ -840,6 +841,15 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
             {new_pos.copy().face(0, 0, 1).move_forward(),
              new_pos.copy().face(0, 0, -1).move_forward()});
       }
+
+      as.write_label("stack_empty");
+      if (opcode == '_') {
+        this->write_jump_to_cell(as, pos, pos.copy().face(1, 0, 0).move_forward());
+      } else if (opcode == '|') {
+        this->write_jump_to_cell(as, pos, pos.copy().face(0, 1, 0).move_forward());
+      } else { // 'm'
+        this->write_jump_to_cell(as, pos, pos.copy().face(0, 0, 1).move_forward());
+      }
       break;
     }
 
@@ -870,9 +880,8 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
 
       // stack is empty; write a zero
       {
-        int64_t token = this->next_token++;
-        cell.next_position_tokens.emplace(token);
-        this->token_to_position.emplace(token, target_pos.copy().move_forward());
+        int64_t token = this->allocate_token(cell,
+            target_pos.copy().move_forward());
 
         as.write_mov(rsi, token);
         as.write_xor(r9, r9);
@@ -889,9 +898,8 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       as.write_label("stack_sufficient");
       {
         target_pos.change_alignment();
-        int64_t token = this->next_token++;
-        cell.next_position_tokens.emplace(token);
-        this->token_to_position.emplace(token, target_pos.copy().move_forward());
+        int64_t token = this->allocate_token(cell,
+            target_pos.copy().move_forward());
 
         as.write_mov(rsi, token);
         as.write_pop(r9);
@@ -907,23 +915,25 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
     }
 
     case '\"': { // push an entire string
-      // TODO: this needs to depend on the VALUE of the following cells, not
-      // just their addresses (which it currently doesn't depend on either)
+      // the compiled code depends on the values of all the cells in the string
+      // (including the terminal quote), so they're tracked as dependencies
       Position char_pos = pos.copy().move_forward();
       int16_t last_value = 0;
+      vector<int16_t> values;
       for (;;) {
-        int16_t value = this->field.get(char_pos.x, char_pos.y, char_pos.z);
+        int16_t value = this->get_dependent_value(pos, char_pos);
         if (value == '\"') {
           break;
         }
 
         if ((value != ' ') || (last_value != ' ')) {
-          as.write_push(value);
+          values.emplace_back(value);
           char_pos.change_alignment();
         }
         char_pos.move_forward();
         last_value = value;
       }
+      this->write_push_string(as, values);
 
       // char_pos now points to the terminal quote; we should go one beyond
       this->write_jump_to_cell(as, pos, char_pos.move_forward());
@@ -940,19 +950,21 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
 
     case '\\': // swap top 2 items on stack
       as.write_cmp(rsp, r13);
-      as.write_jl("stack_sufficient");
-      as.write_je("stack_one_item");
+      {
+        AMD64Assembler& cold = this->write_cold_path_jump(as,
+            ColdPathCondition::GreaterOrEqual);
+        cold.write_je("stack_one_item");
 
-      // if the stack is empty, do nothing (the top 2 values are zeroes)
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward());
+        // if the stack is empty, do nothing (the top 2 values are zeroes)
+        this->write_jump_to_cell(cold, pos, pos.copy().move_forward());
 
-      // if there's one item on the stack, just push a zero after it
-      as.write_label("stack_one_item");
-      as.write_push(0);
-      this->write_jump_to_cell(as, pos, pos.copy().move_forward().change_alignment());
+        // if there's one item on the stack, just push a zero after it
+        cold.write_label("stack_one_item");
+        cold.write_push(0);
+        this->write_jump_to_cell(cold, pos, pos.copy().move_forward().change_alignment());
+      }
 
       // if there are two or more items on the stack, swap them
-      as.write_label("stack_sufficient");
       as.write_pop(rax);
       as.write_xchg(rax, MemoryReference(rsp, 0));
       as.write_push(rax);
@@ -1023,199 +1035,90 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
     }
 
     case 'j': { // jump forward by n cells
-      // this is harder than it sounds because the distance is on the stack, not
-      // statically available. to get the resulting cell we have to call into
-      // the compiler, sigh
+      // the distance is on the stack, not statically available, so the target
+      // is found with an inline cache of recently-seen distances. misses call
+      // into the compiler
       as.write_cmp(rsp, r13);
       as.write_jle("stack_sufficient");
       this->write_jump_to_cell(as, pos, pos.copy().move_forward());
 
       as.write_label("stack_sufficient");
+      as.write_pop(r8);
+      this->write_inline_cache_lookup(as, "distance", pos,
+          pos.copy().move_forward().change_alignment(), false, 1);
+      break;
+    }
 
-      Position start_pos = pos.copy().move_forward().change_alignment();
-      as.write_mov(rdi, this->common_object_reference("this"));
+    case 'x': { // set delta
+      // the new delta is on the stack, so the target is found with an inline
+      // cache of recently-seen deltas. there's one cache for each resulting
+      // stack alignment. all paths put the delta in r8, r9, r10 (dx, dy, dz)
+      as.write_cmp(rsp, r13);
 
-      as.write_pop(r11);
+      // it's an error to execute 'x' with an empty stack - this would set
+      // dx = dy = dz = 0, so execution would loop forever on this cell. we
+      // raise an error instead.
+      this->write_throw_error(this->write_cold_path_jump(as,
+          ColdPathCondition::Greater), "cannot execute x opcode on empty stack");
 
-      as.write_push(start_pos.stack_aligned);
-      as.write_push(start_pos.dz);
-      as.write_push(start_pos.dy);
-      as.write_push(start_pos.dx);
+      if (Dimensions == 1) {
+        as.write_pop(r8);
+        as.write_xor(r9, r9);
+        as.write_xor(r10, r10);
+        as.write_jmp("lookup_alignment_changed");
 
-      static auto write_coord = +[](AMD64Assembler& as, int64_t x, int64_t dx) {
-        if (dx) {
-          as.write_mov(r8, r11);
-          if (dx == -1) {
-            as.write_neg(r8);
-          } else if (dx != 1) {
-            // TODO: use immediate form of imul here
-            as.write_mov(r9, dx);
-            as.write_imul(r8, r9);
-          }
-          as.write_add(r8, x);
-          as.write_push(r8);
-        } else {
-          as.write_push(x);
-        }
-      };
-
-      write_coord(as, start_pos.z, start_pos.dz);
-      write_coord(as, start_pos.y, start_pos.dy);
-      write_coord(as, start_pos.x, start_pos.dx);
-
-      as.write_mov(rsi, rsp);
-      this->write_function_call(as,
-          this->common_object_reference("dispatch_get_cell_code"),
-          !start_pos.stack_aligned);
-      as.write_add(rsp, 0x38); // 7 64-bit fields
-      as.write_jmp(rax);
-      break;
-    }
-
-    case 'x': { // set delta
-      as.write_cmp(rsp, r13);
-      as.write_jg("stack_empty");
+      } else if (Dimensions == 2) {
+        as.write_jl("stack_two_or_more_items");
 
-      // all cases end up calling a function with this as the first arg
-      as.write_mov(rdi, this->common_object_reference("this"));
+        as.write_label("stack_one_item");
+        as.write_pop(r9); // dy
+        as.write_xor(r8, r8);
+        as.write_xor(r10, r10);
+        as.write_jmp("lookup_alignment_changed");
 
-      if (this->dimensions == 1) {
-        as.write_pop(r8);
-        as.write_push(!pos.stack_aligned);
-        as.write_push(0); // dz
-        as.write_push(0); // dy
-        as.write_push(r8); // dx
-        as.write_push(0); // z
-        as.write_push(0); // y
-        as.write_add(r8, pos.x);
-        as.write_push(r8); // x
-
-        as.write_mov(rsi, rsp);
-        if (pos.stack_aligned) {
-          as.write_push(this->common_object_reference("jump_return_38"));
-        } else {
-          as.write_sub(rsp, 8);
-          as.write_push(this->common_object_reference("jump_return_40"));
-        }
-        as.write_jmp(this->common_object_reference("dispatch_get_cell_code"));
+        as.write_label("stack_two_or_more_items");
+        as.write_pop(r9); // dy
+        as.write_pop(r8); // dx
+        as.write_xor(r10, r10);
+        as.write_jmp("lookup_alignment_same");
 
-      } else {
+      } else { // 3D
         as.write_jl("stack_two_or_more_items");
 
         as.write_label("stack_one_item");
-        as.write_pop(r8);
-        as.write_push(!pos.stack_aligned);
-        if (this->dimensions == 2) {
-          as.write_push(0); // dz
-          as.write_push(r8); // dy
-        } else { // 3D
-          as.write_push(r8); // dz
-          as.write_push(0); // dy
-        }
-        as.write_push(0); // dx
-        if (this->dimensions == 2) {
-          as.write_push(0); // z
-          as.write_add(r8, pos.y);
-          as.write_push(r8); // y
-        } else { // 3D
-          as.write_add(r8, pos.x);
-          as.write_push(r8); // z
-          as.write_push(pos.y); // y
-        }
-        as.write_push(pos.x); // x
-
-        as.write_mov(rsi, rsp);
-        if (pos.stack_aligned) {
-          as.write_push(this->common_object_reference("jump_return_38"));
-        } else {
-          as.write_sub(rsp, 8);
-          as.write_push(this->common_object_reference("jump_return_40"));
-        }
-        as.write_jmp(this->common_object_reference("dispatch_get_cell_code"));
+        as.write_pop(r10); // dz
+        as.write_xor(r8, r8);
+        as.write_xor(r9, r9);
+        as.write_jmp("lookup_alignment_changed");
 
         as.write_label("stack_two_or_more_items");
-        as.write_pop(r10);
-        as.write_pop(r9);
-        if (this->dimensions == 2) {
-          as.write_push(pos.stack_aligned);
-          as.write_push(0); // dz
-          as.write_push(r10); // dy
-          as.write_push(r9); // dx
-          as.write_push(0); // z
-          as.write_add(r10, pos.y);
-          as.write_push(r10); // y
-          as.write_add(r9, pos.x);
-          as.write_push(r9); // x
-
-          as.write_mov(rsi, rsp);
-          if (!pos.stack_aligned) {
-            as.write_push(this->common_object_reference("jump_return_38"));
-          } else {
-            as.write_sub(rsp, 8);
-            as.write_push(this->common_object_reference("jump_return_40"));
-          }
-          as.write_jmp(this->common_object_reference("dispatch_get_cell_code"));
-
-        } else { // 3D
-          as.write_cmp(rsp, r13);
-          as.write_jle("stack_three_or_more_items");
-
-          as.write_label("stack_two_items");
-          as.write_push(pos.stack_aligned);
-          as.write_push(r10); // dz
-          as.write_push(r9); // dy
-          as.write_push(0); // dx
-          as.write_add(r10, pos.z);
-          as.write_push(r10); // z
-          as.write_add(r9, pos.y);
-          as.write_push(r9); // y
-          as.write_push(pos.x); // x
-
-          as.write_mov(rsi, rsp);
-          if (!pos.stack_aligned) {
-            as.write_push(this->common_object_reference("jump_return_38"));
-          } else {
-            as.write_sub(rsp, 8);
-            as.write_push(this->common_object_reference("jump_return_40"));
-          }
-          as.write_jmp(this->common_object_reference("dispatch_get_cell_code"));
-
-          as.write_label("stack_three_or_more_items");
-          as.write_pop(r8);
-          as.write_push(pos.stack_aligned);
-          as.write_push(r10); // dz
-          as.write_push(r9); // dy
-          as.write_push(r8); // dx
-          as.write_add(r10, pos.z);
-          as.write_push(r10); // z
-          as.write_add(r9, pos.y);
-          as.write_push(r9); // y
-          as.write_add(r8, pos.x);
-          as.write_push(r8); // x
-
-          as.write_mov(rsi, rsp);
-          if (pos.stack_aligned) {
-            as.write_push(this->common_object_reference("jump_return_38"));
-          } else {
-            as.write_sub(rsp, 8);
-            as.write_push(this->common_object_reference("jump_return_40"));
-          }
-          as.write_jmp(this->common_object_reference("dispatch_get_cell_code"));
-        }
+        as.write_pop(r10); // dz
+        as.write_pop(r9); // dy
+        as.write_cmp(rsp, r13);
+        as.write_jle("stack_three_or_more_items");
+
+        as.write_label("stack_two_items");
+        as.write_xor(r8, r8);
+        as.write_jmp("lookup_alignment_same");
+
+        as.write_label("stack_three_or_more_items");
+        as.write_pop(r8); // dx
+        as.write_jmp("lookup_alignment_changed");
       }
 
-      // it's an error to execute 'x' with an empty stack - this would set
-      // dx = dy = dz = 0, so execution would loop forever on this cell. we
-      // raise an error instead.
-      as.write_label("stack_empty");
-      this->write_throw_error(as, "cannot execute x opcode on empty stack");
+      as.write_label("lookup_alignment_same");
+      this->write_inline_cache_lookup(as, "delta_same", pos, pos, true,
+          Dimensions);
+      as.write_label("lookup_alignment_changed");
+      this->write_inline_cache_lookup(as, "delta_changed", pos,
+          pos.copy().change_alignment(), true, Dimensions);
       break;
     }
 
     case ';': { // skip everything until the next ';'
       Position char_pos = pos.copy().move_forward();
       for (;;) {
-        int16_t value = this->field.get(char_pos.x, char_pos.y, char_pos.z);
+        int16_t value = this->get_dependent_value(pos, char_pos);
         if (value == ';') {
           break;
         }
@@ -1232,7 +1135,7 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       int16_t value;
       bool in_semicolon = false;
       for (;;) {
-        value = this->field.get(char_pos.x, char_pos.y, char_pos.z);
+        value = this->get_dependent_value(pos, char_pos);
         if (value == ';') {
           in_semicolon = !in_semicolon;
         } else if (!in_semicolon && (value != ' ') && (value != 'Y')) {
@@ -1275,13 +1178,13 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       // stack has 2 or more items; pop the first 2 and check again. but if this
       // is one-dimensional, we only need two arguments (hooray)
       as.write_label("stack_two_or_more_items");
-      if (this->dimensions == 1) {
+      if (Dimensions == 1) {
         as.write_pop(rdx); // x
         this->write_load_storage_offset(as, {{rdx, true}, {rcx, false}, {r8, false}});
         as.write_pop(r9); // value
         as.write_jmp("call_same_alignment");
 
-      } if (this->dimensions == 2) {
+      } if (Dimensions == 2) {
         as.write_pop(rcx); // y
         as.write_pop(rdx); // x
 
@@ -1332,9 +1235,7 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       as.write_label("call_other_alignment");
       {
         Position next_pos = pos.copy().move_forward().change_alignment().wrap_lahey(this->field);
-        int64_t token = this->next_token++;
-        cell.next_position_tokens.emplace(token);
-        this->token_to_position.emplace(token, next_pos);
+        int64_t token = this->allocate_token(cell, next_pos);
 
         as.write_mov(rsi, token);
         if (!pos.stack_aligned) {
@@ -1349,9 +1250,7 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       as.write_label("call_same_alignment");
       {
         Position next_pos = pos.copy().move_forward().wrap_lahey(this->field);
-        int64_t token = this->next_token++;
-        cell.next_position_tokens.emplace(token);
-        this->token_to_position.emplace(token, next_pos);
+        int64_t token = this->allocate_token(cell, next_pos);
 
         as.write_mov(rsi, token);
         if (pos.stack_aligned) {
@@ -1369,7 +1268,7 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
 
       as.write_cmp(rsp, r13);
       as.write_je("stack_one_item");
-      if (this->dimensions > 1) {
+      if (Dimensions > 1) {
         as.write_jl("stack_two_or_more_items");
       }
 
@@ -1381,10 +1280,10 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       this->write_jump_to_cell(as, pos, pos.copy().move_forward().change_alignment());
 
       as.write_label("stack_one_item");
-      if (this->dimensions == 1) {
+      if (Dimensions == 1) {
         as.write_pop(rsi);
         this->write_load_storage_offset(as, {{rsi, true}, {rdx, false}, {rcx, false}});
-      } else if (this->dimensions == 2) {
+      } else if (Dimensions == 2) {
         as.write_pop(rdx);
         this->write_load_storage_offset(as, {{rsi, false}, {rdx, true}, {rcx, false}});
       } else {
@@ -1396,7 +1295,7 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       as.write_push(rax);
       this->write_jump_to_cell(as, pos, pos.copy().move_forward());
 
-      if (this->dimensions == 2) {
+      if (Dimensions == 2) {
         as.write_label("stack_two_or_more_items");
         as.write_pop(rdx); // y
         as.write_pop(rsi); // x
@@ -1406,7 +1305,7 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
         as.write_push(rax);
         this->write_jump_to_cell(as, pos, pos.copy().move_forward().change_alignment());
 
-      } else if (dimensions == 3) {
+      } else if (Dimensions == 3) {
         as.write_label("stack_two_or_more_items");
         as.write_pop(rcx); // z
         as.write_pop(rdx); // y
@@ -1463,13 +1362,13 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       as.write_xor(r10, r10);
       as.write_xor(r11, r11);
 
-      if (this->dimensions > 2) {
+      if (Dimensions > 2) {
         as.write_cmp(rax, r13);
         as.write_cmovle(r11, MemoryReference(rax, 0));
         as.write_add(rax, 8);
       }
 
-      if (this->dimensions > 1) {
+      if (Dimensions > 1) {
         as.write_cmp(rax, r13);
         as.write_cmovle(r10, MemoryReference(rax, 0));
         as.write_add(rax, 8);
@@ -1500,14 +1399,14 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       // vb (uninitialized values since this is output-only)
       // note: here, va and vb are always 3-dimensional because I'm lazy
       as.write_push(rax);
-      if (this->dimensions > 2) {
+      if (Dimensions > 2) {
         as.write_push(r11);
       } else {
         as.write_push(0);
       }
-      if (this->dimensions > 1) {
+      if (Dimensions > 1) {
         as.write_push(r10);
-      } else if (this->dimensions == 3) {
+      } else {
         as.write_push(0);
       }
       as.write_push(r9);
@@ -1537,26 +1436,13 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       this->write_jump_to_cell_unknown_alignment(as, pos, pos.copy().turn_around().move_forward());
       as.write_label("file_read_success");
 
-      // now, copy va and vb into where they're supposed to go on the stack
-      if (this->dimensions == 3) {
-        as.write_push(MemoryReference(rdx, 40));
-        as.write_push(MemoryReference(rdx, 32));
-        as.write_push(MemoryReference(rdx, 24));
-      } else if (this->dimensions == 2) {
-        as.write_push(MemoryReference(rdx, 32));
-        as.write_push(MemoryReference(rdx, 24));
-      } else if (this->dimensions == 1) {
-        as.write_push(MemoryReference(rdx, 24));
-      }
-      if (this->dimensions == 3) {
-        as.write_push(MemoryReference(rdx, 16));
-        as.write_push(MemoryReference(rdx, 8));
-        as.write_push(MemoryReference(rdx, 0));
-      } else if (this->dimensions == 2) {
-        as.write_push(MemoryReference(rdx, 8));
-        as.write_push(MemoryReference(rdx, 0));
-      } else if (this->dimensions == 1) {
-        as.write_push(MemoryReference(rdx, 0));
+      // now, copy va and vb into where they're supposed to go on the stack.
+      // the last component of each vector goes on top
+      for (uint8_t d = 0; d < Dimensions; d++) {
+        as.write_push(MemoryReference(rdx, 24 + 8 * d));
+      }
+      for (uint8_t d = 0; d < Dimensions; d++) {
+        as.write_push(MemoryReference(rdx, 8 * d));
       }
 
       // all done
@@ -1607,182 +1493,107 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
       break;
 
     case 'y': // get sysinfo
-      as.write_mov(r10, rsp); // we'll need this later
-
-      // get the index argument
-      as.write_cmp(rsp, r13);
-      as.write_jg("stack_empty");
-      as.write_pop(r11);
-      as.write_jmp("count_available");
-      as.write_label("stack_empty");
-      as.write_xor(r11, r11);
-      as.write_label("count_available");
-
-      // the following fields are pushed in this order:
+      // a positive argument selects a single item, which the helper computes
+      // without building the rest. only a full dump pushes everything
+      this->write_helper_call(as, cell, pos, "dispatch_sysinfo");
+      break;
 
-      // vector of strings: env (NAME=VALUE), terminated by double null
-      // TODO
-      as.write_push(0);
-      as.write_push(0);
+    case '@': // end program
+      this->write_end_program(as, pos.stack_aligned);
+      break;
 
-      // vector of strings: argv, terminated by triple null (so a single argument can be null); first is name of Funge source program
-      // TODO
-      as.write_push(0);
-      as.write_push(0);
-      as.write_push(0);
+    case '(': // load fingerprint
+      this->write_helper_call(as, cell, pos, "dispatch_load_fingerprint");
+      break;
 
-      // vector: size of each stack, starting from bottom (sizes as if y was not executed yet)
-      // r10 is the initial stack pointer (from before y began); we can use it
-      // to compute the stack sizes
-      as.write_mov(rax, r10);
-      as.write_mov(rdx, r13);
-      as.write_lea(r8, this->end_of_last_stack_reference());
-      as.write_xor(rcx, rcx); // number of stacks
-
-      // count this stack. rdx points to the last valid stack entry, so add 8
-      as.write_label("count_next_stack");
-      as.write_lea(r9, MemoryReference(rdx, 8));
-      as.write_sub(r9, rax);
-      as.write_shr(r9, 3);
-      as.write_push(r9);
-      as.write_inc(rcx);
+    case ')': // unload fingerprint
+      this->write_helper_call(as, cell, pos, "dispatch_unload_fingerprint");
+      break;
 
-      as.write_cmp(rdx, r8); // check if this is the last stack
-      as.write_je("all_stacks_counted");
-      as.write_lea(rax, MemoryReference(rdx, 16));
-      as.write_mov(rdx, MemoryReference(rdx, 8));
-      as.write_jmp("count_next_stack");
+    case 'A':
+    case 'B':
+    case 'C':
+    case 'D':
+    case 'E':
+    case 'F':
+    case 'G':
+    case 'H':
+    case 'I':
+    case 'J':
+    case 'K':
+    case 'L':
+    case 'M':
+    case 'N':
+    case 'O':
+    case 'P':
+    case 'Q':
+    case 'R':
+    case 'S':
+    case 'T':
+    case 'U':
+    case 'V':
+    case 'W':
+    case 'X':
+    case 'Y':
+    case 'Z': { // fingerprint instructions
+      // in concurrent mode, each thread has its own semantics, so the cell
+      // looks up the current thread's semantic when it runs
+      if (this->concurrent) {
+        this->write_helper_call(as, cell, pos, "dispatch_letter", opcode);
+        break;
+      }
 
-      as.write_label("all_stacks_counted");
+      // this cell has to be recompiled if the letter's semantic changes
+      this->letter_cells[opcode - 'A'].emplace(pos);
 
-      // cell: number of stacks currently open
-      as.write_push(rcx);
+      const auto& semantics = this->letter_semantics[opcode - 'A'];
+      const FingerprintSemantic* semantic = semantics.empty() ? NULL :
+          semantics.back();
+      if (!semantic || (semantic->type == FingerprintSemantic::Type::Reflect)) {
+        this->write_jump_to_cell(as, pos, pos.copy().turn_around().move_forward());
 
-      // we'll need some high-level info for the next few cells
-      as.write_sub(rsp, sizeof(SysinfoHL));
-      as.write_mov(rdi, this->common_object_reference("this"));
-      as.write_mov(rsi, rsp);
-      as.write_push(r10); // can be clobbered by the function call, so save it
-      as.write_push(r11); // can be clobbered by the function call, so save it
-      this->write_function_call(as,
-          this->common_object_reference("dispatch_get_sysinfo_hl"), !pos.stack_aligned);
-      as.write_pop(r11);
-      as.write_pop(r10);
-
-      // get_sysinfo_hl accounts for the following cells:
-
-      // cell: (hour << 16) | (minute << 8) | (second)
-      // cell: ((year - 1900) << 16) | (month << 8) | (day of month)
-      // vector: greatest point with non-space cell
-      // vector: least point with non-space cell
-
-      // however, if the dimension isn't 3, we need to remove a couple of fields
-      // from the above two vectors
-      if (this->dimensions == 2) {
-        // stack looks like [0 y x 0 y x]; remove the zeroes
-        as.write_mov(rax, MemoryReference(rsp, 16));
-        as.write_mov(MemoryReference(rsp, 24), rax);
-        as.write_mov(rax, MemoryReference(rsp, 8));
-        as.write_mov(MemoryReference(rsp, 16), rax);
-        as.write_add(rsp, 16);
-      } else if (this->dimensions == 1) {
-        // stack looks like [0 0 x 0 0 x]; remove the zeroes
-        as.write_mov(rax, MemoryReference(rsp, 16));
-        as.write_mov(MemoryReference(rsp, 32), rax);
-        as.write_add(rsp, 32);
-      }
-
-      // vector: current storage offset
-      if (this->dimensions > 1) {
-        if (this->dimensions > 2) {
-          as.write_push(this->storage_offset_reference(2));
-        }
-        as.write_push(this->storage_offset_reference(1));
-      }
-      as.write_push(this->storage_offset_reference(0));
+      } else if (semantic->type == FingerprintSemantic::Type::PushConstant) {
+        as.write_push(semantic->value);
+        this->write_jump_to_cell(as, pos, pos.copy().move_forward().change_alignment());
 
-      // vector: current delta
-      as.write_push(pos.dx);
-      if (this->dimensions > 1) {
-        as.write_push(pos.dy);
-        if (this->dimensions > 2) {
-          as.write_push(pos.dz);
-        }
+      } else {
+        this->write_helper_call(as, cell, pos, "dispatch_fingerprint",
+            reinterpret_cast<int64_t>(semantic->function));
       }
+      break;
+    }
 
-      // vector: current ip position
-      as.write_push(pos.x);
-      if (this->dimensions > 1) {
-        as.write_push(pos.y);
-        if (this->dimensions > 2) {
-          as.write_push(pos.z);
-        }
+    case 't': { // split the IP
+      // the spec allows unavailable instructions to act like r
+      if (!this->concurrent) {
+        this->warn_about_late_t(pos);
+        this->write_jump_to_cell(as, pos,
+            pos.copy().turn_around().move_forward());
+        break;
       }
 
-      // cell: unique team number for current thread
-      as.write_push(0);
-
-      // cell: unique id for current thread
-      as.write_push(0); // TODO
-
-      // cell: number of dimensions (1=unefunge, etc.)
-      as.write_push(this->dimensions);
-
-      // cell: path separator character (/)
-      as.write_push(static_cast<int64_t>('/'));
-
-      // cell: operating paradigm. 0=unavailable, 1=system(), 2=specific shell, 3=same shell that started this compiler
-      // TODO: implement = and set this to nonzero
-      as.write_push(1);
-
-      // cell: implementation version number
-      as.write_push(0);
-
-      // cell: implementation handprint
-      as.write_push(0x5555555555555555);
-
-      // cell: number of bytes per cell (8 in our case)
-      as.write_push(8);
-
-      // cell: 0bUEOIT
-      //   Bit 0 (0x01): high if t is implemented. (is this Concurrent Funge-98?)
-      //   Bit 1 (0x02): high if i is implemented.
-      //   Bit 2 (0x04): high if o is implemented.
-      //   Bit 3 (0x08): high if = is implemented.
-      //   Bit 4 (0x10): high if unbuffered standard I/O (like getch()) is in effect, low if the usual buffered variety (like scanf("%c")) is being used.
-      // TODO: finish implementing io= and enable them here
-      as.write_push(0x0E);
-
-      // if the stack argument (r11) is positive, select out that item from the
-      // stack and throw away the others. if it's zero or negative, do nothing
-      as.write_dec(r11);
-      as.write_js("skip_select_field");
-
-      // figure out which item to read and check if it's within range
-      as.write_lea(r8, MemoryReference(rsp, 0, r11, 8));
-      as.write_cmp(r8, r13);
-      as.write_jg("select_beyond_stack_end");
-      as.write_mov(rax, MemoryReference(r8, 0));
-      as.write_jmp("select_clear_stack");
-      as.write_label("select_beyond_stack_end");
-      as.write_xor(rax, rax);
-      as.write_label("select_clear_stack");
-      as.write_lea(rsp, MemoryReference(r10, 8)); // r10 includes count that was popped, so +8
-      as.write_push(rax);
-
-      as.write_label("skip_select_field");
-
-      // finally we're done
-      this->write_jump_to_cell_unknown_alignment(as, pos, pos.copy().move_forward());
-      break;
+      // the child thread moves in the opposite direction; it runs next, after
+      // the current thread yields at the beginning of the next cell
+      int64_t parent_token = this->allocate_token(cell,
+          pos.copy().move_forward());
+      int64_t child_token = this->allocate_token(cell,
+          pos.copy().turn_around().move_forward());
 
-    case '@': // end program
-      as.write_mov(r13, MemoryReference(rbp, -0x10));
-      as.write_mov(r12, MemoryReference(rbp, -0x08));
-      as.write_mov(rsp, rbp);
-      as.write_pop(rbp);
-      as.write_ret();
+      as.write_mov(rdi, this->common_object_reference("this"));
+      as.write_mov(rsi, parent_token);
+      as.write_mov(rdx, child_token);
+      as.write_mov(rcx, rsp);
+      as.write_mov(r8, r13);
+      as.write_mov(r9, rbp);
+      if (pos.stack_aligned) {
+        as.write_push(this->common_object_reference("jump_return_0"));
+      } else {
+        as.write_sub(rsp, 8);
+        as.write_push(this->common_object_reference("jump_return_8"));
+      }
+      as.write_jmp(this->common_object_reference("dispatch_fork_thread"));
       break;
+    }
 
     default:
       throw invalid_argument(string_printf(
@@ -1790,25 +1601,74 @@ void BefungeJITCompiler::compile_opcode(AMD64Assembler& as, const Position& pos,
   }
 }
 
-void BefungeJITCompiler::compile_opcode_iterated(AMD64Assembler& as,
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::compile_opcode_iterated(AMD64Assembler& as,
     const Position& iterator_pos, const Position& target_pos, int16_t opcode) {
   // iterator_pos and target_pos refer to the position before the count is
-  // popped (immediately below)
+  // popped (immediately below). the target opcode executes with the IP on the
+  // k, so execution continues from iterator_pos unless the opcode moves the IP
+  CompiledCell& cell = this->compiled_cells[iterator_pos];
 
   as.write_label(string_printf("iterated_subopcode_%c", opcode));
 
-  // get the iteration count
+  // get the iteration count. zero and negative counts skip the target
   as.write_cmp(rsp, r13);
   as.write_jg("opcode_end_zero_count_alignment_same");
 
   as.write_pop(r11);
   as.write_test(r11, r11);
-  as.write_jz("opcode_end_zero_count_alignment_changed");
+  as.write_jle("opcode_end_zero_count_alignment_changed");
 
+  // r10 is 1 if the stack alignment is different from what it was at the
+  // beginning of the cell. popping the count changed it
   as.write_mov(r10, 1);
 
-  // if the iteration count is odd, then the resulting jmp afterward may need to
-  // change stack alignments, so keep track of that here
+  // pushes the value in rdx r11 times (r11 must be positive). this doesn't
+  // return to the caller for large counts, so it must be the end of the kernel
+  auto write_fill = [&]() {
+    // the items have to fit above the stack limit. this is checked before
+    // moving rsp, which also keeps the shift from overflowing
+    as.write_mov(rax, rsp);
+    as.write_mov(rcx, this->common_object_reference("stack_limit_ptr"));
+    as.write_mov(rcx, MemoryReference(rcx, 0));
+    as.write_sub(rax, rcx);
+    as.write_sar(rax, 3);
+    as.write_cmp(r11, rax);
+    this->write_throw_error(this->write_cold_path_jump(as,
+        ColdPathCondition::Greater),
+        "stack is too large for k to push the items");
+
+    as.write_mov(rax, r11);
+    as.write_shl(rax, 3);
+    as.write_sub(rsp, rax);
+
+    as.write_cmp(r11, 0x40);
+    as.write_jg("fill_bulk");
+
+    as.write_xor(r10b, r11b, OperandSize::Byte);
+    as.write_and(r10b, 1, OperandSize::Byte);
+    as.write_label("fill_again");
+    as.write_dec(r11);
+    as.write_mov(MemoryReference(rsp, 0, r11, 8), rdx);
+    as.write_jnz("fill_again");
+    as.write_jmp("opcode_end");
+
+    as.write_label("fill_bulk");
+    as.write_mov(rdi, rsp);
+    as.write_mov(rsi, r11);
+    this->write_function_call_unknown_alignment(as,
+        this->common_object_reference("dispatch_fill_stack"));
+    this->write_jump_to_cell_unknown_alignment(as, iterator_pos,
+        iterator_pos.copy().move_forward());
+  };
+
+  // the helper pops the count again, so it goes back on the stack
+  auto write_iterated_helper_call = [&](const char* dispatch_function_name,
+      int64_t extra_arg) {
+    as.write_push(r11);
+    this->write_helper_call(as, cell, iterator_pos, dispatch_function_name,
+        extra_arg);
+  };
 
   switch (opcode) {
     case -1:
@@ -1831,21 +1691,48 @@ void BefungeJITCompiler::compile_opcode_iterated(AMD64Assembler& as,
     case 'd':
     case 'e':
     case 'f':
-      // the stack alignment will change once per loop iteration. if the
-      // iteration count is odd, the resulting alignment will be opposite.
-      as.write_xor(r10b, r11b, OperandSize::Byte);
-      as.write_and(r10b, 1, OperandSize::Byte);
+      as.write_mov(rdx, (opcode >= 'a') ? (opcode - 'a' + 10) : (opcode - '0'));
+      write_fill();
+      break;
 
-      as.write_label("iterate_again");
-      as.write_dec(r11);
-      as.write_js("iterate_done");
-      if (opcode >= 'a') {
-        as.write_push(opcode - 'a' + 10);
-      } else {
-        as.write_push(opcode - '0');
-      }
-      as.write_jmp("iterate_again");
-      as.write_label("iterate_done");
+    case ':': // duplicate top of stack n times
+      // if the stack is empty, the duplicated value is zero
+      as.write_xor(rdx, rdx);
+      as.write_cmp(rsp, r13);
+      as.write_cmovle(rdx, MemoryReference(rsp, 0));
+      write_fill();
+      break;
+
+    case '\\': // swap top 2 items on stack
+      // only the parity of the count matters, but if there are fewer than two
+      // items on the stack, the first swap pushes zeroes
+      as.write_cmp(rsp, r13);
+      as.write_jl("stack_sufficient");
+      as.write_jle("stack_one_item");
+      as.write_push(0);
+      as.write_push(0);
+      as.write_jmp("opcode_end");
+
+      as.write_label("stack_one_item");
+
+      as.write_pop(rax);
+      as.write_xor(r10b, 1, OperandSize::Byte);
+      as.write_test(r11, 1);
+      as.write_jz("stack_one_item_even");
+      as.write_push(rax);
+      as.write_push(0);
+      as.write_jmp("opcode_end");
+      as.write_label("stack_one_item_even");
+      as.write_push(0);
+      as.write_push(rax);
+      as.write_jmp("opcode_end");
+
+      as.write_label("stack_sufficient");
+      as.write_test(r11, 1);
+      as.write_jz("opcode_end");
+      as.write_pop(rax);
+      as.write_xchg(rax, MemoryReference(rsp, 0));
+      as.write_push(rax);
       break;
 
     case '$': // discard n stack items
@@ -1856,8 +1743,8 @@ void BefungeJITCompiler::compile_opcode_iterated(AMD64Assembler& as,
       // there aren't enough items on the stack to pop them all - just clear the
       // entire stack
       as.write_lea(rsp, MemoryReference(r13, 8));
-      this->write_jump_to_cell(as, iterator_pos,
-          iterator_pos.copy().move_forward().set_aligned(true));
+      this->write_jump_to_cell_unknown_alignment(as, iterator_pos,
+          iterator_pos.copy().move_forward());
 
       // there are enough items on the stack to pop them all. if we pop an odd
       // number of stack items, track the alignment change
@@ -1867,43 +1754,10 @@ void BefungeJITCompiler::compile_opcode_iterated(AMD64Assembler& as,
       as.write_mov(rsp, rdx);
       break;
 
-    case ',': // pop and print as ascii characters
-      // we'll pop n items off the stack, so keep track of alignment
-      as.write_xor(r10b, r11b, OperandSize::Byte);
-      as.write_and(r10b, 1, OperandSize::Byte);
-
-      // because we're calling another function, we have to expect r10/r11 to
-      // get destroyed. so we'll save them in r14 and r15 in this implementation
-      as.write_push(r10);
-      as.write_push(r14);
-      as.write_push(r15);
-      as.write_lea(r14, MemoryReference(rsp, 0x18));
-      if (iterator_pos.stack_aligned) {
-        as.write_sub(rsp, 8);
-      }
-
-      // r14 = current stack item ptr; r15 = past-the-last stack item ptr
-      as.write_lea(r15, MemoryReference(r14, 0, r11, 8));
-
-      as.write_label("iterate_again");
-      as.write_cmp(r14, r15);
-      as.write_je("iterate_done");
-      as.write_mov(rdi, MemoryReference(r14, 0));
-      as.write_call(this->common_object_reference("putchar"));
-      as.write_add(r14, 8);
-      as.write_jmp("iterate_again");
-      as.write_label("iterate_done");
-
-      // r15 is where the stack should be when we're done (the first item we
-      // didn't pop). so set that up and restore the reg values
-      as.write_mov(r8, r15);
-      if (iterator_pos.stack_aligned) {
-        as.write_add(rsp, 8);
-      }
-      as.write_mov(r15, MemoryReference(rsp, 0x00));
-      as.write_mov(r14, MemoryReference(rsp, 0x08));
-      as.write_mov(r10, MemoryReference(rsp, 0x10));
-      as.write_mov(rsp, r8);
+    case 'n': // clear stack entirely (once is enough)
+      as.write_lea(rsp, MemoryReference(r13, 8));
+      this->write_jump_to_cell_unknown_alignment(as, iterator_pos,
+          iterator_pos.copy().move_forward());
       break;
 
     case '`':
@@ -1912,20 +1766,21 @@ void BefungeJITCompiler::compile_opcode_iterated(AMD64Assembler& as,
     case '*':
     case '/':
     case '%':
-      as.write_test(r11, r11);
-      as.write_jz("opcode_end");
-
-      // if the stack is empty, leave it alone (the result is 0)
+      // the top item is the running result (in rcx); each iteration combines
+      // it with the next item. if the stack is empty, every iteration pops two
+      // zeroes, so the result is a single zero
       as.write_cmp(rsp, r13);
-      as.write_jg("opcode_end");
+      as.write_jle("stack_not_empty");
+      as.write_xor(rcx, rcx);
+      as.write_xor(r10b, 1, OperandSize::Byte); // track the alignment change
+      as.write_jmp("push_result");
 
+      as.write_label("stack_not_empty");
       as.write_pop(rcx);
 
       as.write_label("iterate_again");
       as.write_cmp(rsp, r13);
-      as.write_jg("stack_empty_in_loop");
-
-      // the stack isn't empty, so pop a value from it and combine appropriately
+      as.write_jg("stack_exhausted");
       as.write_pop(rax);
       as.write_xor(r10b, 1, OperandSize::Byte); // track the alignment change
 
@@ -1941,50 +1796,56 @@ void BefungeJITCompiler::compile_opcode_iterated(AMD64Assembler& as,
       } else if (opcode == '*') {
         as.write_imul(rcx, rax);
       } else {
-        as.write_xor(rdx, rdx);
         as.write_test(rcx, rcx);
         as.write_jz("division_by_zero");
-
+        as.write_mov(rdx, rax); // sign-extend the dividend into rdx
+        as.write_sar(rdx, 63);
         as.write_idiv(rcx);
         as.write_mov(rcx, (opcode == '%') ? rdx : rax);
         as.write_jmp("division_complete");
-
         as.write_label("division_by_zero");
         as.write_xor(rcx, rcx);
         as.write_label("division_complete");
       }
-      as.write_jmp("iterate_check");
+      as.write_dec(r11);
+      as.write_jnz("iterate_again");
+      as.write_jmp("push_result");
 
-      // the stack is empty. behave as if we had popped zero and terminate the
-      // loop early
-      as.write_label("stack_empty_in_loop");
+      // the stack ran out with r11 iterations left; the remaining items are
+      // zeroes, so the result can be computed directly
+      as.write_label("stack_exhausted");
       if (opcode == '`') {
-        this->write_throw_error(as,
-            "unimplemented stack empty condition on iterated ` opcode");
+        // (0 > x) is 0 or 1, so after two iterations the result is zero
+        as.write_xor(rax, rax);
+        as.write_cmp(r11, 1);
+        as.write_jne("exhausted_compare_done");
+        as.write_cmp(rcx, 0);
+        as.write_setl(al);
+        as.write_label("exhausted_compare_done");
+        as.write_mov(rcx, rax);
       } else if (opcode == '-') {
+        // (0 - x) alternates between -x and x
         as.write_test(r11, 1);
-        as.write_jnz("skip_neg");
+        as.write_jz("push_result");
         as.write_neg(rcx);
-        as.write_label("skip_neg");
       } else if (opcode != '+') {
         as.write_xor(rcx, rcx);
       }
-      as.write_push(rcx);
-      as.write_jmp("opcode_end");
 
-      as.write_label("iterate_check");
-      as.write_dec(r11);
-      as.write_jnz("iterate_again");
+      as.write_label("push_result");
+      as.write_push(rcx);
       break;
 
     case '!': // logical not
+      as.write_mov(rcx, r11);
+      as.write_and(rcx, 1);
+
       as.write_cmp(rsp, r13);
       as.write_jle("stack_sufficient");
 
-      // if the iteration count is even, leave the stack alone
-      as.write_test(r11, 1);
-      as.write_jz("opcode_end");
-      as.write_push(1);
+      // if the stack is empty, the result is 1 for an odd count and 0 for an
+      // even count
+      as.write_push(rcx);
       as.write_xor(r10b, 1, OperandSize::Byte); // track the alignment change
       as.write_jmp("opcode_end");
 
@@ -1992,43 +1853,70 @@ void BefungeJITCompiler::compile_opcode_iterated(AMD64Assembler& as,
       as.write_pop(rax);
       as.write_test(rax, rax);
       as.write_setnz(al);
-      as.write_mov(r10b, r11b, OperandSize::Byte);
-      as.write_and(r10b, 1, OperandSize::Byte);
-      as.write_xor(al, r10b, OperandSize::Byte);
+      as.write_xor(al, cl, OperandSize::Byte);
       as.write_movzx8(rax, al);
       as.write_push(rax);
       break;
 
+    case 'z': // "go through" (noop)
+      break;
+
+    case '@': // end program; the count doesn't matter
+      this->write_end_program(as, !iterator_pos.stack_aligned);
+      break;
+
     case '<': // move left
     case '>': // move right
     case '^': // move up
     case 'v': // move down
     case 'h': // move above
     case 'l': { // move below
-      as.write_test(r11, r11);
-      as.write_jz("opcode_end");
-      as.write_test(r10b, r10b, OperandSize::Byte);
-      as.write_jnz("other_alignment");
-
-      Position result_pos = target_pos.copy();
+      Position result_pos = iterator_pos.copy().change_alignment();
       if (opcode == '<') {
         result_pos.face(-1, 0, 0).move_forward();
       } else if (opcode == '>') {
         result_pos.face(1, 0, 0).move_forward();
       } else if (opcode == '^') {
+        this->check_dimensions(2, target_pos, '^');
         result_pos.face(0, -1, 0).move_forward();
       } else if (opcode == 'v') {
+        this->check_dimensions(2, target_pos, 'v');
         result_pos.face(0, 1, 0).move_forward();
       } else if (opcode == 'h') {
+        this->check_dimensions(3, target_pos, 'h');
         result_pos.face(0, 0, -1).move_forward();
       } else if (opcode == 'l') {
+        this->check_dimensions(3, target_pos, 'l');
         result_pos.face(0, 0, 1).move_forward();
       }
       this->write_jump_to_cell(as, iterator_pos, result_pos);
+      break;
+    }
 
-      as.write_label("other_alignment");
-      result_pos.change_alignment();
-      this->write_jump_to_cell(as, iterator_pos, result_pos);
+    case 'r': // reverse; only the parity of the count matters
+      as.write_test(r11, 1);
+      as.write_jz("opcode_end");
+      this->write_jump_to_cell(as, iterator_pos,
+          iterator_pos.copy().change_alignment().turn_around().move_forward());
+      break;
+
+    case '?': { // move randomly
+      // only the last direction matters, but the generator is still stepped
+      // once per iteration so the sequence matches the interpreter's
+      as.write_label("iterate_again");
+      as.write_dec(r11);
+      as.write_jz("iterate_done");
+      this->write_random_index(as, Dimensions * 2);
+      as.write_jmp("iterate_again");
+      as.write_label("iterate_done");
+
+      // the count was popped, so the alignment changed
+      this->write_random_index(as, Dimensions * 2);
+      as.write_mov(rcx, "jump_table");
+      as.write_jmp(MemoryReference(rcx, 0, rax, 8));
+      this->write_jump_table(as, "jump_table", iterator_pos,
+          this->random_direction_positions(
+            iterator_pos.copy().change_alignment()));
       break;
     }
 
@@ -2040,23 +1928,12 @@ void BefungeJITCompiler::compile_opcode_iterated(AMD64Assembler& as,
     case ']': { // turn right
       this->check_dimensions(2, target_pos, ']');
 
+      // the count was popped, so the alignment changed
       as.write_and(r11, 3);
-      as.write_test(r10, 1);
-      as.write_jnz("other_alignment");
-
-      as.write_mov(rcx, "same_alignment_jump_table");
-      as.write_jmp(MemoryReference(rcx, 0, r11, 8));
-      this->write_jump_table(as, "same_alignment_jump_table", iterator_pos, {
-          iterator_pos.copy().move_forward(),
-          iterator_pos.copy().turn_right().move_forward(),
-          iterator_pos.copy().turn_right().turn_right().move_forward(),
-          iterator_pos.copy().turn_right().turn_right().turn_right().move_forward()});
-
-      as.write_label("other_alignment");
       const Position iterator_pos_realigned = iterator_pos.copy().change_alignment();
-      as.write_mov(rcx, "other_alignment_jump_table");
+      as.write_mov(rcx, "jump_table");
       as.write_jmp(MemoryReference(rcx, 0, r11, 8));
-      this->write_jump_table(as, "other_alignment_jump_table", iterator_pos, {
+      this->write_jump_table(as, "jump_table", iterator_pos, {
           iterator_pos_realigned.copy().move_forward(),
           iterator_pos_realigned.copy().turn_right().move_forward(),
           iterator_pos_realigned.copy().turn_right().turn_right().move_forward(),
@@ -2103,34 +1980,198 @@ void BefungeJITCompiler::compile_opcode_iterated(AMD64Assembler& as,
       break;
     }
 
-    // TODO HERE: convert the rest of this function to iterated opcodes
-
-    default:
-      throw invalid_argument(string_printf(
-          "can\'t compile iterated character %c at (%zd, %zd)", opcode, target_pos.x, target_pos.y));
-  }
+    case '\"': { // toggle string mode
+      // if the count is even, string mode is off when the IP leaves the k, so
+      // the quote starts a string as usual
+      as.write_test(r11, 1);
+      as.write_jz("opcode_end");
 
-  as.write_label("opcode_end");
-  as.write_test(r10b, r10b, OperandSize::Byte);
-  as.write_jnz("opcode_end_alignment_changed");
-  this->write_jump_to_cell(as, iterator_pos, iterator_pos.copy().move_forward());
+      // if the count is odd, string mode is on, so the cells between the k and
+      // the quote are pushed and the quote ends the string
+      Position char_pos = iterator_pos.copy().change_alignment().move_forward()
+          .wrap_lahey(this->field);
+      int16_t last_value = 0;
+      vector<int16_t> values;
+      while ((char_pos.x != target_pos.x) || (char_pos.y != target_pos.y) ||
+             (char_pos.z != target_pos.z)) {
+        int16_t value = this->get_dependent_value(iterator_pos, char_pos);
+        if ((value != ' ') || (last_value != ' ')) {
+          values.emplace_back(value);
+          char_pos.change_alignment();
+        }
+        char_pos.move_forward().wrap_lahey(this->field);
+        last_value = value;
+      }
+      this->write_push_string(as, values);
+      this->write_jump_to_cell(as, iterator_pos, char_pos.move_forward());
+      break;
+    }
 
-  as.write_label("opcode_end_alignment_changed");
-  this->write_jump_to_cell(as, iterator_pos,
-      iterator_pos.copy().move_forward().change_alignment());
+    case 't': { // split the IP n times
+      // without threads, t acts like r, so only the parity of the count
+      // matters
+      if (!this->concurrent) {
+        this->warn_about_late_t(target_pos);
+        as.write_test(r11, 1);
+        as.write_jz("opcode_end");
+        this->write_jump_to_cell(as, iterator_pos,
+            iterator_pos.copy().change_alignment().turn_around().move_forward());
+        break;
+      }
 
-  // if the target did not execute (the count was zero), then we move forward
-  // from target_pos instead of iterator_pos because the target could not have
-  // changed the execution direction
-  as.write_label("opcode_end_zero_count_alignment_same");
-  this->write_jump_to_cell(as, iterator_pos, target_pos.copy().move_forward());
+      // like t, but the count is passed as the seventh argument, so it goes on
+      // the stack above the return address
+      const Position realigned_pos = iterator_pos.copy().change_alignment();
+      int64_t parent_token = this->allocate_token(cell,
+          realigned_pos.copy().move_forward());
+      int64_t child_token = this->allocate_token(cell,
+          realigned_pos.copy().turn_around().move_forward());
 
-  as.write_label("opcode_end_zero_count_alignment_changed");
+      as.write_mov(rdi, this->common_object_reference("this"));
+      as.write_mov(rsi, parent_token);
+      as.write_mov(rdx, child_token);
+      as.write_mov(rcx, rsp);
+      as.write_mov(r8, r13);
+      as.write_mov(r9, rbp);
+      if (realigned_pos.stack_aligned) {
+        as.write_sub(rsp, 0x38);
+        as.write_push(r11);
+        as.write_push(this->common_object_reference("jump_return_40"));
+      } else {
+        as.write_push(r11);
+        as.write_push(this->common_object_reference("jump_return_8"));
+      }
+      as.write_jmp(this->common_object_reference("dispatch_fork_threads"));
+      break;
+    }
+
+    case 'w':
+    case 'x':
+    case '|':
+      this->check_dimensions(2, target_pos, opcode);
+    case 'm':
+      if (opcode == 'm') {
+        this->check_dimensions(3, target_pos, opcode);
+      }
+    case ',':
+    case '.':
+    case '&':
+    case '~':
+    case 'g':
+    case 'p':
+    case 's':
+    case '\'':
+    case 'j':
+    case '_':
+    case 'y':
+    case 'i':
+    case '{':
+    case '}':
+    case 'u':
+    case '(':
+    case ')':
+      write_iterated_helper_call("dispatch_iterated_opcode", opcode);
+      break;
+
+    case 'A':
+    case 'B':
+    case 'C':
+    case 'D':
+    case 'E':
+    case 'F':
+    case 'G':
+    case 'H':
+    case 'I':
+    case 'J':
+    case 'K':
+    case 'L':
+    case 'M':
+    case 'N':
+    case 'O':
+    case 'P':
+    case 'Q':
+    case 'R':
+    case 'S':
+    case 'T':
+    case 'U':
+    case 'V':
+    case 'W':
+    case 'X':
+    case 'Y':
+    case 'Z': { // fingerprint instructions
+      if (this->concurrent) {
+        write_iterated_helper_call("dispatch_iterated_letter", opcode);
+        break;
+      }
+
+      this->letter_cells[opcode - 'A'].emplace(iterator_pos);
+
+      const auto& semantics = this->letter_semantics[opcode - 'A'];
+      const FingerprintSemantic* semantic = semantics.empty() ? NULL :
+          semantics.back();
+      if (!semantic || (semantic->type == FingerprintSemantic::Type::Reflect)) {
+        as.write_test(r11, 1);
+        as.write_jz("opcode_end");
+        this->write_jump_to_cell(as, iterator_pos,
+            iterator_pos.copy().change_alignment().turn_around().move_forward());
+
+      } else if (semantic->type == FingerprintSemantic::Type::PushConstant) {
+        as.write_mov(rdx, semantic->value);
+        write_fill();
+
+      } else {
+        write_iterated_helper_call("dispatch_iterated_fingerprint",
+            reinterpret_cast<int64_t>(semantic->function));
+      }
+      break;
+    }
+
+    // each inner k pops its own count and iterates the instruction after it;
+    // this is rare enough to leave to the helper
+    case 'k':
+      write_iterated_helper_call("dispatch_iterated_opcode", opcode);
+      break;
+
+    default:
+      throw invalid_argument(string_printf(
+          "can\'t compile iterated character %c at (%zd, %zd)", opcode, target_pos.x, target_pos.y));
+  }
+
+  as.write_label("opcode_end");
+  as.write_test(r10b, r10b, OperandSize::Byte);
+  as.write_jnz("opcode_end_alignment_changed");
+  this->write_jump_to_cell(as, iterator_pos, iterator_pos.copy().move_forward());
+
+  as.write_label("opcode_end_alignment_changed");
+  this->write_jump_to_cell(as, iterator_pos,
+      iterator_pos.copy().move_forward().change_alignment());
+
+  // if the target did not execute (the count was zero), then we move forward
+  // from target_pos instead of iterator_pos because the target could not have
+  // changed the execution direction
+  as.write_label("opcode_end_zero_count_alignment_same");
+  this->write_jump_to_cell(as, iterator_pos, target_pos.copy().move_forward());
+
+  as.write_label("opcode_end_zero_count_alignment_changed");
   this->write_jump_to_cell(as, iterator_pos,
       target_pos.copy().move_forward().change_alignment());
 }
 
-const void* BefungeJITCompiler::compile_cell(const Position& cell_pos,
+// returns the offsets of the labels named <prefix><index>, by index
+static vector<size_t> get_indexed_label_offsets(
+    const multimap<size_t, string>& label_offsets, const string& prefix,
+    size_t count) {
+  vector<size_t> ret(count);
+  for (const auto& it : label_offsets) {
+    if (!it.second.compare(0, prefix.size(), prefix)) {
+      ret.at(stoul(it.second.substr(prefix.size()))) = it.first;
+    }
+  }
+  return ret;
+}
+
+template <uint8_t Dimensions>
+const void* BefungeJITCompiler<Dimensions>::compile_cell(const Position& cell_pos,
     bool reset_cell) {
   // we'll compile the given cell, and any other cells that depend on its
   // address (but only if its address changes)
@@ -2148,8 +2189,26 @@ const void* BefungeJITCompiler::compile_cell(const Position& cell_pos,
     string data;
     unordered_set<size_t> patch_offsets;
     multimap<size_t, std::string> label_offsets;
-    if (!reset_cell) {
+    string cold_data;
+    unordered_set<size_t> cold_patch_offsets;
+    vector<size_t> cold_path_offsets;
+    vector<size_t> cold_jump_offsets;
+    if (!reset_cell && !pos.special_cell_id && this->can_use_opcode_template(
+        pos, this->field.get(pos.x, pos.y, pos.z))) {
+      opcode = this->field.get(pos.x, pos.y, pos.z);
+      this->clear_value_dependencies(pos, cell);
+      this->release_tokens(cell);
+      OpcodeTemplate code = this->compile_opcode_from_template(pos, opcode);
+      data = move(code.data);
+      patch_offsets = move(code.patch_offsets);
+      cold_data = move(code.cold_data);
+      cold_patch_offsets = move(code.cold_patch_offsets);
+      cold_path_offsets = move(code.cold_path_offsets);
+      cold_jump_offsets = move(code.cold_jump_offsets);
+
+    } else if (!reset_cell) {
       AMD64Assembler as;
+      AMD64Assembler cold_as;
       as.write_label(pos.label());
 
       if (pos.special_cell_id == 1) {
@@ -2160,61 +2219,200 @@ const void* BefungeJITCompiler::compile_cell(const Position& cell_pos,
         as.write_mov(r12, reinterpret_cast<int64_t>(this->common_objects.data()));
         as.write_push(r13);
 
+        // in concurrent mode, the program ends from whichever thread executes
+        // the last @, which may not be running on this stack
+        if (this->concurrent) {
+          as.write_mov(rax, this->common_object_reference("main_thread_frame_ptr"));
+          as.write_mov(MemoryReference(rax, 0), rbp);
+        }
+
         // set up storage offset
-        for (uint8_t x = 0; x < this->dimensions; x++) {
+        for (uint8_t x = 0; x < Dimensions; x++) {
           as.write_push(0);
         }
 
         as.write_lea(r13, MemoryReference(rsp, -8));
 
         this->write_jump_to_cell(as, pos, Position(0, 0, 0, 1, 0, 0,
-            !(this->dimensions & 1)));
+            !(Dimensions & 1)));
 
       } else {
         opcode = this->field.get(pos.x, pos.y, pos.z);
 
+        // the new code may not read the same remote cells as the old code
+        this->clear_value_dependencies(pos, cell);
+
+        if (this->max_code_size) {
+          as.write_mov(rax, reinterpret_cast<int64_t>(&cell.accessed));
+          as.write_mov(MemoryReference(rax, 0), 1, OperandSize::Byte);
+        }
+
+        // in concurrent mode, every cell that takes a tick first lets the
+        // other threads run. spaces and semicolons take no time, so they
+        // don't yield
+        if (this->concurrent && (opcode != ' ') && (opcode != ';')) {
+          as.write_mov(rax, "thread_resume");
+          as.write_jmp(this->common_object_reference("yield"));
+          as.write_label("thread_resume");
+        }
+
         // remove the position token if the cell has one already
-        for (auto it = cell.next_position_tokens.begin();
-             it != cell.next_position_tokens.end();
-             it = cell.next_position_tokens.erase(it)) {
-          this->token_to_position.erase(*it);
+        this->release_tokens(cell);
+
+        if (this->should_call_debug_hook(pos)) {
+          this->write_debug_hook_call(as, cell, pos);
         }
 
-        this->compile_opcode(as, pos, opcode);
+        if (this->volatile_cells.count(Position(pos.x, pos.y, pos.z, 0, 0, 0))) {
+          this->write_helper_call(as, cell, pos, "dispatch_volatile_cell");
+        } else {
+          this->cold_as = &cold_as;
+          this->num_cold_paths = 0;
+          try {
+            this->compile_opcode(as, pos, opcode);
+          } catch (...) {
+            this->cold_as = NULL;
+            throw;
+          }
+          this->cold_as = NULL;
+        }
       }
 
       // at this point the code for the cell is complete; we can assemble it and
       // put it in the buffer appropriately
       data = as.assemble(&patch_offsets, &label_offsets);
+      if (this->num_cold_paths) {
+        multimap<size_t, string> cold_label_offsets;
+        cold_data = cold_as.assemble(&cold_patch_offsets, &cold_label_offsets);
+        cold_path_offsets = get_indexed_label_offsets(cold_label_offsets,
+            "cold_path_", this->num_cold_paths);
+        cold_jump_offsets = get_indexed_label_offsets(label_offsets,
+            "cold_jump_", this->num_cold_paths);
+      }
+    }
+
+    size_t resume_offset = 0;
+    size_t body_offset = 0;
+    for (const auto& it : label_offsets) {
+      if (it.second == "thread_resume") {
+        resume_offset = it.first;
+      } else if (it.second == "debug_hook_return") {
+        body_offset = it.first;
+      }
     }
+    const void* old_resume = cell.code ?
+        reinterpret_cast<const uint8_t*>(cell.code) + cell.resume_offset : NULL;
 
+    // cells that jump here through the slot don't need to be recompiled when
+    // the code moves; they only need to be recompiled if the cell is reset
     bool recompile_dependencies;
+    bool recompile_slot_dependencies = false;
     if (data.empty()) {
-      // TODO: this leaks memory in the code buffer when resetting cells that
-      // previously had code. fix this.
+      this->clear_value_dependencies(pos, cell);
+
+      this->retire_code(this->hot_code, cell.code, cell.buffer_capacity);
       cell.code = NULL;
       cell.code_size = 0;
       cell.buffer_capacity = 0;
+      this->retire_code(this->cold_code, cell.cold_path_code,
+          cell.cold_path_capacity);
+      cell.cold_path_code = NULL;
+      cell.cold_path_capacity = 0;
       recompile_dependencies = true;
+      recompile_slot_dependencies = true;
 
-    } else if (cell.buffer_capacity < data.size()) {
-      cell.code = this->buf.append(data, &patch_offsets);
-      cell.code_size = data.size();
-      cell.buffer_capacity = cell.code_size;
+    } else {
+      // returns true if the main code moved. if it did, we need to recompile
+      // all the cells that embed this cell's address. clear the address deps,
+      // since they'll be repopulated during recompilation if the new compiled
+      // form depends on the new address (it probably does, but w/e - should be
+      // correct). if the new code fit in the old code's space, all the cells
+      // that jump to it are still correct
+      auto place_code = [&]() -> bool {
+        if (cell.buffer_capacity < data.size()) {
+          this->retire_code(this->hot_code, cell.code, cell.buffer_capacity);
+          cell.code = this->allocate_code(this->hot_code, data, patch_offsets,
+              &cell.buffer_capacity);
+          cell.code_size = data.size();
+          return true;
+        }
+        this->buf.overwrite(cell.code, data, &patch_offsets);
+        cell.code_size = data.size();
+        return false;
+      };
+      recompile_dependencies = place_code();
+
+      // the jumps to the cold paths are relative, so they're linked after both
+      // blocks have been placed, and the main code is written again. the cold
+      // paths are only reachable through those jumps, so nothing else has to
+      // change when they move
+      if (cold_data.empty()) {
+        this->retire_code(this->cold_code, cell.cold_path_code,
+            cell.cold_path_capacity);
+        cell.cold_path_code = NULL;
+        cell.cold_path_capacity = 0;
+      } else {
+        if (cell.cold_path_capacity < cold_data.size()) {
+          this->retire_code(this->cold_code, cell.cold_path_code,
+              cell.cold_path_capacity);
+          cell.cold_path_code = this->allocate_code(this->cold_code, cold_data,
+              cold_patch_offsets, &cell.cold_path_capacity);
+        } else {
+          this->cold_buf.overwrite(cell.cold_path_code, cold_data,
+              &cold_patch_offsets);
+        }
 
-      // the address changed - need to recompile all the cells that depend
-      // on this cell's address. clear the address deps, since they'll be
-      // repopulated during recompilation if the new compiled form depends
-      // on the new address (it probably does, but w/e - should be correct)
-      recompile_dependencies = true;
+        int64_t cold_path_distance =
+            reinterpret_cast<int64_t>(cell.cold_path_code) -
+            reinterpret_cast<int64_t>(cell.code);
+        if (this->link_cold_paths(data, cold_path_distance, cold_path_offsets,
+            cold_jump_offsets)) {
+          this->buf.overwrite(cell.code, data, &patch_offsets);
 
-    } else {
-      this->buf.overwrite(cell.code, data, &patch_offsets);
-      cell.code_size = data.size();
+        } else {
+          // the two buffers' blocks are usually next to each other, but mmap
+          // doesn't promise that. if the cold paths are out of reach, they go
+          // after the main code instead, and the addresses within them are
+          // adjusted to be relative to the start of the combined block
+          this->retire_code(this->cold_code, cell.cold_path_code,
+              cell.cold_path_capacity);
+          cell.cold_path_code = NULL;
+          cell.cold_path_capacity = 0;
+
+          size_t cold_start = data.size();
+          data += cold_data;
+          for (size_t offset : cold_patch_offsets) {
+            char* value_ptr = const_cast<char*>(data.data()) + cold_start +
+                offset;
+            int64_t value;
+            memcpy(&value, value_ptr, sizeof(value));
+            value += cold_start;
+            memcpy(value_ptr, &value, sizeof(value));
+            patch_offsets.emplace(cold_start + offset);
+          }
+          if (!this->link_cold_paths(data, cold_start, cold_path_offsets,
+              cold_jump_offsets)) {
+            throw logic_error("cold paths out of reach within the cell");
+          }
+          recompile_dependencies |= place_code();
+        }
+      }
+    }
 
-      // the new code fit in the old code's space, so all the cells that jump to
-      // the new code are still correct
-      recompile_dependencies = false;
+    cell.resume_offset = resume_offset;
+    cell.body_offset = body_offset;
+    cell.accessed = 1;
+    if (cell.slot.pos) {
+      cell.slot.entry.store(
+          cell.code ? cell.code : this->slot_trampoline_function,
+          memory_order_release);
+    }
+    if (this->concurrent && old_resume) {
+      const void* new_resume = cell.code ?
+          reinterpret_cast<const uint8_t*>(cell.code) + cell.resume_offset : NULL;
+      if (new_resume != old_resume) {
+        this->relocate_suspended_threads(pos, old_resume, new_resume);
+      }
     }
 
     if (recompile_dependencies) {
@@ -2225,10 +2423,26 @@ const void* BefungeJITCompiler::compile_cell(const Position& cell_pos,
           fprintf(stderr, "%s depends on %s\n", dependency_str.c_str(),
               pos_str.c_str());
         }
-        pending_positions.emplace(dependency_pos);
+        if (this->defer_dependency_updates) {
+          this->deferred_dependency_updates.emplace(dependency_pos);
+        } else {
+          pending_positions.emplace(dependency_pos);
+        }
       }
       cell.address_dependencies.clear();
     }
+    if (recompile_slot_dependencies) {
+      for (const auto& dependency_pos : cell.slot_dependencies) {
+        if (this->debug_flags & DebugFlag::ShowCompilationEvents) {
+          string pos_str = pos.str();
+          string dependency_str = dependency_pos.str();
+          fprintf(stderr, "%s jumps to %s\n", dependency_str.c_str(),
+              pos_str.c_str());
+        }
+        pending_positions.emplace(dependency_pos);
+      }
+      cell.slot_dependencies.clear();
+    }
 
     if (!reset_cell && !cell.code) {
       throw logic_error("cell code address not set after compilation");
@@ -2248,6 +2462,13 @@ const void* BefungeJITCompiler::compile_cell(const Position& cell_pos,
               reinterpret_cast<uint64_t>(cell.code), &label_offsets);
           fprintf(stderr, "compiled cell %s (opcode = %02hX \'%c\'):\n%s\n\n",
               pos_str.c_str(), opcode, opcode, dasm.c_str());
+          if (cell.cold_path_code) {
+            string cold_dasm = AMD64Assembler::disassemble(cell.cold_path_code,
+                cold_data.size(),
+                reinterpret_cast<uint64_t>(cell.cold_path_code));
+            fprintf(stderr, "cold paths of cell %s:\n%s\n\n",
+                pos_str.c_str(), cold_dasm.c_str());
+          }
         } else {
           fprintf(stderr, "compiled cell %s (opcode = %02hX \'%c\')\n",
               pos_str.c_str(), opcode, opcode);
@@ -2261,409 +2482,2697 @@ const void* BefungeJITCompiler::compile_cell(const Position& cell_pos,
   return this->compiled_cells.at(cell_pos).code;
 }
 
-void BefungeJITCompiler::on_cell_contents_changed(int64_t x, int64_t y, int64_t z) {
-  if (this->debug_flags & DebugFlag::SingleStep) {
-    char ch = this->field.get(x, y, z);
-    fprintf(stderr, "cell contents changed at x=%" PRId64 " y=%" PRId64 " z=%" PRId64 " with value=%02hhX (\'%c\')\n",
-        x, y, z, ch, ch);
-  }
-
-  // reset all the cells that this could affect
-  // TODO: we should check for remote opcodes, like ", ;, or k here. one
-  // solution could just be to reset the entire row and column, but that seems
-  // too heavy. ideally we would have a notion of value dependencies as well as
-  // address dependencies, and would use that here
-  int64_t min_dx = -0x8000000000000000;
-  Position pos(x, y, z, min_dx, min_dx, min_dx, false);
-  for (auto it = this->compiled_cells.lower_bound(pos);
-       it != this->compiled_cells.end(); it++) {
-    if ((it->first.x != pos.x) || (it->first.y != pos.y) || (it->first.z != pos.z)) {
-      break;
+static void erase_code_block_by_size(
+    multimap<size_t, uint8_t*>& blocks_by_size, size_t size, uint8_t* code) {
+  auto its = blocks_by_size.equal_range(size);
+  for (auto it = its.first; it != its.second; it++) {
+    if (it->second == code) {
+      blocks_by_size.erase(it);
+      return;
     }
-    if (this->debug_flags & DebugFlag::SingleStep) {
-      string s = it->first.str();
-      fprintf(stderr, "- deleting compiled code for cell at %s\n", s.c_str());
-    }
-    this->compile_cell(it->first, true);
   }
+  throw logic_error("free code block missing from size index");
 }
 
-void BefungeJITCompiler::write_function_call(AMD64Assembler& as,
-    const MemoryReference& function_ref, bool stack_aligned) {
-  if (!stack_aligned) {
-    as.write_sub(rsp, 8);
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::CodeAllocator::CodeAllocator(CodeBuffer* buf) : buf(buf),
+    append_end(NULL) { }
+
+template <uint8_t Dimensions>
+void* BefungeJITCompiler<Dimensions>::CodeAllocator::allocate(const string& data,
+    const unordered_set<size_t>& patch_offsets, size_t* capacity) {
+  auto size_it = this->free_blocks_by_size.lower_bound(data.size());
+  if (size_it == this->free_blocks_by_size.end()) {
+    uint8_t* code = reinterpret_cast<uint8_t*>(
+        this->buf->append(data, &patch_offsets));
+    if (code != this->append_end) {
+      this->region_starts.emplace(code);
+    }
+    this->append_end = code + data.size();
+    *capacity = data.size();
+    return code;
   }
-  as.write_call(function_ref);
-  if (!stack_aligned) {
-    as.write_add(rsp, 8);
+
+  // free blocks are already merged with their neighbors, so the remainder of
+  // a split block can't be adjacent to another free block
+  uint8_t* code = size_it->second;
+  size_t block_size = size_it->first;
+  this->free_blocks_by_size.erase(size_it);
+  this->free_blocks.erase(code);
+  if (block_size - data.size() >= min_split_code_block_size) {
+    this->free_blocks.emplace(code + data.size(), block_size - data.size());
+    this->free_blocks_by_size.emplace(block_size - data.size(),
+        code + data.size());
+    block_size = data.size();
   }
-}
 
-void BefungeJITCompiler::write_function_call_unknown_alignment(
-    AMD64Assembler& as, const MemoryReference& function_ref) {
-  as.write_xor(rax, rax); // rax = 0
-  as.write_test(rsp, 8);
-  as.write_setz(al); // rax = (rsp & 8) ? 1 : 0
-  as.write_neg(rax); // rax = -1 if aligned for call, 0 if misaligned for call
-  as.write_lea(rax, MemoryReference(rsp, -8, rax, 8)); // move rsp back by 16 if aligned, 8 if misaligned
-  as.write_mov(MemoryReference(rax, 0), rsp); // save what rsp should be on return
-  as.write_mov(rsp, rax); // set up rsp for call
-  as.write_call(function_ref);
-  as.write_pop(rsp); // restore rsp on return
+  this->buf->overwrite(code, data, &patch_offsets);
+  *capacity = block_size;
+  return code;
 }
 
-void BefungeJITCompiler::write_jump_to_cell(AMD64Assembler& as,
-    const Position& cell_pos, const Position& next_pos) {
-  Position& next_pos_norm = next_pos.copy().wrap_lahey(this->field);
-  auto& next_cell = this->compiled_cells[next_pos_norm];
-
-  if (this->debug_flags & DebugFlag::InteractiveDebug) {
-    as.write_mov(rdi, this->common_object_reference("this"));
-    as.write_mov(rdx, rsp);
-    as.write_push(cell_pos.stack_aligned);
-    as.write_push(cell_pos.dz);
-    as.write_push(cell_pos.dy);
-    as.write_push(cell_pos.dx);
-    as.write_push(cell_pos.z);
-    as.write_push(cell_pos.y);
-    as.write_push(cell_pos.x);
-    as.write_mov(rsi, rsp);
-    as.write_mov(rcx, r13);
-    as.write_lea(r8, this->end_of_last_stack_reference());
-    as.write_lea(r9, this->storage_offset_reference(this->dimensions - 1));
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::CodeAllocator::retire(void* code, size_t capacity) {
+  this->retired_blocks.emplace_back(reinterpret_cast<uint8_t*>(code),
+      capacity);
+}
 
-    if (next_pos.stack_aligned) {
-      as.write_sub(rsp, 8);
-    }
-    as.write_call(this->common_object_reference("dispatch_interactive_debug_hook"));
-    if (next_pos.stack_aligned) {
-      as.write_add(rsp, 8 * 8);
-    } else {
-      as.write_add(rsp, 7 * 8);
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::CodeAllocator::reclaim() {
+  for (const auto& block : this->retired_blocks) {
+    uint8_t* code = block.first;
+    size_t size = block.second;
+
+    auto next_it = this->free_blocks.find(code + size);
+    if ((next_it != this->free_blocks.end()) &&
+        !this->region_starts.count(next_it->first)) {
+      erase_code_block_by_size(this->free_blocks_by_size, next_it->second,
+          next_it->first);
+      size += next_it->second;
+      this->free_blocks.erase(next_it);
     }
-  }
 
-  if (next_cell.code) {
-    as.write_jmp_abs(next_cell.code);
-  } else {
-    // dispatch_compile_cell returns the newly-compiled cell's entry point, so
-    // we can just jump to that
-    as.write_mov(rdi, this->common_object_reference("this"));
-    as.write_push(next_pos_norm.stack_aligned);
-    as.write_push(next_pos_norm.dz);
-    as.write_push(next_pos_norm.dy);
-    as.write_push(next_pos_norm.dx);
-    as.write_push(next_pos_norm.z);
-    as.write_push(next_pos_norm.y);
-    as.write_push(next_pos_norm.x);
-    as.write_mov(rsi, rsp);
-    if (next_pos_norm.stack_aligned) {
-      as.write_sub(rsp, 8);
-      as.write_push(this->common_object_reference("jump_return_40"));
-    } else {
-      as.write_push(this->common_object_reference("jump_return_38"));
+    auto prev_it = this->free_blocks.lower_bound(code);
+    if ((prev_it != this->free_blocks.begin()) &&
+        !this->region_starts.count(code)) {
+      prev_it--;
+      if (prev_it->first + prev_it->second == code) {
+        erase_code_block_by_size(this->free_blocks_by_size, prev_it->second,
+            prev_it->first);
+        code = prev_it->first;
+        size += prev_it->second;
+        this->free_blocks.erase(prev_it);
+      }
     }
-    as.write_jmp(this->common_object_reference("dispatch_compile_cell"));
+
+    this->free_blocks.emplace(code, size);
+    this->free_blocks_by_size.emplace(size, code);
   }
+  this->retired_blocks.clear();
+}
 
-  next_cell.address_dependencies.emplace(cell_pos);
+template <uint8_t Dimensions>
+void* BefungeJITCompiler<Dimensions>::allocate_code(CodeAllocator& allocator,
+    const string& data, const unordered_set<size_t>& patch_offsets,
+    size_t* capacity) {
+  void* code = allocator.allocate(data, patch_offsets, capacity);
+  this->live_code_size += *capacity;
+  return code;
 }
 
-void BefungeJITCompiler::write_jump_to_cell_unknown_alignment(
-    AMD64Assembler& as, const Position& cell_pos, const Position& next_pos) {
-  as.write_test(rsp, 8);
-  as.write_jz("stack_aligned_" + next_pos.str());
-  this->write_jump_to_cell(as, cell_pos, next_pos.copy().set_aligned(false));
-  as.write_label("stack_aligned_" + next_pos.str());
-  this->write_jump_to_cell(as, cell_pos, next_pos.copy().set_aligned(true));
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::retire_code(CodeAllocator& allocator, void* code,
+    size_t capacity) {
+  if (code && capacity) {
+    this->live_code_size -= capacity;
+    allocator.retire(code, capacity);
+  }
 }
 
-void BefungeJITCompiler::write_jump_table(AMD64Assembler& as,
-    const string& label_name, const Position& pos,
-    const vector<Position>& positions) {
-  vector<Position> normal_positions;
-  for (const auto& next_pos : positions) {
-    normal_positions.emplace_back(next_pos.copy().wrap_lahey(this->field));
-  }
-
-  vector<int64_t> jump_table_contents;
-  for (Position next_pos : normal_positions) {
-    CompiledCell& next_cell = this->compiled_cells[next_pos];
-    if (next_cell.code) {
-      jump_table_contents.emplace_back(reinterpret_cast<int64_t>(
-          next_cell.code));
-      next_cell.address_dependencies.emplace(pos);
-    } else {
-      as.write_label(label_name + "_" + next_pos.label());
-      this->write_jump_to_cell(as, pos, next_pos);
-      jump_table_contents.emplace_back(0);
-    }
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::reclaim_retired_code() {
+  this->free_tokens.insert(this->free_tokens.end(),
+      this->retired_tokens.begin(), this->retired_tokens.end());
+  this->retired_tokens.clear();
+  this->hot_code.reclaim();
+  this->cold_code.reclaim();
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::evict_cold_cells() {
+  if (!this->max_code_size || (this->live_code_size <= this->max_code_size)) {
+    return;
   }
 
-  as.write_label(label_name);
-  for (size_t x = 0; x < normal_positions.size(); x++) {
-    if (!jump_table_contents[x]) {
-      as.write_label_address(label_name + "_" + normal_positions[x].label());
-    } else {
-      as.write_raw(&jump_table_contents[x], 8);
+  // every cell's accessed flag is cleared in the first pass around the clock,
+  // so two passes are enough to get below the target (unless almost all of
+  // the code belongs to cells that can't be evicted)
+  size_t target_size = this->max_code_size - (this->max_code_size / 4);
+  size_t cells_remaining = this->compiled_cells.size() * 2;
+  while ((this->live_code_size > target_size) && (cells_remaining-- > 0)) {
+    if (this->eviction_clock_hand == this->compiled_cells.end()) {
+      this->eviction_clock_hand = this->compiled_cells.begin();
+    }
+    auto cell_it = this->eviction_clock_hand++;
+    CompiledCell& cell = cell_it->second;
+    if (!cell.code || cell_it->first.special_cell_id) {
+      continue;
+    }
+    if (cell.accessed) {
+      cell.accessed = 0;
+      continue;
     }
+    this->evict_cell(cell_it->first);
   }
 }
 
-void BefungeJITCompiler::write_load_storage_offset(AMD64Assembler& as,
-    const vector<pair<MemoryReference, bool>>& regs) {
-  for (uint8_t dimension = 0; dimension < 3; dimension++) {
-    const auto& reg_flag = regs[dimension];
-    if (dimension < this->dimensions) {
-      if (reg_flag.second) {
-        as.write_add(reg_flag.first, this->storage_offset_reference(dimension));
-      } else {
-        as.write_mov(reg_flag.first, this->storage_offset_reference(dimension));
-      }
-    } else {
-      as.write_xor(reg_flag.first, reg_flag.first);
-    }
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::evict_cell(const Position& pos) {
+  if (this->debug_flags & DebugFlag::ShowCompilationEvents) {
+    string pos_str = pos.str();
+    fprintf(stderr, "evicting cell %s\n", pos_str.c_str());
   }
-}
 
-void BefungeJITCompiler::write_throw_error(AMD64Assembler& as,
-    const char* message) {
-  as.write_mov(rdi, reinterpret_cast<int64_t>(message));
-  as.write_and(rsp, -0x10);
-  as.write_call(this->common_object_reference("dispatch_throw_error"));
+  // the cell's contents haven't changed, so the cells that jump to it through
+  // its slot are still correct; only the cells that embed its address have to
+  // be recompiled
+  CompiledCell& cell = this->compiled_cells.at(pos);
+  set<Position> slot_dependencies = move(cell.slot_dependencies);
+  cell.slot_dependencies.clear();
+  this->compile_cell(pos, true);
+  this->compiled_cells.at(pos).slot_dependencies = move(slot_dependencies);
 }
 
-void BefungeJITCompiler::add_common_object(const string& name, const void* o) {
-  auto emplace_ret = this->common_object_index.emplace(name, this->common_objects.size());
-  if (emplace_ret.second) {
-    this->common_objects.emplace_back(o);
+template <uint8_t Dimensions>
+int64_t BefungeJITCompiler<Dimensions>::allocate_token(CompiledCell& cell,
+    const Position& pos) {
+  int64_t token;
+  if (this->free_tokens.empty()) {
+    token = this->next_token++;
+  } else {
+    token = this->free_tokens.back();
+    this->free_tokens.pop_back();
   }
+  cell.next_position_tokens.emplace(token);
+  this->token_to_position.emplace(token, pos);
+  return token;
 }
 
-MemoryReference BefungeJITCompiler::common_object_reference(const string& name) {
-  return MemoryReference(r12, this->common_object_index.at(name) * 8);
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::release_tokens(CompiledCell& cell) {
+  for (int64_t token : cell.next_position_tokens) {
+    this->token_to_position.erase(token);
+    this->retired_tokens.emplace_back(token);
+  }
+  cell.next_position_tokens.clear();
 }
 
-MemoryReference BefungeJITCompiler::storage_offset_reference(uint8_t dimension) {
-  if ((dimension < 0) || (dimension >= this->dimensions)) {
-    throw invalid_argument("dimension out of range");
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::can_use_opcode_template(const Position& pos,
+    int16_t opcode) const {
+  // the yield, the accessed flag, and the debug hook call depend on the cell,
+  // so cells that need any of them are always assembled
+  if (this->concurrent || this->max_code_size ||
+      this->should_call_debug_hook(pos) ||
+      this->volatile_cells.count(Position(pos.x, pos.y, pos.z, 0, 0, 0))) {
+    return false;
   }
-  return MemoryReference(rbp, -0x10 - (8 * dimension));
-}
 
-MemoryReference BefungeJITCompiler::end_of_last_stack_reference() {
-  return MemoryReference(rbp, -8 * (3 + this->dimensions));
+  switch (opcode) {
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+    case 'a':
+    case 'b':
+    case 'c':
+    case 'd':
+    case 'e':
+    case 'f': {
+      // these are compiled differently if they're followed by a y
+      Position next_pos = pos.copy().move_forward().wrap_lahey(this->field);
+      return (opcode == '0') ||
+          (this->field.get(next_pos.x, next_pos.y, next_pos.z) != 'y');
+    }
+
+    case ' ':
+    case 'z':
+    case '<':
+    case '>':
+    case '^':
+    case 'v':
+    case 'h':
+    case 'l':
+    case '[':
+    case ']':
+    case 'r':
+    case '?':
+    case '_':
+    case '|':
+    case 'm':
+    case 'w':
+    case '`':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '%':
+    case '!':
+    case ':':
+    case '\\':
+    case '$':
+    case 'n':
+      return true;
+
+    default:
+      return false;
+  }
 }
 
-const void* BefungeJITCompiler::dispatch_compile_cell(BefungeJITCompiler* c,
-    const Position* pos) {
-  const void* ret = c->compile_cell(*pos);
-  if (c->debug_flags & DebugFlag::ShowCompilationEvents) {
-    string pos_str = pos->str();
-    fprintf(stderr, "returning control to compiled code at %016" PRIX64 " %s\n",
-        reinterpret_cast<uint64_t>(ret), pos_str.c_str());
+template <uint8_t Dimensions>
+const typename BefungeJITCompiler<Dimensions>::OpcodeTemplate&
+BefungeJITCompiler<Dimensions>::get_opcode_template(const Position& pos, int16_t opcode) {
+  auto key = make_pair(opcode, Position(0, 0, 0, pos.dx, pos.dy, pos.dz,
+      pos.stack_aligned));
+  auto template_it = this->opcode_templates.find(key);
+  if (template_it != this->opcode_templates.end()) {
+    return template_it->second;
   }
 
-  return ret;
-}
+  OpcodeTemplate t;
+  {
+    AMD64Assembler as;
+    AMD64Assembler cold_as;
+    this->recording_template = &t;
+    this->cold_as = &cold_as;
+    this->num_cold_paths = 0;
+    try {
+      this->compile_opcode(as, pos, opcode);
+    } catch (...) {
+      this->recording_template = NULL;
+      this->cold_as = NULL;
+      throw;
+    }
+    this->recording_template = NULL;
+    this->cold_as = NULL;
 
-const void* BefungeJITCompiler::dispatch_get_cell_code(BefungeJITCompiler* c,
-    const Position* pos) {
-  Position normalized_pos = pos->copy().wrap_lahey(c->field);
-  try {
-    const void* code = c->compiled_cells.at(normalized_pos).code;
-    if (code) {
-      return code;
+    multimap<size_t, string> label_offsets;
+    t.data = as.assemble(&t.patch_offsets, &label_offsets);
+    if (this->num_cold_paths) {
+      multimap<size_t, string> cold_label_offsets;
+      t.cold_data = cold_as.assemble(&t.cold_patch_offsets,
+          &cold_label_offsets);
+      t.cold_path_offsets = get_indexed_label_offsets(cold_label_offsets,
+          "cold_path_", this->num_cold_paths);
+      t.cold_jump_offsets = get_indexed_label_offsets(label_offsets,
+          "cold_jump_", this->num_cold_paths);
     }
-  } catch (const out_of_range&) { }
+  }
 
-  return c->compile_cell(normalized_pos);
-}
+  // each exit is in either the main code or the cold paths
+  vector<pair<size_t, Position>> exits;
+  exits.swap(t.exits);
+  for (size_t x = 0; x < exits.size(); x++) {
+    int64_t placeholder = opcode_template_placeholder + x;
+    string placeholder_data(reinterpret_cast<const char*>(&placeholder),
+        sizeof(placeholder));
+    size_t offset = t.data.find(placeholder_data);
+    if (offset != string::npos) {
+      t.exits.emplace_back(offset, exits[x].second);
+      continue;
+    }
+    offset = t.cold_data.find(placeholder_data);
+    if (offset == string::npos) {
+      throw logic_error("placeholder missing from opcode template");
+    }
+    t.cold_exits.emplace_back(offset, exits[x].second);
+  }
 
-int64_t BefungeJITCompiler::dispatch_field_read(BefungeJITCompiler* c,
-    int64_t x, int64_t y, int64_t z) {
-  return c->field.get(x, y, z);
+  return this->opcode_templates.emplace(key, move(t)).first->second;
 }
 
-const void* BefungeJITCompiler::dispatch_field_write(BefungeJITCompiler* c,
-    int64_t return_position_token, int64_t x, int64_t y, int64_t z,
-    int64_t value) {
-  c->field.set(x, y, z, value);
-  c->on_cell_contents_changed(x, y, z);
-
-  const auto& return_position = c->token_to_position.at(return_position_token);
-  auto& return_cell = c->compiled_cells[return_position];
-  const void* ret = return_cell.code ? return_cell.code : c->compile_cell(return_position);
-  if (c->debug_flags & DebugFlag::ShowCompilationEvents) {
-    fprintf(stderr, "returning control to compiled code at %016" PRIX64 "\n",
-        reinterpret_cast<uint64_t>(ret));
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::OpcodeTemplate
+BefungeJITCompiler<Dimensions>::compile_opcode_from_template(const Position& pos,
+    int16_t opcode) {
+  OpcodeTemplate ret = this->get_opcode_template(pos, opcode);
+  for (auto* exits : {&ret.exits, &ret.cold_exits}) {
+    string& data = (exits == &ret.exits) ? ret.data : ret.cold_data;
+    for (const auto& exit : *exits) {
+      const Position& delta = exit.second;
+      Position next_pos(pos.x + delta.x, pos.y + delta.y, pos.z + delta.z,
+          delta.dx, delta.dy, delta.dz, delta.stack_aligned);
+      const typename CompiledCell::Slot* slot = this->get_jump_slot(pos, next_pos);
+      memcpy(const_cast<char*>(data.data()) + exit.first, &slot, sizeof(slot));
+    }
   }
   return ret;
 }
 
-int64_t BefungeJITCompiler::dispatch_file_read(BefungeJITCompiler* c,
-    const char* filename, int64_t flags, Position* va, Position* vb) {
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::benchmark_compilation(size_t iterations) {
+  // (0, 0, 0) holds the opcode being compiled. (1, 0, 0) is a space, except
+  // for " and ;, which end immediately if it's the same opcode
+  int64_t original_values[2] = {this->field.get(0, 0, 0),
+      this->field.get(1, 0, 0)};
+  Position pos(0, 0, 0, 1, 0, 0, false);
+
+  fprintf(stdout, "compilation times for %hhu dimension(s), %zu iterations:\n",
+      Dimensions, iterations);
+  for (int16_t opcode = 0x20; opcode < 0x7F; opcode++) {
+    this->field.set(0, 0, 0, opcode);
+    this->field.set(1, 0, 0, ((opcode == '\"') || (opcode == ';')) ? opcode : ' ');
+
+    try {
+      uint64_t start_time = now();
+      this->compile_cell(pos);
+      uint64_t first_time = now() - start_time;
+
+      start_time = now();
+      for (size_t x = 1; x < iterations; x++) {
+        this->compile_cell(pos);
+      }
+      uint64_t total_time = now() - start_time;
+
+      fprintf(stdout, "  %c  first: %6" PRIu64 " usecs  average: %8.3f usecs  size: %4zu bytes%s\n",
+          opcode, first_time,
+          (iterations > 1) ? (static_cast<double>(total_time) / (iterations - 1)) : 0.0,
+          this->compiled_cells.at(pos).code_size,
+          this->can_use_opcode_template(pos, opcode) ? "  (template)" : "");
+
+    } catch (const exception& e) {
+      fprintf(stdout, "  %c  not compiled: %s\n", opcode, e.what());
+    }
+
+    this->compile_cell(pos, true);
+    this->reclaim_retired_code();
+  }
+
+  this->field.set(0, 0, 0, original_values[0]);
+  this->field.set(1, 0, 0, original_values[1]);
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::precompile_reachable_cells() {
+  // k can iterate an opcode that modifies the field, so it's only safe if the
+  // program contains no such opcodes at all
+  bool field_may_be_modified = false;
+  for (char opcode : {'p', 's', 'i', '('}) {
+    if (this->field_contains_opcode(this->field, opcode)) {
+      field_may_be_modified = true;
+    }
+  }
+
+  // write_jump_to_cell adds positions that aren't compiled yet to the queue.
+  // it's used as a stack, so cells tend to be laid out in execution order
+  vector<Position> queue;
+  this->eager_compile_queue = &queue;
+
+  Position start_pos(1, false);
+  this->compile_cell(start_pos);
+  size_t num_compiled = 1;
+  size_t num_failed = 0;
+  bool stopped = false;
+  bool stopped_at_limit = false;
+  Position stop_pos;
+  while (!queue.empty()) {
+    Position pos = queue.back();
+    queue.pop_back();
+    auto cell_it = this->compiled_cells.find(pos);
+    if ((cell_it != this->compiled_cells.end()) && cell_it->second.code) {
+      continue;
+    }
+
+    // if a reachable cell can modify the field, some of the code compiled here
+    // may be reset before it runs, so the rest is compiled lazily instead
+    int16_t opcode = this->field.get(pos.x, pos.y, pos.z);
+    if ((opcode == 'p') || (opcode == 's') || (opcode == 'i') ||
+        (opcode == '(') || ((opcode == 'k') && field_may_be_modified)) {
+      stopped = true;
+      stop_pos = pos;
+      break;
+    }
+
+    // don't compile more than the code size limit allows, since it would just
+    // be evicted again
+    if (this->max_code_size && (this->live_code_size >= this->max_code_size)) {
+      stopped_at_limit = true;
+      stop_pos = pos;
+      break;
+    }
+
+    // cells that can't be compiled (e.g. invalid opcodes) may never actually
+    // be executed, so they're left for lazy compilation, which will throw if
+    // they are
+    try {
+      this->compile_cell(pos);
+    } catch (const invalid_argument&) {
+      num_failed++;
+      continue;
+    }
+    num_compiled++;
+
+    // helpers continue at positions computed at runtime, with either stack
+    // alignment
+    for (int64_t token : this->compiled_cells.at(pos).next_position_tokens) {
+      const Position& next_pos = this->token_to_position.at(token);
+      for (bool aligned : {false, true}) {
+        Position target_pos = this->canonical_position(
+            next_pos.copy().set_aligned(aligned));
+        auto target_it = this->compiled_cells.find(target_pos);
+        if ((target_it == this->compiled_cells.end()) ||
+            !target_it->second.code) {
+          queue.emplace_back(target_pos);
+        }
+      }
+    }
+  }
+  this->eager_compile_queue = NULL;
+
+  if (this->debug_flags & DebugFlag::ShowCompilationEvents) {
+    if (stopped) {
+      string pos_str = stop_pos.str();
+      fprintf(stderr, "compiled %zu cells ahead of time; stopped at %s, which may modify the field\n",
+          num_compiled, pos_str.c_str());
+    } else if (stopped_at_limit) {
+      string pos_str = stop_pos.str();
+      fprintf(stderr, "compiled %zu cells ahead of time; stopped at %s, since the code size limit was reached\n",
+          num_compiled, pos_str.c_str());
+    } else {
+      fprintf(stderr, "compiled %zu cells ahead of time; %zu cells could not be compiled\n",
+          num_compiled, num_failed);
+    }
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::on_cell_contents_changed(int64_t x, int64_t y, int64_t z) {
+  if (this->debug_flags & DebugFlag::SingleStep) {
+    char ch = this->field.get(x, y, z);
+    fprintf(stderr, "cell contents changed at x=%" PRId64 " y=%" PRId64 " z=%" PRId64 " with value=%02hhX (\'%c\')\n",
+        x, y, z, ch, ch);
+  }
+
+  // reset all the cells that this could affect. first, the cells that were
+  // compiled from this cell's contents directly. volatile cells read their
+  // contents at runtime, so they don't need to be reset. other cells are reset
+  // even if they have no code, since their slots (like those of shared
+  // direction-independent cells) may still point at code for the old contents;
+  // only rewrites of cells with code count toward making them volatile
+  Position key(x, y, z, 0, 0, 0);
+  if (!this->volatile_cells.count(key)) {
+    if (this->has_compiled_code_at(x, y, z)) {
+      this->count_cell_rewrite(key);
+    }
+    this->reset_cells_at(x, y, z);
+  }
+
+  // then, the cells elsewhere that read this cell's value at compile time
+  // (string literals, skipped spans, and iterated opcodes). resetting them
+  // removes them from the index, so work on a copy of the set
+  auto deps_it = this->value_dependents.find(Position(x, y, z, 0, 0, 0));
+  if (deps_it != this->value_dependents.end()) {
+    set<Position> dependents = move(deps_it->second);
+    this->value_dependents.erase(deps_it);
+    for (const auto& dependent_pos : dependents) {
+      if (this->debug_flags & DebugFlag::SingleStep) {
+        string s = dependent_pos.str();
+        fprintf(stderr, "- deleting compiled code for value-dependent cell at %s\n",
+            s.c_str());
+      }
+      this->compile_cell(dependent_pos, true);
+    }
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::count_cell_rewrite(const Position& key) {
+  auto count_it = this->rewrite_counts.emplace(key, 0).first;
+  if (++count_it->second >= volatile_cell_rewrite_threshold) {
+    // this has to happen before the cells are reset, so the cells that jump
+    // to this one are recompiled to jump to per-direction positions
+    this->rewrite_counts.erase(count_it);
+    this->volatile_cells.emplace(key);
+    if (this->debug_flags & DebugFlag::ShowCompilationEvents) {
+      string s = key.str();
+      fprintf(stderr, "cell %s is now volatile\n", s.c_str());
+    }
+  }
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::has_compiled_code_at(int64_t x, int64_t y,
+    int64_t z) const {
+  int64_t min_dx = -0x8000000000000000;
+  Position pos(x, y, z, min_dx, min_dx, min_dx, false);
+  for (auto it = this->compiled_cells.lower_bound(pos);
+       it != this->compiled_cells.end(); it++) {
+    if ((it->first.x != pos.x) || (it->first.y != pos.y) || (it->first.z != pos.z)) {
+      break;
+    }
+    if (it->second.code) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::reset_cells_at(int64_t x, int64_t y, int64_t z) {
+  int64_t min_dx = -0x8000000000000000;
+  Position pos(x, y, z, min_dx, min_dx, min_dx, false);
+  for (auto it = this->compiled_cells.lower_bound(pos);
+       it != this->compiled_cells.end(); it++) {
+    if ((it->first.x != pos.x) || (it->first.y != pos.y) || (it->first.z != pos.z)) {
+      break;
+    }
+    if (this->debug_flags & DebugFlag::SingleStep) {
+      string s = it->first.str();
+      fprintf(stderr, "- deleting compiled code for cell at %s\n", s.c_str());
+    }
+    this->compile_cell(it->first, true);
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::on_region_contents_changed(int64_t x1, int64_t y1,
+    int64_t z1, int64_t x2, int64_t y2, int64_t z2) {
+  if (this->debug_flags & DebugFlag::SingleStep) {
+    fprintf(stderr, "region contents changed from x=%" PRId64 " y=%" PRId64 " z=%" PRId64 " to x=%" PRId64 " y=%" PRId64 " z=%" PRId64 "\n",
+        x1, y1, z1, x2, y2, z2);
+  }
+
+  // compiled cells and value dependencies are both ordered by x first, so all
+  // the affected entries are in a contiguous range of each map. collect them
+  // first, since resetting cells modifies both maps
+  int64_t min_value = -0x8000000000000000;
+  Position start_pos(x1, min_value, min_value, min_value, min_value, min_value,
+      false);
+  auto in_region = [&](const Position& pos) -> bool {
+    return !pos.special_cell_id && (pos.y >= y1) && (pos.y <= y2) &&
+        (pos.z >= z1) && (pos.z <= z2);
+  };
+
+  // as for single-cell writes, volatile cells aren't reset, and the others
+  // count the write toward becoming volatile
+  vector<Position> positions_to_reset;
+  set<Position> rewritten_cells;
+  for (auto it = this->compiled_cells.lower_bound(start_pos);
+       (it != this->compiled_cells.end()) && !it->first.special_cell_id &&
+         (it->first.x <= x2);
+       it++) {
+    if (!in_region(it->first)) {
+      continue;
+    }
+    Position key(it->first.x, it->first.y, it->first.z, 0, 0, 0);
+    if (this->volatile_cells.count(key)) {
+      continue;
+    }
+    if (it->second.code) {
+      rewritten_cells.emplace(key);
+    }
+    positions_to_reset.emplace_back(it->first);
+  }
+  for (const auto& key : rewritten_cells) {
+    this->count_cell_rewrite(key);
+  }
+  for (auto it = this->value_dependents.lower_bound(start_pos);
+       (it != this->value_dependents.end()) && (it->first.x <= x2);) {
+    if (in_region(it->first)) {
+      positions_to_reset.insert(positions_to_reset.end(), it->second.begin(),
+          it->second.end());
+      it = this->value_dependents.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+  for (const auto& pos : positions_to_reset) {
+    this->compile_cell(pos, true);
+  }
+}
+
+template <uint8_t Dimensions>
+int16_t BefungeJITCompiler<Dimensions>::get_dependent_value(const Position& dependent_pos,
+    const Position& value_pos) {
+  Position key(value_pos.x, value_pos.y, value_pos.z, 0, 0, 0);
+  this->value_dependents[key].emplace(dependent_pos);
+  this->compiled_cells[dependent_pos].value_dependencies.emplace(key);
+  return this->field.get(value_pos.x, value_pos.y, value_pos.z);
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::clear_value_dependencies(const Position& pos,
+    CompiledCell& cell) {
+  for (const auto& key : cell.value_dependencies) {
+    auto deps_it = this->value_dependents.find(key);
+    if (deps_it == this->value_dependents.end()) {
+      continue;
+    }
+    deps_it->second.erase(pos);
+    if (deps_it->second.empty()) {
+      this->value_dependents.erase(deps_it);
+    }
+  }
+  cell.value_dependencies.clear();
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_function_call(AMD64Assembler& as,
+    const MemoryReference& function_ref, bool stack_aligned) {
+  if (!stack_aligned) {
+    as.write_sub(rsp, 8);
+  }
+  as.write_call(function_ref);
+  if (!stack_aligned) {
+    as.write_add(rsp, 8);
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_function_call_unknown_alignment(
+    AMD64Assembler& as, const MemoryReference& function_ref) {
+  as.write_xor(rax, rax); // rax = 0
+  as.write_test(rsp, 8);
+  as.write_setz(al); // rax = (rsp & 8) ? 1 : 0
+  as.write_neg(rax); // rax = -1 if aligned for call, 0 if misaligned for call
+  as.write_lea(rax, MemoryReference(rsp, -8, rax, 8)); // move rsp back by 16 if aligned, 8 if misaligned
+  as.write_mov(MemoryReference(rax, 0), rsp); // save what rsp should be on return
+  as.write_mov(rsp, rax); // set up rsp for call
+  as.write_call(function_ref);
+  as.write_pop(rsp); // restore rsp on return
+}
+
+template <uint8_t Dimensions>
+const typename BefungeJITCompiler<Dimensions>::CompiledCell::Slot* BefungeJITCompiler<Dimensions>::get_jump_slot(
+    const Position& cell_pos, const Position& next_pos) {
+  Position next_pos_norm = this->canonical_position(next_pos);
+  auto cell_it = this->compiled_cells.emplace(piecewise_construct,
+      forward_as_tuple(next_pos_norm), forward_as_tuple()).first;
+  auto& next_cell = cell_it->second;
+  if (!next_cell.slot.pos) {
+    next_cell.slot.pos = &cell_it->first;
+    next_cell.slot.entry.store(next_cell.code ? next_cell.code :
+        this->slot_trampoline_function, memory_order_release);
+  }
+
+  if (!next_cell.code && this->eager_compile_queue) {
+    this->eager_compile_queue->emplace_back(next_pos_norm);
+  }
+  if (!next_cell.code && this->speculative_compile_thread.joinable() &&
+      (this->current_speculation_depth < max_speculation_depth)) {
+    this->speculative_compile_queue.emplace_back(next_pos_norm,
+        this->current_speculation_depth + 1);
+    this->speculative_compile_cv.notify_one();
+  }
+  next_cell.slot_dependencies.emplace(cell_pos);
+  return &next_cell.slot;
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_jump_to_cell(AMD64Assembler& as,
+    const Position& cell_pos, const Position& next_pos) {
+  // when making a template, the slot's address isn't known yet, so a
+  // placeholder is written instead and the exit is recorded
+  int64_t slot_address;
+  if (this->recording_template) {
+    auto& exits = this->recording_template->exits;
+    slot_address = opcode_template_placeholder + exits.size();
+    exits.emplace_back(0, Position(next_pos.x - cell_pos.x,
+        next_pos.y - cell_pos.y, next_pos.z - cell_pos.z, next_pos.dx,
+        next_pos.dy, next_pos.dz, next_pos.stack_aligned));
+  } else {
+    slot_address = reinterpret_cast<int64_t>(
+        this->get_jump_slot(cell_pos, next_pos));
+  }
+
+  // the slot trampoline expects the slot's address in rax
+  as.write_mov(rax, slot_address);
+  as.write_jmp(MemoryReference(rax, offsetof(typename CompiledCell::Slot, entry)));
+}
+
+template <uint8_t Dimensions>
+AMD64Assembler& BefungeJITCompiler<Dimensions>::write_cold_path_jump(
+    AMD64Assembler& as, ColdPathCondition condition) {
+  if (!this->cold_as) {
+    throw logic_error("cold path written outside of cell compilation");
+  }
+
+  // the displacement is zero until link_cold_paths fills it in. jumps don't
+  // affect the flags, so cold paths can use the flags from the comparison
+  // that led to them
+  size_t index = this->num_cold_paths++;
+  if (condition == ColdPathCondition::Always) {
+    static const uint8_t jmp_rel32[5] = {0xE9, 0x00, 0x00, 0x00, 0x00};
+    as.write_raw(jmp_rel32, sizeof(jmp_rel32));
+  } else {
+    const uint8_t jcc_rel32[6] = {0x0F, static_cast<uint8_t>(condition),
+        0x00, 0x00, 0x00, 0x00};
+    as.write_raw(jcc_rel32, sizeof(jcc_rel32));
+  }
+  as.write_label(string_printf("cold_jump_%zu", index));
+  this->cold_as->write_label(string_printf("cold_path_%zu", index));
+  return *this->cold_as;
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::link_cold_paths(string& data,
+    int64_t cold_path_distance, const vector<size_t>& cold_path_offsets,
+    const vector<size_t>& cold_jump_offsets) const {
+  if (cold_path_offsets.size() != cold_jump_offsets.size()) {
+    throw logic_error("cold path count does not match cold jump count");
+  }
+
+  // the displacement is relative to the end of the jump, which is where the
+  // cold_jump label is
+  vector<int32_t> displacements;
+  for (size_t x = 0; x < cold_path_offsets.size(); x++) {
+    int64_t displacement = cold_path_distance +
+        static_cast<int64_t>(cold_path_offsets[x]) -
+        static_cast<int64_t>(cold_jump_offsets[x]);
+    if (displacement != static_cast<int32_t>(displacement)) {
+      return false;
+    }
+    displacements.emplace_back(displacement);
+  }
+  for (size_t x = 0; x < displacements.size(); x++) {
+    memcpy(const_cast<char*>(data.data()) + cold_jump_offsets[x] - 4,
+        &displacements[x], sizeof(int32_t));
+  }
+  return true;
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_jump_to_cell_unknown_alignment(
+    AMD64Assembler& as, const Position& cell_pos, const Position& next_pos) {
+  as.write_test(rsp, 8);
+  as.write_jz("stack_aligned_" + next_pos.str());
+  this->write_jump_to_cell(as, cell_pos, next_pos.copy().set_aligned(false));
+  as.write_label("stack_aligned_" + next_pos.str());
+  this->write_jump_to_cell(as, cell_pos, next_pos.copy().set_aligned(true));
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_jump_table(AMD64Assembler& as,
+    const string& label_name, const Position& pos,
+    const vector<Position>& positions) {
+  // each entry points to a jump through the target cell's slot, so the table
+  // doesn't have to change when the targets are compiled or moved
+  for (size_t x = 0; x < positions.size(); x++) {
+    as.write_label(string_printf("%s_%zu", label_name.c_str(), x));
+    this->write_jump_to_cell(as, pos, positions[x]);
+  }
+
+  as.write_label(label_name);
+  for (size_t x = 0; x < positions.size(); x++) {
+    as.write_label_address(string_printf("%s_%zu", label_name.c_str(), x));
+  }
+}
+
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::InlineCache::InlineCache() : num_filled(0),
+    next_replace(0), key_is_delta(false) {
+  memset(this->keys, 0, sizeof(this->keys));
+  memset(this->targets, 0, sizeof(this->targets));
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_inline_cache_lookup(AMD64Assembler& as,
+    const string& label_prefix, const Position& cell_pos,
+    const Position& base_pos, bool key_is_delta, uint8_t key_count) {
+  // the cache is reset whenever the cell is recompiled. unfilled entries
+  // point to the miss handler, so an unfilled entry matching the key is
+  // equivalent to missing entirely
+  InlineCache& cache = this->inline_caches[make_pair(cell_pos,
+      base_pos.stack_aligned)];
+  cache = InlineCache();
+  cache.cell_pos = cell_pos;
+  cache.base_pos = base_pos;
+  cache.key_is_delta = key_is_delta;
+  for (size_t x = 0; x < InlineCache::num_entries; x++) {
+    cache.targets[x] = this->inline_cache_miss_function;
+  }
+
+  as.write_mov(rax, reinterpret_cast<int64_t>(&cache));
+  for (size_t x = 0; x < InlineCache::num_entries; x++) {
+    string miss_label = string_printf("%s_miss_%zu", label_prefix.c_str(), x);
+    int64_t key_offset = offsetof(InlineCache, keys) + x * sizeof(cache.keys[0]);
+    as.write_cmp(r8, MemoryReference(rax, key_offset));
+    as.write_jne(miss_label);
+    if (key_count > 1) {
+      as.write_cmp(r9, MemoryReference(rax, key_offset + 8));
+      as.write_jne(miss_label);
+    }
+    if (key_count > 2) {
+      as.write_cmp(r10, MemoryReference(rax, key_offset + 16));
+      as.write_jne(miss_label);
+    }
+    as.write_jmp(MemoryReference(rax,
+        offsetof(InlineCache, targets) + x * sizeof(cache.targets[0])));
+    as.write_label(miss_label);
+  }
+  as.write_jmp(this->common_object_reference("inline_cache_miss"));
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_push_string(AMD64Assembler& as,
+    const vector<int16_t>& values) {
+  // the copy loop zero-extends the values, so strings containing negative
+  // values are pushed one at a time, like short strings
+  bool use_copy_loop = (values.size() >= min_string_copy_loop_length);
+  for (int16_t value : values) {
+    if (value < 0) {
+      use_copy_loop = false;
+    }
+  }
+  if (!use_copy_loop) {
+    for (int16_t value : values) {
+      as.write_push(value);
+    }
+    return;
+  }
+
+  // the values are stored as 16-bit integers between a jump and the loop. rdx
+  // counts up from -size to zero
+  int64_t size = values.size();
+  as.write_jmp("string_copy_start");
+  as.write_label("string_data");
+  as.write_raw(values.data(), size * sizeof(int16_t));
+  as.write_label("string_copy_start");
+  as.write_mov(rcx, "string_data");
+  as.write_mov(rdx, -size);
+  as.write_label("string_copy_again");
+  as.write_movzx16(rax, MemoryReference(rcx, size * sizeof(int16_t), rdx, 2));
+  as.write_push(rax);
+  as.write_inc(rdx);
+  as.write_jnz("string_copy_again");
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_random_index(AMD64Assembler& as,
+    uint8_t count) {
+  // this is the same as RandomGenerator::next_below. the result is in rax;
+  // rcx and rdx are clobbered
+  as.write_mov(rcx, this->common_object_reference("random_state_ptr"));
+  as.write_mov(rax, MemoryReference(rcx, 0));
+  as.write_mov(rdx, rax);
+  as.write_shl(rdx, 13);
+  as.write_xor(rax, rdx);
+  as.write_mov(rdx, rax);
+  as.write_shr(rdx, 7);
+  as.write_xor(rax, rdx);
+  as.write_mov(rdx, rax);
+  as.write_shl(rdx, 17);
+  as.write_xor(rax, rdx);
+  as.write_mov(MemoryReference(rcx, 0), rax);
+  as.write_shr(rax, 32);
+  as.write_imul_imm(rax, rax, count);
+  as.write_shr(rax, 32);
+}
+
+template <uint8_t Dimensions>
+vector<Position> BefungeJITCompiler<Dimensions>::random_direction_positions(
+    const Position& pos) const {
+  // this order matches the interpreter's
+  vector<Position> ret({
+      pos.copy().face(-1, 0, 0).move_forward(),
+      pos.copy().face(1, 0, 0).move_forward()});
+  if (Dimensions > 1) {
+    ret.emplace_back(pos.copy().face(0, -1, 0).move_forward());
+    ret.emplace_back(pos.copy().face(0, 1, 0).move_forward());
+  }
+  if (Dimensions > 2) {
+    ret.emplace_back(pos.copy().face(0, 0, -1).move_forward());
+    ret.emplace_back(pos.copy().face(0, 0, 1).move_forward());
+  }
+  return ret;
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_load_storage_offset(AMD64Assembler& as,
+    const vector<pair<MemoryReference, bool>>& regs) {
+  for (uint8_t dimension = 0; dimension < 3; dimension++) {
+    const auto& reg_flag = regs[dimension];
+    if (dimension < Dimensions) {
+      if (reg_flag.second) {
+        as.write_add(reg_flag.first, this->storage_offset_reference(dimension));
+      } else {
+        as.write_mov(reg_flag.first, this->storage_offset_reference(dimension));
+      }
+    } else {
+      as.write_xor(reg_flag.first, reg_flag.first);
+    }
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_throw_error(AMD64Assembler& as,
+    const char* message) {
+  as.write_mov(rdi, reinterpret_cast<int64_t>(message));
+  as.write_and(rsp, -0x10);
+  as.write_call(this->common_object_reference("dispatch_throw_error"));
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_end_program(AMD64Assembler& as,
+    bool stack_aligned) {
+  // in concurrent mode, this only ends the current thread, unless it's the
+  // last one
+  if (this->concurrent) {
+    as.write_mov(rdi, this->common_object_reference("this"));
+    this->write_function_call(as,
+        this->common_object_reference("dispatch_end_thread"), stack_aligned);
+    as.write_test(rax, rax);
+    as.write_jz("end_program");
+    as.write_mov(rsp, MemoryReference(rax, offsetof(ThreadContext, stack_top)));
+    as.write_mov(rbp, MemoryReference(rax, offsetof(ThreadContext, frame)));
+    as.write_mov(r13, MemoryReference(rax, offsetof(ThreadContext, stack_end)));
+    as.write_jmp(MemoryReference(rax, offsetof(ThreadContext, resume)));
+
+    // the last thread might not be running on the original stack, so return
+    // using the main thread's frame
+    as.write_label("end_program");
+    as.write_mov(rax, this->common_object_reference("main_thread_frame_ptr"));
+    as.write_mov(rbp, MemoryReference(rax, 0));
+  }
+  as.write_mov(r13, MemoryReference(rbp, -0x10));
+  as.write_mov(r12, MemoryReference(rbp, -0x08));
+  as.write_mov(rsp, rbp);
+  as.write_pop(rbp);
+  as.write_ret();
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::add_common_object(const string& name, const void* o) {
+  auto emplace_ret = this->common_object_index.emplace(name, this->common_objects.size());
+  if (emplace_ret.second) {
+    this->common_objects.emplace_back(o);
+  }
+}
+
+template <uint8_t Dimensions>
+MemoryReference BefungeJITCompiler<Dimensions>::common_object_reference(const string& name) {
+  return MemoryReference(r12, this->common_object_index.at(name) * 8);
+}
+
+template <uint8_t Dimensions>
+MemoryReference BefungeJITCompiler<Dimensions>::storage_offset_reference(uint8_t dimension) {
+  if ((dimension < 0) || (dimension >= Dimensions)) {
+    throw invalid_argument("dimension out of range");
+  }
+  // rbp-0x08 and rbp-0x10 are the saved r12 and r13 values
+  return MemoryReference(rbp, -0x18 - (8 * dimension));
+}
+
+template <uint8_t Dimensions>
+MemoryReference BefungeJITCompiler<Dimensions>::end_of_last_stack_reference() {
+  return MemoryReference(rbp, -8 * (3 + Dimensions));
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_enter_slot(
+    BefungeJITCompiler* c, const typename CompiledCell::Slot* slot, int64_t* stack_top,
+    int64_t* stack_end, uint8_t* frame) {
+  CompilerLock lock(c);
+
+  // the cell may have been compiled speculatively since the jump to it was
+  // taken, in which case this just returns its code
+  Position pos = slot->pos->copy();
+  FungeStackView stack(stack_top, stack_end);
+  if (c->tiered) {
+    pos = c->interpret_cells(pos, stack, frame);
+  }
+  HelperReturn ret = c->make_helper_return(pos, stack);
+  if (c->debug_flags & DebugFlag::ShowCompilationEvents) {
+    string pos_str = pos.str();
+    fprintf(stderr, "returning control to compiled code at %016" PRIX64 " %s\n",
+        reinterpret_cast<uint64_t>(ret.next_code), pos_str.c_str());
+  }
+  return ret;
+}
+
+template <uint8_t Dimensions>
+const void* BefungeJITCompiler<Dimensions>::dispatch_get_cell_code(BefungeJITCompiler* c,
+    const Position* pos) {
+  CompilerLock lock(c);
+  Position normalized_pos = c->canonical_position(*pos);
+  try {
+    const void* code = c->compiled_cells.at(normalized_pos).code;
+    if (code) {
+      return code;
+    }
+  } catch (const out_of_range&) { }
+
+  return c->compile_cell(normalized_pos);
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::interpret_opcode(Position& pos, int16_t opcode,
+    FungeStackView& stack, uint8_t* frame) {
+  // these do the same things as the code compile_opcode generates. pos is only
+  // changed if the opcode was executed
+  switch (opcode) {
+    case ' ':
+    case 'z':
+      break;
+
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+      stack.push(opcode - '0');
+      break;
+    case 'a':
+    case 'b':
+    case 'c':
+    case 'd':
+    case 'e':
+    case 'f':
+      stack.push(opcode - 'a' + 10);
+      break;
+
+    case '`':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '%': {
+      // an empty stack is left alone
+      if (stack.empty()) {
+        break;
+      }
+      int64_t a = stack.pop();
+      int64_t b = stack.pop();
+      int64_t result;
+      if (opcode == '`') {
+        result = (b > a);
+      } else if (opcode == '+') {
+        result = static_cast<int64_t>(static_cast<uint64_t>(b) +
+            static_cast<uint64_t>(a));
+      } else if (opcode == '-') {
+        result = static_cast<int64_t>(static_cast<uint64_t>(b) -
+            static_cast<uint64_t>(a));
+      } else if (opcode == '*') {
+        result = static_cast<int64_t>(static_cast<uint64_t>(b) *
+            static_cast<uint64_t>(a));
+      } else if (!a) {
+        result = 0;
+      } else if ((a == -1) && (b == INT64_MIN)) {
+        // idiv would fault here; the compiled code can't produce a result
+        // either, so leave this to it
+        stack.push(b);
+        stack.push(a);
+        return false;
+      } else {
+        result = (opcode == '/') ? (b / a) : (b % a);
+      }
+      stack.push(result);
+      break;
+    }
+
+    case '!':
+      stack.push(!stack.pop());
+      break;
+
+    case ':': {
+      // duplicating an empty stack pushes a single zero
+      if (!stack.empty()) {
+        int64_t a = stack.pop();
+        stack.push(a);
+        stack.push(a);
+      } else {
+        stack.push(0);
+      }
+      break;
+    }
+
+    case '\\': {
+      if (stack.empty()) {
+        break;
+      }
+      int64_t a = stack.pop();
+      int64_t b = stack.pop();
+      stack.push(a);
+      stack.push(b);
+      break;
+    }
+
+    case '$':
+      stack.pop();
+      break;
+
+    case 'n':
+      stack.top = stack.end + 1;
+      break;
+
+    case '.':
+      printf("%" PRId64 " ", stack.pop());
+      break;
+
+    case ',':
+      putchar(stack.pop());
+      break;
+
+    case '<':
+      pos.face(-1, 0, 0);
+      break;
+    case '>':
+      pos.face(1, 0, 0);
+      break;
+    case '^':
+    case 'v':
+      if (Dimensions < 2) {
+        return false;
+      }
+      pos.face(0, (opcode == '^') ? -1 : 1, 0);
+      break;
+    case 'h':
+    case 'l':
+      if (Dimensions < 3) {
+        return false;
+      }
+      pos.face(0, 0, (opcode == 'h') ? -1 : 1);
+      break;
+    case '[':
+    case ']':
+      if (Dimensions < 2) {
+        return false;
+      }
+      if (opcode == '[') {
+        pos.turn_left();
+      } else {
+        pos.turn_right();
+      }
+      break;
+    case 'r':
+      pos.turn_around();
+      break;
+
+    case '?':
+      pos = this->random_direction_positions(pos)[
+          this->random.next_below(Dimensions * 2)];
+      return true;
+
+    case '_':
+      pos.face(stack.pop() ? -1 : 1, 0, 0);
+      break;
+    case '|':
+      if (Dimensions < 2) {
+        return false;
+      }
+      pos.face(0, stack.pop() ? -1 : 1, 0);
+      break;
+
+    case '#':
+      pos.move_forward().wrap_lahey(this->field);
+      break;
+
+    case 'g':
+    case 'p': {
+      int64_t x, y, z;
+      stack.pop_vector(Dimensions, &x, &y, &z);
+      x += *this->storage_offset_pointer(frame, 0);
+      if (Dimensions > 1) {
+        y += *this->storage_offset_pointer(frame, 1);
+      }
+      if (Dimensions > 2) {
+        z += *this->storage_offset_pointer(frame, 2);
+      }
+      if (opcode == 'g') {
+        stack.push(this->field.get(x, y, z));
+      } else {
+        this->field.set(x, y, z, stack.pop());
+        this->on_cell_contents_changed(x, y, z);
+      }
+      break;
+    }
+
+    default:
+      return false;
+  }
+
+  pos.move_forward();
+  return true;
+}
+
+template <uint8_t Dimensions>
+Position BefungeJITCompiler<Dimensions>::interpret_cells(const Position& start_pos,
+    FungeStackView& stack, uint8_t* frame) {
+  Position pos = start_pos.copy();
+  size_t num_interpreted = 0;
+  for (;;) {
+    pos = this->canonical_position(pos.set_aligned(
+        !(reinterpret_cast<uintptr_t>(stack.top) & 0x0F)));
+
+    auto cell_it = this->compiled_cells.find(pos);
+    if ((cell_it != this->compiled_cells.end()) && cell_it->second.code) {
+      break;
+    }
+
+    // alignment doesn't affect what the cell does, so it isn't counted
+    // separately
+    uint64_t& count = this->interpreted_counts[pos.copy().set_aligned(false)];
+    if (count >= this->jit_threshold) {
+      break;
+    }
+    if (!this->interpret_opcode(pos, this->field.get(pos.x, pos.y, pos.z),
+        stack, frame)) {
+      break;
+    }
+    count++;
+    num_interpreted++;
+  }
+
+  if (this->debug_flags & DebugFlag::ShowCompilationEvents) {
+    string start_str = start_pos.str();
+    string pos_str = pos.str();
+    fprintf(stderr, "interpreted %zu cells from %s; returning to compiled code at %s\n",
+        num_interpreted, start_str.c_str(), pos_str.c_str());
+  }
+  return pos;
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_volatile_cell(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  Position pos = c->token_to_position.at(next_token).copy().move_backward();
+  int16_t opcode = c->field.get(pos.x, pos.y, pos.z);
+
+  if (c->interpret_opcode(pos, opcode, stack, frame)) {
+    return c->make_helper_return(pos, stack);
+  }
+
+  // the iterated opcode helper implements most of the rest; running it with a
+  // count of 1 is the same as executing the opcode once
+  bool has_iterated_helper;
+  switch (opcode) {
+    case 'w':
+    case '|':
+      has_iterated_helper = (Dimensions > 1);
+      break;
+    case 'm':
+      has_iterated_helper = (Dimensions > 2);
+      break;
+    case '&':
+    case '~':
+    case 's':
+    case '\'':
+    case 'j':
+    case 'x':
+    case 'y':
+    case '{':
+    case '}':
+    case 'u':
+    case '(':
+    case ')':
+    case 'i':
+      has_iterated_helper = true;
+      break;
+    default:
+      has_iterated_helper = false;
+  }
+  if (has_iterated_helper) {
+    stack.push(1);
+    return dispatch_iterated_opcode(c, stack.top, stack.end, frame,
+        next_token, reflect_token, opcode);
+  }
+
+  // anything else is compiled normally, and the cell stops being volatile
+  c->volatile_cells.erase(Position(pos.x, pos.y, pos.z, 0, 0, 0));
+  c->reset_cells_at(pos.x, pos.y, pos.z);
+  return c->make_helper_return(pos, stack);
+}
+
+template <uint8_t Dimensions>
+const void* BefungeJITCompiler<Dimensions>::dispatch_inline_cache_miss(
+    BefungeJITCompiler* c, InlineCache* cache, int64_t key0, int64_t key1,
+    int64_t key2) {
+  CompilerLock lock(c);
+  Position target_pos = cache->base_pos;
+  if (cache->key_is_delta) {
+    target_pos.face(key0, key1, key2).move_forward();
+  } else {
+    target_pos.x += key0 * target_pos.dx;
+    target_pos.y += key0 * target_pos.dy;
+    target_pos.z += key0 * target_pos.dz;
+  }
+  target_pos = c->canonical_position(target_pos);
+
+  // compiling the target can recompile the cell that owns the cache (which
+  // resets the cache), so the entry is filled only after that
+  auto& target_cell = c->compiled_cells[target_pos];
+  const void* code = target_cell.code ? target_cell.code :
+      c->compile_cell(target_pos);
+
+  // if the target moves or is reset, the owning cell is recompiled, which
+  // clears the cache
+  c->compiled_cells.at(target_pos).address_dependencies.emplace(
+      cache->cell_pos);
+
+  size_t index;
+  if (cache->num_filled < InlineCache::num_entries) {
+    index = cache->num_filled++;
+  } else {
+    index = cache->next_replace;
+    cache->next_replace = (cache->next_replace + 1) % InlineCache::num_entries;
+  }
+  cache->keys[index][0] = key0;
+  cache->keys[index][1] = key1;
+  cache->keys[index][2] = key2;
+  cache->targets[index] = code;
+
+  if (c->debug_flags & DebugFlag::ShowCompilationEvents) {
+    string cell_str = cache->cell_pos.str();
+    string target_str = target_pos.str();
+    fprintf(stderr, "inline cache miss at %s; filled entry %zu with %s\n",
+        cell_str.c_str(), index, target_str.c_str());
+  }
+  return code;
+}
+
+template <uint8_t Dimensions>
+int64_t BefungeJITCompiler<Dimensions>::dispatch_field_read(BefungeJITCompiler* c,
+    int64_t x, int64_t y, int64_t z) {
+  CompilerLock lock(c);
+  return c->field.get(x, y, z);
+}
+
+template <uint8_t Dimensions>
+const void* BefungeJITCompiler<Dimensions>::dispatch_field_write(BefungeJITCompiler* c,
+    int64_t return_position_token, int64_t x, int64_t y, int64_t z,
+    int64_t value) {
+  CompilerLock lock(c);
+  c->field.set(x, y, z, value);
+  c->on_cell_contents_changed(x, y, z);
+
+  // the write may have changed the opcode at the return position, so it has to
+  // be canonicalized here rather than when the token was created
+  Position return_position = c->canonical_position(
+      c->token_to_position.at(return_position_token));
+  auto& return_cell = c->compiled_cells[return_position];
+  const void* ret = return_cell.code ? return_cell.code : c->compile_cell(return_position);
+  if (c->debug_flags & DebugFlag::ShowCompilationEvents) {
+    fprintf(stderr, "returning control to compiled code at %016" PRIX64 "\n",
+        reinterpret_cast<uint64_t>(ret));
+  }
+  return ret;
+}
+
+template <uint8_t Dimensions>
+int64_t BefungeJITCompiler<Dimensions>::dispatch_file_read(BefungeJITCompiler* c,
+    const char* filename, int64_t flags, Position* va, Position* vb) {
+  CompilerLock lock(c);
+
   // note: va and vb overlap! only the x, y, and z members are valid
 
-  fprintf(stderr, "dispatch_file_read: filename=%s, flags=%016" PRIX64 ", xa=%" PRId64 ", ya=%" PRId64 ", za=%" PRId64 "\n",
-      filename, flags, va->x, va->y, va->z);
+  try {
+    // the field is written in one pass (whole rows at a time), and then the
+    // compiled code is invalidated with a single range query
+    Field::Region r = c->field.load_region(filename, va->x, va->y, va->z,
+        flags & 1);
+    if (r.w && r.h) {
+      c->on_region_contents_changed(r.x, r.y, r.z, r.x + r.w - 1,
+          r.y + r.h - 1, r.z);
+    }
+
+    vb->x = r.w;
+    vb->y = r.h;
+    vb->z = ((Dimensions > 2) && r.w && r.h) ? 1 : 0;
+
+    if (c->debug_flags & DebugFlag::ShowCompilationEvents) {
+      fprintf(stderr, "dispatch_file_read: read %s at %" PRId64 " %" PRId64 " %" PRId64 " with size %" PRId64 " %" PRId64 " %" PRId64 "\n",
+          filename, va->x, va->y, va->z, vb->x, vb->y, vb->z);
+    }
+    return 0;
+
+  } catch (const exception& e) {
+    if (c->debug_flags & DebugFlag::ShowCompilationEvents) {
+      fprintf(stderr, "dispatch_file_read failed: %s\n", e.what());
+    }
+    return 1;
+  }
+
+  // i pops a null-terminated 0"gnirts" string for the filename, followed by a flags
+  // cell, then a vector Va telling it where to operate. If the file can be opened
+  // for reading, it is inserted into Funge-Space at Va, and immediately closed. Two
+  // vectors are then pushed onto the stack, Va and Vb, suitable arguments to a
+  // corresponding o instruction. If the file open failed, the instruction acts like
+  // r.
+
+  // i is in all respects similar to the procedure used to load the main Funge source
+  // code file, except it may specify any file, not necessarily Funge source code,
+  // and at any location, not necessarily the origin.
+
+  // Also, if the least significant bit of the flags cell is high, i treats the file
+  // as a binary file; that is, EOL and FF sequences are stored in Funge-space
+  // instead of causing the dimension counters to be reset and incremented.
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::should_call_debug_hook(const Position& pos) const {
+  if (this->debug_flags & DebugFlag::SingleStep) {
+    return true;
+  }
+  return this->breakpoint_positions.count(Position(pos.x, pos.y, pos.z, 0, 0, 0));
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_debug_hook_call(AMD64Assembler& as,
+    CompiledCell& cell, const Position& pos) {
+  // the hook may reset every compiled cell (including this one), so it returns
+  // the address to continue at instead of returning here
+  int64_t token = this->allocate_token(cell, pos);
+
+  as.write_mov(rdi, this->common_object_reference("this"));
+  as.write_mov(rsi, token);
+  as.write_mov(rdx, rsp);
+  as.write_mov(rcx, r13);
+  as.write_lea(r8, this->end_of_last_stack_reference());
+  as.write_lea(r9, this->storage_offset_reference(Dimensions - 1));
+  if (pos.stack_aligned) {
+    as.write_push(this->common_object_reference("jump_return_0"));
+  } else {
+    as.write_sub(rsp, 8);
+    as.write_push(this->common_object_reference("jump_return_8"));
+  }
+  as.write_jmp(this->common_object_reference("dispatch_interactive_debug_hook"));
+  as.write_label("debug_hook_return");
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::reset_all_cells() {
+  vector<Position> positions;
+  for (const auto& it : this->compiled_cells) {
+    if (it.second.code && !it.first.special_cell_id) {
+      positions.emplace_back(it.first.copy());
+    }
+  }
+
+  // resetting a cell recompiles the cells that depend on its address, so some
+  // of these may have code again by the time we get to them
+  for (const auto& pos : positions) {
+    if (this->compiled_cells[pos].code) {
+      this->compile_cell(pos, true);
+    }
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::interactive_debug_hook(const Position& current_pos,
+    int64_t stack_top, int64_t r13, int64_t stack_end,
+    const int64_t* storage_offset) {
+  if (!(this->debug_flags & DebugFlag::SingleStep)) {
+    for (const auto& pos : this->breakpoint_positions) {
+      if (pos.x == current_pos.x && pos.y == current_pos.y && pos.z == current_pos.z) {
+        this->debug_flags |= DebugFlag::SingleStep;
+        break;
+      }
+    }
+  }
+
+  if (this->debug_flags & DebugFlag::SingleStep) {
+    string storage_offset_str;
+    if (Dimensions == 1) {
+      storage_offset_str = string_printf("(%" PRId64 ",)", *storage_offset);
+    } else if (Dimensions == 2) {
+      storage_offset_str = string_printf("(%" PRId64 ", %" PRId64 ")",
+          storage_offset[1], storage_offset[0]);
+    } else if (Dimensions == 3) {
+      storage_offset_str = string_printf("(%" PRId64 ", %" PRId64 ", %" PRId64 ")",
+          storage_offset[2], storage_offset[1], storage_offset[0]);
+    } else {
+      storage_offset_str = "<<invalid-dimension>>";
+    }
+
+    string current_pos_str = current_pos.str();
+    fprintf(stderr, "single step: at = \'%c\' %s, storage offset = %s\n",
+        this->field.get(current_pos.x, current_pos.y, current_pos.z),
+        current_pos_str.c_str(), storage_offset_str.c_str());
+
+    static string red_esc = format_color_escape(TerminalFormat::FG_RED, TerminalFormat::END);
+    static string normal_esc = format_color_escape(TerminalFormat::NORMAL, TerminalFormat::END);
+    for (int64_t y = current_pos.y - 4; y < current_pos.y + 5; y++) {
+      for (int64_t x = current_pos.x - 4; x < current_pos.x + 5; x++) {
+        char ch = this->field.get(x, y, current_pos.z);
+        if (x == current_pos.x && y == current_pos.y) {
+          fprintf(stderr, "%s%c%s", red_esc.c_str(), ch, normal_esc.c_str());
+        } else {
+          fputc(ch, stderr);
+        }
+      }
+      fputc('\n', stderr);
+    }
+
+    // each stack's end is followed by the next stack's end and top pointers
+    const int64_t* top = reinterpret_cast<const int64_t*>(stack_top);
+    const int64_t* end = reinterpret_cast<const int64_t*>(r13);
+    for (size_t stack_index = 0;; stack_index++) {
+      for (size_t item_index = 0; top + item_index <= end; item_index++) {
+        int64_t item = top[item_index];
+        if (item >= 0x20 && item < 0x7F) {
+          fprintf(stderr, "[stack %zu : %zu] %" PRId64 " (0x%" PRIX64 ") (\'%c\')\n",
+              stack_index, item_index, item, item, static_cast<char>(item));
+        } else {
+          fprintf(stderr, "[stack %zu : %zu] %" PRId64 " (0x%" PRIX64 ")\n",
+              stack_index, item_index, item, item);
+        }
+      }
+      fprintf(stderr, "[end of stack %zu]\n", stack_index);
+
+      if (end == reinterpret_cast<const int64_t*>(stack_end)) {
+        break;
+      }
+      top = reinterpret_cast<const int64_t*>(end[2]);
+      end = reinterpret_cast<const int64_t*>(end[1]);
+    }
+  }
+}
+
+template <uint8_t Dimensions>
+const void* BefungeJITCompiler<Dimensions>::dispatch_interactive_debug_hook(
+    BefungeJITCompiler* c, int64_t return_position_token, int64_t stack_top,
+    int64_t r13, int64_t stack_end, const int64_t* storage_offset) {
+  const Position pos = c->token_to_position.at(return_position_token).copy();
+
+  bool was_single_stepping = c->debug_flags & DebugFlag::SingleStep;
+  c->interactive_debug_hook(pos, stack_top, r13, stack_end, storage_offset);
+
+  // if we just hit a breakpoint, every cell needs the hook from now on
+  if (!was_single_stepping && (c->debug_flags & DebugFlag::SingleStep)) {
+    c->reset_all_cells();
+  }
+
+  auto& cell = c->compiled_cells[pos];
+  const void* code = cell.code ? cell.code : c->compile_cell(pos);
+  return reinterpret_cast<const uint8_t*>(code) +
+      c->compiled_cells.at(pos).body_offset;
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::dispatch_throw_error(const char* message) {
+  throw runtime_error(message);
+}
+
+
+
+static const size_t thread_stack_size = 0x1000000; // 16MB
+static const size_t thread_stack_guard_size = 0x1000;
+
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::ThreadContext::ThreadContext(int64_t id,
+    size_t stack_region_size) : stack_top(NULL), frame(NULL), stack_end(NULL),
+    resume(NULL), next(NULL), prev(NULL), stack_limit(NULL), id(id),
+    stack_region(NULL), stack_region_size(stack_region_size),
+    hrti_mark_set(false), hrti_mark(0) {
+  if (this->stack_region_size) {
+    this->stack_region = mmap(NULL, this->stack_region_size,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+        0);
+    if (this->stack_region == MAP_FAILED) {
+      throw runtime_error("can\'t allocate stack for new thread");
+    }
+
+    // the lowest page is a guard, so a stack overflow crashes instead of
+    // silently corrupting memory
+    mprotect(this->stack_region, thread_stack_guard_size, PROT_NONE);
+    this->stack_limit = reinterpret_cast<const uint8_t*>(this->stack_region) +
+        thread_stack_guard_size + stack_reserve_size;
+  }
+}
+
+template <uint8_t Dimensions>
+BefungeJITCompiler<Dimensions>::ThreadContext::~ThreadContext() {
+  if (this->stack_region) {
+    munmap(this->stack_region, this->stack_region_size);
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::warn_about_late_t(const Position& pos) {
+  if (!this->warned_about_late_t) {
+    string pos_str = pos.str();
+    fprintf(stderr, "warning: t at %s acts like r, since the program did not contain t when it was loaded\n",
+        pos_str.c_str());
+    this->warned_about_late_t = true;
+  }
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::field_contains_opcode(const Field& field,
+    char opcode) {
+  for (const auto& plane : field.planes) {
+    for (const auto& line : plane) {
+      if (line.find(opcode) != string::npos) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::relocate_suspended_threads(const Position& pos,
+    const void* old_resume, const void* new_resume) {
+  for (auto& it : this->threads) {
+    ThreadContext* t = it.second.get();
+    if ((t == this->current_thread) || (t->resume != old_resume)) {
+      continue;
+    }
+
+    // if the cell was reset, the thread will recompile it when it resumes
+    if (new_resume) {
+      t->resume = new_resume;
+    } else {
+      t->resume = this->resume_thread_function;
+      t->resume_position = pos;
+    }
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::fork_thread(int64_t child_token, uint8_t* stack_top,
+    uint8_t* stack_end, uint8_t* frame) {
+  // none of the dead threads can be running now, so their stacks can be freed
+  this->dead_threads.clear();
+
+  unique_ptr<ThreadContext> t(new ThreadContext(this->next_thread_id++,
+      thread_stack_size));
+
+  // copy the entire stack-of-stacks and the frame (including the saved rbp
+  // and return address, though the child never uses them) to the top of the
+  // new thread's stack region. the frame is always 16-byte aligned and so is
+  // the region, so the child has the same stack alignment as the parent
+  uint8_t* frame_end = frame + 0x10;
+  size_t copy_size = frame_end - stack_top;
+  if (copy_size > t->stack_region_size - thread_stack_guard_size -
+      stack_reserve_size) {
+    throw runtime_error("stack is too large to split the IP");
+  }
+  uint8_t* new_frame_end = reinterpret_cast<uint8_t*>(t->stack_region) +
+      t->stack_region_size;
+  int64_t delta = new_frame_end - frame_end;
+  memcpy(stack_top + delta, stack_top, copy_size);
+
+  // the stacks are linked by the end and top pointers saved between them,
+  // which have to be relocated too
+  uint8_t* end_of_last_stack = frame - 8 * (3 + Dimensions);
+  for (uint8_t* end = stack_end; end != end_of_last_stack;) {
+    int64_t* links = reinterpret_cast<int64_t*>(end + delta);
+    end = reinterpret_cast<uint8_t*>(links[1]);
+    links[1] += delta;
+    links[2] += delta;
+  }
+
+  t->stack_top = stack_top + delta;
+  t->frame = frame + delta;
+  t->stack_end = stack_end + delta;
+  t->resume_position = this->canonical_position(
+      this->token_to_position.at(child_token));
+  t->resume = this->resume_thread_function;
+
+  // the child inherits the parent's fingerprint semantics and HRTI mark
+  ThreadContext* parent = this->current_thread;
+  for (size_t x = 0; x < 26; x++) {
+    t->letter_semantics[x] = parent->letter_semantics[x];
+  }
+  t->hrti_mark_set = parent->hrti_mark_set;
+  t->hrti_mark = parent->hrti_mark;
+
+  // the child runs immediately after the parent in each tick
+  t->prev = parent;
+  t->next = parent->next;
+  parent->next->prev = t.get();
+  parent->next = t.get();
+  this->threads.emplace(t->id, move(t));
+}
+
+template <uint8_t Dimensions>
+const void* BefungeJITCompiler<Dimensions>::dispatch_fork_thread(BefungeJITCompiler* c,
+    int64_t parent_token, int64_t child_token, uint8_t* stack_top,
+    uint8_t* stack_end, uint8_t* frame) {
+  c->fork_thread(child_token, stack_top, stack_end, frame);
+
+  Position return_position = c->canonical_position(
+      c->token_to_position.at(parent_token));
+  auto& return_cell = c->compiled_cells[return_position];
+  return return_cell.code ? return_cell.code : c->compile_cell(return_position);
+}
+
+template <uint8_t Dimensions>
+const void* BefungeJITCompiler<Dimensions>::dispatch_fork_threads(BefungeJITCompiler* c,
+    int64_t parent_token, int64_t child_token, uint8_t* stack_top,
+    uint8_t* stack_end, uint8_t* frame, int64_t count) {
+  // all the children start in the same state, so they're all copies of the
+  // parent at this point
+  for (; count > 0; count--) {
+    c->fork_thread(child_token, stack_top, stack_end, frame);
+  }
+
+  Position return_position = c->canonical_position(
+      c->token_to_position.at(parent_token));
+  auto& return_cell = c->compiled_cells[return_position];
+  return return_cell.code ? return_cell.code : c->compile_cell(return_position);
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::ThreadContext* BefungeJITCompiler<Dimensions>::dispatch_end_thread(
+    BefungeJITCompiler* c) {
+  c->dead_threads.clear();
+
+  // the current thread's stack can't be freed yet since we're running on it
+  ThreadContext* t = c->current_thread;
+  ThreadContext* next = (t->next == t) ? NULL : t->next;
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  c->current_thread = next;
+  if (next) {
+    c->stack_limit = next->stack_limit;
+  }
+
+  auto it = c->threads.find(t->id);
+  c->dead_threads.emplace_back(move(it->second));
+  c->threads.erase(it);
+  return next;
+}
+
+template <uint8_t Dimensions>
+const void* BefungeJITCompiler<Dimensions>::dispatch_resume_thread(BefungeJITCompiler* c,
+    ThreadContext* thread) {
+  const Position& pos = thread->resume_position;
+  auto& cell = c->compiled_cells[pos];
+  const void* code = cell.code ? cell.code : c->compile_cell(pos);
+
+  // skip the yield at the beginning of the cell; the thread already yielded
+  // before it was suspended
+  return reinterpret_cast<const uint8_t*>(code) +
+      c->compiled_cells.at(pos).resume_offset;
+}
+
+
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::write_helper_call(AMD64Assembler& as,
+    CompiledCell& cell, const Position& pos, const char* dispatch_function_name,
+    int64_t extra_arg) {
+  // the stack alignment after the call isn't known until it returns, so the
+  // tokens' positions are aligned at that point
+  int64_t next_token = this->allocate_token(cell, pos.copy().move_forward());
+  int64_t reflect_token = this->allocate_token(cell,
+      pos.copy().turn_around().move_forward());
+
+  as.write_mov(rdi, this->common_object_reference("this"));
+  as.write_mov(rsi, rsp);
+  as.write_mov(rdx, r13);
+  as.write_mov(rcx, rbp);
+  as.write_mov(r8, next_token);
+  as.write_mov(r9, reflect_token);
+
+  // switch to the helper stack (which is 16-byte aligned) and "call" the
+  // function, but make it return to helper_return instead of this cell
+  as.write_mov(rsp, this->common_object_reference("helper_stack_top"));
+  if (extra_arg) {
+    as.write_sub(rsp, 8);
+    as.write_mov(rax, extra_arg);
+    as.write_push(rax);
+  }
+  as.write_push(this->common_object_reference("helper_return"));
+  as.write_jmp(this->common_object_reference(dispatch_function_name));
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::make_helper_return(
+    int64_t token, const FungeStackView& stack) {
+  return this->make_helper_return(this->token_to_position.at(token), stack);
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::make_helper_return(
+    const Position& next_pos, const FungeStackView& stack) {
+  // helpers return to compiled code via helper_return, so nothing on the stack
+  // refers to code that this might recompile, evict, or reuse
+  this->apply_deferred_dependency_updates();
+  this->evict_cold_cells();
+  this->reclaim_retired_code();
+
+  Position pos = this->canonical_position(next_pos.copy().set_aligned(
+      !(reinterpret_cast<uintptr_t>(stack.top) & 0x0F)));
+  auto& cell = this->compiled_cells[pos];
+  const void* code = cell.code ? cell.code : this->compile_cell(pos);
+
+  this->helper_return_stack_end = stack.end;
+  return {stack.top, code};
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::on_letter_semantics_changed(char letter) {
+  // resetting the cells doesn't remove them from the set, so take the set
+  // first. cells in the set that have since been recompiled as something else
+  // are reset unnecessarily, but that's harmless
+  set<Position> positions = move(this->letter_cells[letter - 'A']);
+  this->letter_cells[letter - 'A'].clear();
+  for (const auto& pos : positions) {
+    this->compile_cell(pos, true);
+  }
+}
 
-  try {
-    string data = load_file(filename);
-
-    bool binary = flags & 1;
-    Position where = *va;
-    vb->x = va->x;
-    vb->y = va->y;
-    vb->z = va->z;
-    for (char ch : data) {
-      if ((ch == '\n') && !binary) {
-        where.x = va->x;
-        where.y++;
-      } else if ((ch == '\r') && !binary) {
-        // ignore \r chars in text mode
-      } else {
-        if (ch != ' ') {
-          c->field.set(where.x, where.y, where.z, ch);
-          // TODO: this call is logarithmic; probably can be optimized somehow
-          c->on_cell_contents_changed(where.x, where.y, where.z);
-        }
-        where.x++;
-        if (where.x > vb->x) {
-          vb->x = where.x;
-        }
-        if (where.y > vb->y) {
-          vb->y = where.y + 1;
-        }
-      }
+template <uint8_t Dimensions>
+vector<const FingerprintSemantic*>*
+BefungeJITCompiler<Dimensions>::active_letter_semantics() {
+  return this->concurrent ? this->current_thread->letter_semantics :
+      this->letter_semantics;
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::call_fingerprint_function(FingerprintFunction fn,
+    FungeStackView& stack, uint8_t* frame) {
+  FingerprintEnvironment& env = this->fingerprint_env;
+  ThreadContext* t = this->concurrent ? this->current_thread : NULL;
+  if (t) {
+    env.hrti_mark_set = t->hrti_mark_set;
+    env.hrti_mark = t->hrti_mark;
+  }
+  env.storage_offset_x = *this->storage_offset_pointer(frame, 0);
+  if (Dimensions > 1) {
+    env.storage_offset_y = *this->storage_offset_pointer(frame, 1);
+  }
+  if (Dimensions > 2) {
+    env.storage_offset_z = *this->storage_offset_pointer(frame, 2);
+  }
+
+  bool success = fn(env, stack);
+  if (t) {
+    t->hrti_mark_set = env.hrti_mark_set;
+    t->hrti_mark = env.hrti_mark;
+  }
+
+  if (!env.modified_cells.empty()) {
+    vector<Position> modified_cells = move(env.modified_cells);
+    env.modified_cells.clear();
+    for (const auto& pos : modified_cells) {
+      this->on_cell_contents_changed(pos.x, pos.y, pos.z);
     }
+  }
+  return success;
+}
 
-    vb->x -= va->x;
-    vb->y -= va->y;
-    vb->z -= va->z;
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_fingerprint(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token,
+    FingerprintFunction fn) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  bool success = c->call_fingerprint_function(fn, stack, frame);
+  return c->make_helper_return(success ? next_token : reflect_token, stack);
+}
 
-    c->field.save("equinox_debug.b98");
-    fprintf(stderr, "dispatch_file_read succeeded with va = %" PRId64 " %" PRId64 " %" PRId64 " vb = %" PRId64 " %" PRId64 " %" PRId64 "\n",
-        va->x, va->y, va->z, vb->x, vb->y, vb->z);
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::execute_letter(char letter, FungeStackView& stack,
+    uint8_t* frame) {
+  const auto& semantics = this->active_letter_semantics()[letter - 'A'];
+  const FingerprintSemantic* semantic = semantics.empty() ? NULL :
+      semantics.back();
+  if (!semantic || (semantic->type == FingerprintSemantic::Type::Reflect)) {
+    return false;
+  }
+  if (semantic->type == FingerprintSemantic::Type::PushConstant) {
+    stack.push(semantic->value);
+    return true;
+  }
+  return this->call_fingerprint_function(semantic->function, stack, frame);
+}
 
-    return 0;
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_letter(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token, int64_t letter) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  bool success = c->execute_letter(letter, stack, frame);
+  return c->make_helper_return(success ? next_token : reflect_token, stack);
+}
 
-  } catch (const exception& e) {
-    fprintf(stderr, "dispatch_file_read failed: %s\n", e.what());
-    return 1;
+static int64_t pop_fingerprint_id(FungeStackView& stack, bool* valid) {
+  int64_t count = stack.pop();
+  int64_t id = 0;
+  for (int64_t x = 0; x < count; x++) {
+    id = (id << 8) + stack.pop();
   }
-  // i pops a null-terminated 0"gnirts" string for the filename, followed by a flags
-  // cell, then a vector Va telling it where to operate. If the file can be opened
-  // for reading, it is inserted into Funge-Space at Va, and immediately closed. Two
-  // vectors are then pushed onto the stack, Va and Vb, suitable arguments to a
-  // corresponding o instruction. If the file open failed, the instruction acts like
-  // r.
+  *valid = (count > 0);
+  return id;
+}
 
-  // i is in all respects similar to the procedure used to load the main Funge source
-  // code file, except it may specify any file, not necessarily Funge source code,
-  // and at any location, not necessarily the origin.
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::load_fingerprint(FungeStackView& stack) {
+  bool valid;
+  int64_t id = pop_fingerprint_id(stack, &valid);
+  const Fingerprint* fp = valid ? find_fingerprint(id) : NULL;
+  if (!fp) {
+    return false;
+  }
 
-  // Also, if the least significant bit of the flags cell is high, i treats the file
-  // as a binary file; that is, EOL and FF sequences are stored in Funge-space
-  // instead of causing the dimension counters to be reset and incremented.
+  if (this->debug_flags & DebugFlag::ShowCompilationEvents) {
+    fprintf(stderr, "loading fingerprint %s\n", fp->name.c_str());
+  }
+
+  auto* letter_semantics = this->active_letter_semantics();
+  for (const auto& it : fp->semantics) {
+    auto& semantics = letter_semantics[it.first - 'A'];
+    const FingerprintSemantic* prev = semantics.empty() ? NULL : semantics.back();
+    semantics.emplace_back(&it.second);
+    if (prev != &it.second) {
+      this->on_letter_semantics_changed(it.first);
+    }
+  }
+
+  stack.push(id);
+  stack.push(1);
+  return true;
 }
 
-void BefungeJITCompiler::interactive_debug_hook(const Position& current_pos,
-    int64_t stack_top, int64_t r13, int64_t stack_end,
-    const int64_t* storage_offset) {
-  if (!(this->debug_flags & DebugFlag::SingleStep)) {
-    for (const auto& pos : this->breakpoint_positions) {
-      if (pos.x == current_pos.x && pos.y == current_pos.y && pos.z == current_pos.z) {
-        this->debug_flags |= DebugFlag::SingleStep;
-        break;
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::unload_fingerprint(FungeStackView& stack) {
+  bool valid;
+  int64_t id = pop_fingerprint_id(stack, &valid);
+  const Fingerprint* fp = valid ? find_fingerprint(id) : NULL;
+  if (!fp) {
+    return false;
+  }
+
+  if (this->debug_flags & DebugFlag::ShowCompilationEvents) {
+    fprintf(stderr, "unloading fingerprint %s\n", fp->name.c_str());
+  }
+
+  // this pops the letter's current semantic even if a different fingerprint
+  // loaded it, as the spec requires
+  auto* letter_semantics = this->active_letter_semantics();
+  for (const auto& it : fp->semantics) {
+    auto& semantics = letter_semantics[it.first - 'A'];
+    if (semantics.empty()) {
+      continue;
+    }
+    const FingerprintSemantic* prev = semantics.back();
+    semantics.pop_back();
+    if (semantics.empty() || (semantics.back() != prev)) {
+      this->on_letter_semantics_changed(it.first);
+    }
+  }
+  return true;
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_load_fingerprint(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  bool success = c->load_fingerprint(stack);
+  return c->make_helper_return(success ? next_token : reflect_token, stack);
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_unload_fingerprint(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  bool success = c->unload_fingerprint(stack);
+  return c->make_helper_return(success ? next_token : reflect_token, stack);
+}
+
+template <uint8_t Dimensions>
+int64_t* BefungeJITCompiler<Dimensions>::stack_limit_pointer() const {
+  return reinterpret_cast<int64_t*>(const_cast<void*>(this->stack_limit));
+}
+
+template <uint8_t Dimensions>
+int64_t* BefungeJITCompiler<Dimensions>::storage_offset_pointer(uint8_t* frame,
+    uint8_t dimension) const {
+  // this is the same location as storage_offset_reference(dimension)
+  return reinterpret_cast<int64_t*>(frame - 0x18 - (8 * dimension));
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::open_block(FungeStackView& stack, uint8_t* frame,
+    const Position& next_pos) {
+  int64_t count = stack.pop();
+  int64_t size = stack.end + 1 - stack.top;
+
+  // the items that remain on the current stack become the second stack. if
+  // the count is negative, that many zeroes are pushed onto it instead of
+  // transferring anything
+  int64_t transfer_count = (count > 0) ? min(count, size) : 0;
+
+  // the new stack, the storage offset, and the pointers between the stacks
+  // have to fit above the stack limit. this is checked before anything moves,
+  // since a huge count would put the new stack far below the guard page
+  int64_t available = (stack.top - this->stack_limit_pointer()) -
+      Dimensions - 3;
+  if ((count > 0) ? (count - transfer_count > available) : (count < -available)) {
+    throw runtime_error("stack is too large to open a block");
+  }
+
+  int64_t* second_stack_top = stack.top + transfer_count;
+  if (count < 0) {
+    second_stack_top += count;
+    fill(second_stack_top, stack.top, 0);
+  }
+
+  // the new stack goes below the second stack's top and the pointers to the
+  // old stack; only the transferred items are moved there. the rest of the new
+  // stack (if the count is larger than the stack) is filled with zeroes
+  int64_t new_size = (count > 0) ? count : 0;
+  int64_t* new_end = second_stack_top - Dimensions - 3;
+  int64_t* new_top = new_end + 1 - new_size;
+  memmove(new_top, stack.top, transfer_count * sizeof(int64_t));
+  fill(new_top + transfer_count, new_end + 1, 0);
+
+  // push the storage offset onto the second stack, and link the stacks
+  second_stack_top -= Dimensions;
+  for (uint8_t d = 0; d < Dimensions; d++) {
+    int64_t* so = this->storage_offset_pointer(frame, d);
+    second_stack_top[Dimensions - d - 1] = *so;
+  }
+  new_end[1] = reinterpret_cast<int64_t>(stack.end);
+  new_end[2] = reinterpret_cast<int64_t>(second_stack_top);
+
+  // the new storage offset is the position of the next cell
+  *this->storage_offset_pointer(frame, 0) = next_pos.x;
+  if (Dimensions > 1) {
+    *this->storage_offset_pointer(frame, 1) = next_pos.y;
+  }
+  if (Dimensions > 2) {
+    *this->storage_offset_pointer(frame, 2) = next_pos.z;
+  }
+
+  stack.top = new_top;
+  stack.end = new_end;
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::close_block(FungeStackView& stack, uint8_t* frame) {
+  // if there's no second stack, reflect without popping anything
+  int64_t* end_of_last_stack = reinterpret_cast<int64_t*>(
+      frame - 8 * (3 + Dimensions));
+  if (stack.end == end_of_last_stack) {
+    return false;
+  }
+
+  int64_t count = stack.pop();
+
+  // restore the storage offset from the second stack
+  FungeStackView second_stack(reinterpret_cast<int64_t*>(stack.end[2]),
+      reinterpret_cast<int64_t*>(stack.end[1]));
+  for (int8_t d = Dimensions - 1; d >= 0; d--) {
+    *this->storage_offset_pointer(frame, d) = second_stack.pop();
+  }
+
+  if (count >= 0) {
+    // move the top count items onto the second stack in the same order. if
+    // the stack doesn't have that many items, zeroes are transferred for the
+    // missing ones
+    if (count > second_stack.top - this->stack_limit_pointer()) {
+      throw runtime_error("stack is too large to close the block");
+    }
+    int64_t size = stack.end + 1 - stack.top;
+    int64_t transfer_count = min(count, size);
+    int64_t* new_top = second_stack.top - count;
+    memmove(new_top, stack.top, transfer_count * sizeof(int64_t));
+    fill(new_top + transfer_count, second_stack.top, 0);
+    second_stack.top = new_top;
+
+  } else {
+    // discard -count items from the second stack
+    int64_t available = second_stack.end + 1 - second_stack.top;
+    second_stack.top += min(-count, available);
+  }
+
+  stack = second_stack;
+  return true;
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::stack_under_stack(FungeStackView& stack,
+    uint8_t* frame) {
+  int64_t* end_of_last_stack = reinterpret_cast<int64_t*>(
+      frame - 8 * (3 + Dimensions));
+  if (stack.end == end_of_last_stack) {
+    return false;
+  }
+
+  int64_t count = stack.pop();
+  FungeStackView second_stack(reinterpret_cast<int64_t*>(stack.end[2]),
+      reinterpret_cast<int64_t*>(stack.end[1]));
+
+  // neither direction can move the current stack below the stack limit
+  int64_t space = stack.top - this->stack_limit_pointer();
+  if ((count > space) || (count < -space)) {
+    throw runtime_error("stack is too large to transfer items between stacks");
+  }
+
+  if (count > 0) {
+    // pop from the second stack and push onto the current stack. this leaves
+    // unused space between the stacks
+    for (; count > 0; count--) {
+      stack.push(second_stack.pop());
+    }
+
+  } else if (count < 0) {
+    // pop from the current stack and push onto the second stack. if there isn't
+    // enough unused space between the stacks, move the current stack down to
+    // make some. the extra space is proportional to the current stack's size,
+    // so the cost of moving it is amortized over later transfers
+    int64_t available = second_stack.top - (stack.end + 3);
+    if (available < -count) {
+      int64_t size = stack.end + 1 - stack.top;
+      int64_t shift = -count - available + size + 0x10;
+      if (shift > space) {
+        throw runtime_error("stack is too large to transfer items between stacks");
       }
+      memmove(stack.top - shift, stack.top,
+          (stack.end + 3 - stack.top) * sizeof(int64_t));
+      stack.top -= shift;
+      stack.end -= shift;
+    }
+    for (; count < 0; count++) {
+      *(--second_stack.top) = stack.pop();
     }
   }
 
-  if (this->debug_flags & DebugFlag::SingleStep) {
-    string storage_offset_str;
-    if (dimensions == 1) {
-      storage_offset_str = string_printf("(%" PRId64 ",)", *storage_offset);
-    } else if (dimensions == 2) {
-      storage_offset_str = string_printf("(%" PRId64 ", %" PRId64 ")",
-          storage_offset[1], storage_offset[0]);
-    } else if (dimensions == 3) {
-      storage_offset_str = string_printf("(%" PRId64 ", %" PRId64 ", %" PRId64 ")",
-          storage_offset[2], storage_offset[1], storage_offset[0]);
+  stack.end[2] = reinterpret_cast<int64_t>(second_stack.top);
+  return true;
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_open_block(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  c->open_block(stack, frame, c->token_to_position.at(next_token));
+  return c->make_helper_return(next_token, stack);
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_close_block(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  bool success = c->close_block(stack, frame);
+  return c->make_helper_return(success ? next_token : reflect_token, stack);
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_stack_under_stack(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  bool success = c->stack_under_stack(stack, frame);
+  return c->make_helper_return(success ? next_token : reflect_token, stack);
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::write_constant_sysinfo_item(AMD64Assembler& as,
+    const Position& pos, int64_t index) {
+  // in concurrent mode the y has to take its own tick, so it can't be merged
+  // into this cell
+  if (this->concurrent || (index <= 0)) {
+    return false;
+  }
+
+  // only depend on the next cell's value if it's a y. if another cell is later
+  // changed to y, this cell just doesn't get the optimization
+  Position y_pos = pos.copy().move_forward().wrap_lahey(this->field);
+  if ((this->field.get(y_pos.x, y_pos.y, y_pos.z) != 'y') ||
+      this->should_call_debug_hook(y_pos)) {
+    return false;
+  }
+  this->get_dependent_value(pos, y_pos);
+
+  // most items are constants or can be read from the frame; the rest require
+  // a function call. either way, only the selected item is computed
+  int64_t offset = index - 10;
+  if (index <= 9) {
+    as.write_mov(rax, this->get_sysinfo_item(index, y_pos, NULL, NULL, NULL));
+    as.write_push(rax);
+  } else if (offset < 3 * Dimensions) {
+    uint8_t dimension = Dimensions - 1 - (offset % Dimensions);
+    if (offset / Dimensions == 2) {
+      as.write_push(this->storage_offset_reference(dimension));
     } else {
-      storage_offset_str = "<<invalid-dimension>>";
+      as.write_mov(rax, this->get_sysinfo_item(index, y_pos, NULL, NULL, NULL));
+      as.write_push(rax);
     }
+  } else {
+    as.write_mov(rdi, this->common_object_reference("this"));
+    as.write_mov(rsi, index);
+    as.write_mov(rdx, rsp);
+    as.write_mov(rcx, r13);
+    as.write_mov(r8, rbp);
+    this->write_function_call(as,
+        this->common_object_reference("dispatch_get_sysinfo_item"),
+        pos.stack_aligned);
+    as.write_push(rax);
+  }
 
-    string current_pos_str = current_pos.str();
-    fprintf(stderr, "single step: at = \'%c\' %s, storage offset = %s\n",
-        this->field.get(current_pos.x, current_pos.y, current_pos.z),
-        current_pos_str.c_str(), storage_offset_str.c_str());
+  this->write_jump_to_cell(as, pos, y_pos.move_forward().change_alignment());
+  return true;
+}
 
-    static string red_esc = format_color_escape(TerminalFormat::FG_RED, TerminalFormat::END);
-    static string normal_esc = format_color_escape(TerminalFormat::NORMAL, TerminalFormat::END);
-    for (int64_t y = current_pos.y - 4; y < current_pos.y + 5; y++) {
-      for (int64_t x = current_pos.x - 4; x < current_pos.x + 5; x++) {
-        char ch = this->field.get(x, y, current_pos.z);
-        if (x == current_pos.x && y == current_pos.y) {
-          fprintf(stderr, "%s%c%s", red_esc.c_str(), ch, normal_esc.c_str());
+static int64_t vector_component(int64_t x, int64_t y, int64_t z,
+    uint8_t dimension) {
+  return (dimension == 0) ? x : ((dimension == 1) ? y : z);
+}
+
+template <uint8_t Dimensions>
+int64_t BefungeJITCompiler<Dimensions>::get_sysinfo_item(int64_t index,
+    const Position& pos, const int64_t* stack_top, const int64_t* stack_end,
+    uint8_t* frame) {
+  switch (index) {
+    case 1: // flags (t is only available in concurrent mode)
+      return this->concurrent ? 0x0F : 0x0E;
+    case 2: // bytes per cell
+      return 8;
+    case 3: // handprint
+      return 0x5555555555555555;
+    case 4: // version
+      return 0;
+    case 5: // operating paradigm (system())
+      return 1;
+    case 6: // path separator
+      return '/';
+    case 7:
+      return Dimensions;
+    case 8: // thread id
+      return this->concurrent ? this->current_thread->id : 0;
+    case 9: // team number
+      return 0;
+  }
+
+  // next are the position, delta, storage offset, least point, and greatest
+  // point (relative to the least point), each with its last component on top
+  int64_t offset = index - 10;
+  if (offset < 5 * Dimensions) {
+    uint8_t dimension = Dimensions - 1 - (offset % Dimensions);
+    switch (offset / Dimensions) {
+      case 0:
+        return vector_component(pos.x, pos.y, pos.z, dimension);
+      case 1:
+        return vector_component(pos.dx, pos.dy, pos.dz, dimension);
+      case 2:
+        return *this->storage_offset_pointer(frame, dimension);
+      default: {
+        ssize_t lx, ly, lz, gx, gy, gz;
+        this->field.get_bounds(&lx, &ly, &lz, &gx, &gy, &gz);
+        int64_t least = vector_component(lx, ly, lz, dimension);
+        if (offset / Dimensions == 3) {
+          return least;
+        }
+        return vector_component(gx, gy, gz, dimension) - least;
+      }
+    }
+  }
+  offset -= 5 * Dimensions;
+
+  if (offset < 2) {
+    time_t t_secs = now() / 1000000;
+    struct tm t_parsed;
+    gmtime_r(&t_secs, &t_parsed);
+    if (offset == 0) {
+      return (t_parsed.tm_year << 16) | ((t_parsed.tm_mon + 1) << 8) |
+          t_parsed.tm_mday;
+    }
+    return (t_parsed.tm_hour << 16) | (t_parsed.tm_min << 8) | t_parsed.tm_sec;
+  }
+  offset -= 2;
+
+  // the number of stacks, then the size of each one from the TOSS to the BOSS
+  const int64_t* end_of_last_stack = reinterpret_cast<const int64_t*>(
+      frame - 8 * (3 + Dimensions));
+  int64_t num_stacks = 1;
+  for (const int64_t* end = stack_end; end != end_of_last_stack;
+       end = reinterpret_cast<const int64_t*>(end[1])) {
+    num_stacks++;
+  }
+  if (offset == 0) {
+    return num_stacks;
+  }
+  offset--;
+
+  if (offset < num_stacks) {
+    const int64_t* top = stack_top;
+    const int64_t* end = stack_end;
+    for (; offset > 0; offset--) {
+      top = reinterpret_cast<const int64_t*>(end[2]);
+      end = reinterpret_cast<const int64_t*>(end[1]);
+    }
+    return end + 1 - top;
+  }
+  offset -= num_stacks;
+
+  // argv and env are empty (3 and 2 zeroes respectively)
+  if (offset < 5) {
+    return 0;
+  }
+  offset -= 5;
+
+  const int64_t* item = stack_top + offset;
+  return (item <= stack_end) ? *item : 0;
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::push_sysinfo(FungeStackView& stack,
+    const Position& pos, uint8_t* frame) {
+  int64_t arg = stack.pop();
+  int64_t* stack_top = stack.top;
+  if (arg > 0) {
+    stack.push(this->get_sysinfo_item(arg, pos, stack_top, stack.end, frame));
+    return;
+  }
+
+  // a full dump pushes every item, starting from the bottom (env). pushing
+  // doesn't change anything get_sysinfo_item reads, since it only reads the
+  // stack contents for indexes beyond the end of the sysinfo
+  const int64_t* end_of_last_stack = reinterpret_cast<const int64_t*>(
+      frame - 8 * (3 + Dimensions));
+  int64_t num_stacks = 1;
+  for (const int64_t* end = stack.end; end != end_of_last_stack;
+       end = reinterpret_cast<const int64_t*>(end[1])) {
+    num_stacks++;
+  }
+  for (int64_t index = 17 + 5 * Dimensions + num_stacks; index > 0;
+       index--) {
+    stack.push(this->get_sysinfo_item(index, pos, stack_top, stack.end, frame));
+  }
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_sysinfo(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  Position pos = c->token_to_position.at(next_token).copy().move_backward();
+  c->push_sysinfo(stack, pos, frame);
+  return c->make_helper_return(next_token, stack);
+}
+
+template <uint8_t Dimensions>
+int64_t BefungeJITCompiler<Dimensions>::dispatch_get_sysinfo_item(BefungeJITCompiler* c,
+    int64_t index, const int64_t* stack_top, const int64_t* stack_end,
+    uint8_t* frame) {
+  CompilerLock lock(c);
+
+  // the compiled code handles the position and delta items itself, so the
+  // position isn't needed here
+  return c->get_sysinfo_item(index, Position(), stack_top, stack_end, frame);
+}
+
+template <uint8_t Dimensions>
+bool BefungeJITCompiler<Dimensions>::read_file_from_stack(FungeStackView& stack,
+    uint8_t* frame) {
+  string filename = stack.pop_string();
+  int64_t flags = stack.pop();
+  Position va, vb;
+  stack.pop_vector(Dimensions, &va.x, &va.y, &va.z);
+
+  if (dispatch_file_read(this, filename.c_str(), flags, &va, &vb)) {
+    return false;
+  }
+
+  stack.push(va.x);
+  if (Dimensions > 1) {
+    stack.push(va.y);
+    if (Dimensions > 2) {
+      stack.push(va.z);
+    }
+  }
+  stack.push(vb.x);
+  if (Dimensions > 1) {
+    stack.push(vb.y);
+    if (Dimensions > 2) {
+      stack.push(vb.z);
+    }
+  }
+  return true;
+}
+
+template <uint8_t Dimensions>
+int16_t BefungeJITCompiler<Dimensions>::find_iterated_opcode(Position& pos) {
+  // spaces and ;-delimited regions take no time, so k skips over them
+  int16_t opcode;
+  bool in_semicolon = false;
+  for (;;) {
+    pos.move_forward().wrap_lahey(this->field);
+    opcode = this->field.get(pos.x, pos.y, pos.z);
+    if (opcode == ';') {
+      in_semicolon = !in_semicolon;
+    } else if (!in_semicolon && (opcode != ' ')) {
+      return opcode;
+    }
+  }
+}
+
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::execute_iterated_opcode(Position& ip,
+    const Position& opcode_pos, int16_t opcode, int64_t count,
+    FungeStackView& stack, uint8_t* frame) {
+  switch (opcode) {
+    case ',':
+    case '.': { // output is written all at once
+      string data;
+      for (; count > 0; count--) {
+        if (opcode == ',') {
+          data.push_back(stack.pop());
         } else {
-          fputc(ch, stderr);
+          data += string_printf("%" PRId64 " ", stack.pop());
         }
       }
-      fputc('\n', stderr);
+      fwrite(data.data(), 1, data.size(), stdout);
+      break;
     }
 
-    size_t stack_index = 0;
-    size_t item_index = 0;
-    int64_t field = stack_top;
-    int64_t stack_end_field = r13 + 8;
-    int64_t overall_end_field = stack_end + 8;
-    for (; field <= overall_end_field; field += 8) {
-      if (field == stack_end_field) {
-        fprintf(stderr, "[end of stack %zu]\n", stack_index);
-        stack_end_field = *reinterpret_cast<const int64_t*>(stack_end_field) + 8;
-        stack_index++;
-        item_index = 0;
-      } else {
-        int64_t item = *reinterpret_cast<int64_t*>(field);
-        if (item >= 0x20 && item < 0x7F) {
-          fprintf(stderr, "[stack %zu : %zu] %" PRId64 " (0x%" PRIX64 ") (\'%c\')\n",
-              stack_index, item_index, item, item, static_cast<char>(item));
+    case '&':
+      for (; count > 0; count--) {
+        int64_t value = 0;
+        if (scanf("%" PRId64, &value) < 1) {
+          value = 0;
+        }
+        stack.push(value);
+      }
+      break;
+
+    case '~':
+      for (; count > 0; count--) {
+        stack.push(getchar());
+      }
+      break;
+
+    case 'g':
+    case 'p':
+      for (; count > 0; count--) {
+        int64_t x, y, z;
+        stack.pop_vector(Dimensions, &x, &y, &z);
+        x += *this->storage_offset_pointer(frame, 0);
+        if (Dimensions > 1) {
+          y += *this->storage_offset_pointer(frame, 1);
+        }
+        if (Dimensions > 2) {
+          z += *this->storage_offset_pointer(frame, 2);
+        }
+        if (opcode == 'g') {
+          stack.push(this->field.get(x, y, z));
         } else {
-          fprintf(stderr, "[stack %zu : %zu] %" PRId64 " (0x%" PRIX64 ")\n",
-              stack_index, item_index, item, item);
+          this->field.set(x, y, z, stack.pop());
+          this->on_cell_contents_changed(x, y, z);
+        }
+      }
+      break;
+
+    case 's':
+    case '\'':
+      // each iteration moves the IP onto the cell it reads or writes
+      for (; count > 0; count--) {
+        ip.move_forward().wrap_lahey(this->field);
+        if (opcode == '\'') {
+          stack.push(this->field.get(ip.x, ip.y, ip.z));
+        } else {
+          this->field.set(ip.x, ip.y, ip.z, stack.pop());
+          this->on_cell_contents_changed(ip.x, ip.y, ip.z);
+        }
+      }
+      break;
+
+    case 'j':
+      for (; count > 0; count--) {
+        int64_t distance = stack.pop();
+        ip.x += distance * ip.dx;
+        ip.y += distance * ip.dy;
+        ip.z += distance * ip.dz;
+      }
+      ip.wrap_lahey(this->field);
+      break;
+
+    case 'x':
+      for (; count > 0; count--) {
+        stack.pop_vector(Dimensions, &ip.dx, &ip.dy, &ip.dz);
+      }
+      if (!ip.dx && !ip.dy && !ip.dz) {
+        throw runtime_error("cannot execute x opcode with zero delta");
+      }
+      break;
+
+    case 'w':
+      for (; count > 0; count--) {
+        int64_t b = stack.pop();
+        int64_t a = stack.pop();
+        if (a < b) {
+          ip.turn_left();
+        } else if (a > b) {
+          ip.turn_right();
+        }
+      }
+      break;
+
+    case '_':
+    case '|':
+    case 'm':
+      for (; count > 0; count--) {
+        int64_t direction = stack.pop() ? -1 : 1;
+        if (opcode == '_') {
+          ip.face(direction, 0, 0);
+        } else if (opcode == '|') {
+          ip.face(0, direction, 0);
+        } else {
+          ip.face(0, 0, direction);
+        }
+      }
+      break;
+
+    case 'y':
+      for (; count > 0; count--) {
+        this->push_sysinfo(stack, ip, frame);
+      }
+      break;
+
+    case '{':
+    case '}':
+    case 'u':
+    case '(':
+    case ')':
+    case 'i':
+      for (; count > 0; count--) {
+        bool success = true;
+        if (opcode == '{') {
+          this->open_block(stack, frame, ip.copy().move_forward());
+        } else if (opcode == '}') {
+          success = this->close_block(stack, frame);
+        } else if (opcode == 'u') {
+          success = this->stack_under_stack(stack, frame);
+        } else if (opcode == '(') {
+          success = this->load_fingerprint(stack);
+        } else if (opcode == ')') {
+          success = this->unload_fingerprint(stack);
+        } else {
+          success = this->read_file_from_stack(stack, frame);
+        }
+        if (!success) {
+          ip.turn_around();
+        }
+      }
+      break;
+
+    case 'k': {
+      // each iteration of the inner k pops its own count and iterates the
+      // instruction after it, still with the IP on the outer k
+      Position target_pos = opcode_pos.copy();
+      int16_t target = this->find_iterated_opcode(target_pos);
+      if (target == 'k') {
+        throw runtime_error("k cannot iterate kk");
+      }
+      for (; count > 0; count--) {
+        int64_t inner_count = stack.pop();
+        if (inner_count > 0) {
+          this->execute_iterated_opcode(ip, target_pos, target, inner_count,
+              stack, frame);
+        }
+      }
+      break;
+    }
+
+    default:
+      // anything else does the same thing as executing it count times
+      for (; count > 0; count--) {
+        Position pos = ip.copy();
+        if (!this->interpret_opcode(pos, opcode, stack, frame)) {
+          throw logic_error(string_printf("no iterated helper for opcode %c",
+              static_cast<char>(opcode)));
         }
-        item_index++;
+        ip = pos.move_backward().wrap_lahey(this->field);
       }
+  }
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_iterated_opcode(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token, int64_t opcode) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  int64_t count = stack.pop();
+
+  // the opcode executes with the IP on the k, so it's one cell behind the next
+  // position. opcodes that move the IP (like j and s) move it from there
+  Position ip = c->token_to_position.at(next_token).copy().move_backward();
+  Position opcode_pos = ip.copy();
+  if (opcode == 'k') {
+    c->find_iterated_opcode(opcode_pos);
+  }
+
+  c->execute_iterated_opcode(ip, opcode_pos, opcode, count, stack, frame);
+  return c->make_helper_return(ip.move_forward(), stack);
+}
+
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_iterated_fingerprint(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token,
+    FingerprintFunction fn) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  int64_t count = stack.pop();
+
+  Position ip = c->token_to_position.at(next_token).copy().move_backward();
+  for (; count > 0; count--) {
+    if (!c->call_fingerprint_function(fn, stack, frame)) {
+      ip.turn_around();
     }
   }
+  return c->make_helper_return(ip.move_forward(), stack);
 }
 
-void BefungeJITCompiler::dispatch_interactive_debug_hook(BefungeJITCompiler* c,
-    const Position* current_pos, int64_t stack_top, int64_t r13,
-    int64_t stack_end, const int64_t* storage_offset) {
-  c->interactive_debug_hook(*current_pos, stack_top, r13, stack_end, storage_offset);
+template <uint8_t Dimensions>
+typename BefungeJITCompiler<Dimensions>::HelperReturn BefungeJITCompiler<Dimensions>::dispatch_iterated_letter(
+    BefungeJITCompiler* c, int64_t* stack_top, int64_t* stack_end,
+    uint8_t* frame, int64_t next_token, int64_t reflect_token, int64_t letter) {
+  CompilerLock lock(c);
+  FungeStackView stack(stack_top, stack_end);
+  int64_t count = stack.pop();
+
+  Position ip = c->token_to_position.at(next_token).copy().move_backward();
+  for (; count > 0; count--) {
+    if (!c->execute_letter(letter, stack, frame)) {
+      ip.turn_around();
+    }
+  }
+  return c->make_helper_return(ip.move_forward(), stack);
 }
 
-void BefungeJITCompiler::dispatch_throw_error(const char* message) {
-  throw runtime_error(message);
+template <uint8_t Dimensions>
+void BefungeJITCompiler<Dimensions>::dispatch_fill_stack(int64_t* dest, int64_t count,
+    int64_t value) {
+  fill(dest, dest + count, value);
 }
 
-void BefungeJITCompiler::dispatch_get_sysinfo_hl(BefungeJITCompiler* c,
-    SysinfoHL* si) {
-  // TODO
-  si->least_point_x = 0;
-  si->least_point_y = 0;
-  si->least_point_z = 0;
 
-  // TODO
-  si->greatest_point_x = c->field.width();
-  si->greatest_point_y = c->field.height();
-  si->greatest_point_z = c->field.depth();
 
-  time_t t_secs = now() / 1000000;
-  struct tm t_parsed;
-  gmtime_r(&t_secs, &t_parsed);
-  si->day_info = (t_parsed.tm_year << 16) | (t_parsed.tm_mon << 8) | t_parsed.tm_mday;
-  si->second_info = (t_parsed.tm_hour << 16) | (t_parsed.tm_min << 8) | t_parsed.tm_sec;
-}
+template class BefungeJITCompiler<1>;
+template class BefungeJITCompiler<2>;
+template class BefungeJITCompiler<3>;
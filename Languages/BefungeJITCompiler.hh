@@ -5,9 +5,15 @@
 
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -16,35 +22,94 @@
 #include <libamd64/CodeBuffer.hh>
 
 #include "Befunge.hh"
+#include "BefungeFingerprints.hh"
 #include "Common.hh"
 
 
 
+// like the interpreter, the compiler is specialized for each dimension count,
+// so the checks on it while compiling cells and in helpers fold away.
+// BefungeJITCompiler.cc instantiates it for 1, 2, and 3 dimensions
+template <uint8_t Dimensions>
 class BefungeJITCompiler {
 public:
   explicit BefungeJITCompiler(const std::string& filename,
-      uint8_t dimensions = 2, uint64_t debug_flags = 0);
-  ~BefungeJITCompiler() = default;
+      uint64_t debug_flags = 0, uint64_t random_seed = 0,
+      uint64_t jit_threshold = 0,
+      bool speculative_compile = false, size_t max_code_size = 0,
+      bool precompile = false);
+  ~BefungeJITCompiler();
 
   void set_breakpoint(const Position& pos);
 
   void execute();
 
+  // compiles a cell containing each opcode (replacing the first two cells of
+  // the program) the given number of times, and prints the average time per
+  // compilation and the code size to stdout
+  void benchmark_compilation(size_t iterations);
+
 private:
 
   void check_dimensions(uint8_t required_dimensions, const Position& where,
       int16_t opcode) const;
 
-  // TODO: recycle old buffer blocks by keeping them in a free list
+  static bool is_direction_independent_opcode(int16_t opcode);
+  Position canonical_position(const Position& pos) const;
+
+  // orders cell keys the same way as Position::operator<, but compares only
+  // the axes that exist in this dimension count (the others are always zero)
+  struct CellKeyLess {
+    bool operator()(const Position& a, const Position& b) const;
+  };
+  template <typename ValueT>
+  using CellMap = std::map<Position, ValueT, CellKeyLess>;
 
   struct CompiledCell {
     // Position not included; it's the map key
     void* code;
     size_t code_size;
     size_t buffer_capacity;
+    // the cell's rarely-run paths (e.g. for stack underflow), if any, are in a
+    // separate block in the cold code buffer. this is NULL if they're after
+    // the main code instead, because the cold block was out of jump range
+    void* cold_path_code;
+    size_t cold_path_capacity;
+
+    // in concurrent mode, the offset of the cell body after the yield
+    // prologue; suspended threads resume at code + resume_offset
+    size_t resume_offset;
+    // if the cell calls the debug hook on entry, the offset of the code after
+    // the hook call; the hook returns here
+    size_t body_offset;
+    // with a code size limit, compiled code sets this on entry; it's cleared
+    // by the eviction clock as it passes the cell
+    uint8_t accessed;
+
+    // other cells jump to this cell indirectly through its slot, so when the
+    // cell is compiled or moved, only the slot has to be updated. entry is the
+    // cell's code, or the slot trampoline if it has none. the background
+    // compiler publishes new code by storing entry while compiled code may be
+    // jumping through it, so it's stored with release ordering after the code
+    // has been written
+    struct Slot {
+      std::atomic<const void*> entry;
+      const Position* pos; // the cell's key in compiled_cells
+
+      Slot();
+    } slot;
 
     std::unordered_set<int64_t> next_position_tokens;
+    // cells that embed this cell's code address (in inline caches); they're
+    // recompiled whenever the address changes
     std::set<Position> address_dependencies;
+    // cells that jump to this cell through its slot. they're only recompiled
+    // when this cell is reset, since its contents (and therefore the canonical
+    // position they should jump to) may have changed
+    std::set<Position> slot_dependencies;
+    // coordinates (with zero delta) of cells whose values were read when this
+    // cell was compiled; the reverse of BefungeJITCompiler::value_dependents
+    std::set<Position> value_dependencies;
 
     CompiledCell();
     CompiledCell(void* code, size_t code_size);
@@ -55,12 +120,149 @@ private:
   void compile_opcode_iterated(AMD64Assembler& as, const Position& iterator_pos,
       const Position& target_pos, int16_t opcode);
   const void* compile_cell(const Position& cell_pos, bool reset_cell = false);
+
+  // the code of cells that are reset or moved is retired, along with the
+  // tokens of cells that are recompiled. compiled code may still be running
+  // in a retired block (e.g. the cell that called the compiler), so retired
+  // blocks and tokens are only reused after reclaim_retired_code is called,
+  // which is done only where no compiled code is on the call stack (when a
+  // helper or the slot trampoline is about to return to compiled code).
+  // allocate returns the block's capacity in *capacity. free blocks are
+  // indexed by address, so adjacent blocks can be merged, and by size, so
+  // allocate can reuse the smallest one that fits. blocks aren't merged
+  // across the start of a region that buf allocated separately, since regions
+  // that happen to be adjacent in memory may not be contiguous in buf
+  struct CodeAllocator {
+    CodeBuffer* buf;
+    std::vector<std::pair<uint8_t*, size_t>> retired_blocks;
+    std::map<uint8_t*, size_t> free_blocks;
+    std::multimap<size_t, uint8_t*> free_blocks_by_size;
+    std::set<uint8_t*> region_starts;
+    uint8_t* append_end;
+
+    explicit CodeAllocator(CodeBuffer* buf);
+    void* allocate(const std::string& data,
+        const std::unordered_set<size_t>& patch_offsets, size_t* capacity);
+    void retire(void* code, size_t capacity);
+    void reclaim();
+  };
+  // these also keep track of live_code_size
+  void* allocate_code(CodeAllocator& allocator, const std::string& data,
+      const std::unordered_set<size_t>& patch_offsets, size_t* capacity);
+  void retire_code(CodeAllocator& allocator, void* code, size_t capacity);
+  void reclaim_retired_code();
+  int64_t allocate_token(CompiledCell& cell, const Position& pos);
+  void release_tokens(CompiledCell& cell);
+
+  // the code compiled for simple opcodes depends only on the opcode, the
+  // cell's direction, and the stack alignment, except for the addresses of
+  // the slots it jumps through. the first time each combination is compiled,
+  // the code is saved as a template, with placeholders instead of the slot
+  // addresses; after that, cells are compiled by copying the template and
+  // filling in the slot addresses, without using the assembler
+  struct OpcodeTemplate {
+    std::string data;
+    std::unordered_set<size_t> patch_offsets;
+    std::string cold_data;
+    std::unordered_set<size_t> cold_patch_offsets;
+    // offset of each cold path in cold_data, and the offset just past the
+    // jump to it in data, by index
+    std::vector<size_t> cold_path_offsets;
+    std::vector<size_t> cold_jump_offsets;
+    // (offset of the slot address in data or cold_data, next position
+    // relative to the cell's coordinates)
+    std::vector<std::pair<size_t, Position>> exits;
+    std::vector<std::pair<size_t, Position>> cold_exits;
+  };
+  bool can_use_opcode_template(const Position& pos, int16_t opcode) const;
+  const OpcodeTemplate& get_opcode_template(const Position& pos,
+      int16_t opcode);
+  // returns a copy of the template with the slot addresses filled in
+  OpcodeTemplate compile_opcode_from_template(const Position& pos,
+      int16_t opcode);
+
+  // while a cell is being compiled, its rarely-run paths are written to a
+  // separate assembler, and the result goes in the cold code buffer, so the
+  // code that usually runs is smaller and denser. write_cold_path_jump writes
+  // a jump (jmp or jcc rel32) to a new cold path and returns the assembler to
+  // write the path to. the jump's displacement is filled in by
+  // link_cold_paths after both blocks have been placed, given the distance
+  // from the main code to the cold paths. a rel32 jump reaches 2GB either way;
+  // if any cold path is farther than that, link_cold_paths returns false and
+  // compile_cell puts the cell's cold paths after its main code instead
+  enum class ColdPathCondition {
+    // the values are the second byte of the jcc rel32 opcode
+    Always = 0x00,
+    Zero = 0x84,
+    Less = 0x8C,
+    GreaterOrEqual = 0x8D,
+    Greater = 0x8F,
+  };
+  AMD64Assembler& write_cold_path_jump(AMD64Assembler& as,
+      ColdPathCondition condition = ColdPathCondition::Always);
+  bool link_cold_paths(std::string& data, int64_t cold_path_distance,
+      const std::vector<size_t>& cold_path_offsets,
+      const std::vector<size_t>& cold_jump_offsets) const;
+
+  // with a code size limit, when the code owned by compiled cells exceeds the
+  // limit, cells are evicted (reset) in clock order until it's below 3/4 of
+  // the limit, skipping cells that have run since the clock last passed them.
+  // this is done where retired code is reclaimed, so the limit can be exceeded
+  // briefly between those points
+  void evict_cold_cells();
+  void evict_cell(const Position& pos);
+
+  // with precompilation enabled, execute calls this to compile the cells
+  // reachable from the start before running the program. this is only eager
+  // compilation: the code is the same as what lazy compilation would produce,
+  // and cells still jump to each other through their slots. it stops early if
+  // it reaches a cell that can modify the field; if the program does modify
+  // cells that have been compiled, they're reset and compiled lazily again
+  void precompile_reachable_cells();
+
+  // with speculative compilation enabled, a background thread compiles the
+  // targets of jumps to cells that haven't been compiled yet, up to a limited
+  // depth, before the program reaches them. it holds compiler_mutex while
+  // compiling each cell, and everything called from compiled code that uses
+  // the compiler's state holds it too (via CompilerLock). the background
+  // thread only appends new code to the buffer, since the main thread may be
+  // executing any existing code. existing jumps to the new code go through
+  // the cell's slot, which it updates directly; cells that embed the new
+  // code's address are recorded in deferred_dependency_updates instead. the
+  // main thread recompiles them the next time it enters the compiler from
+  // somewhere that won't return to compiled code it might overwrite
+  struct CompilerLock {
+    std::unique_lock<std::recursive_mutex> lock;
+    explicit CompilerLock(BefungeJITCompiler* c);
+  };
+  void start_speculative_compile_thread();
+  void stop_speculative_compile_thread();
+  void speculative_compile_thread_routine();
+  void apply_deferred_dependency_updates();
+
   void on_cell_contents_changed(int64_t x, int64_t y, int64_t z);
+  // counts a write to a cell with compiled code (key has zero delta), and
+  // makes the cell volatile if it's been rewritten too often
+  void count_cell_rewrite(const Position& key);
+  bool has_compiled_code_at(int64_t x, int64_t y, int64_t z) const;
+  void reset_cells_at(int64_t x, int64_t y, int64_t z);
+  void on_region_contents_changed(int64_t x1, int64_t y1, int64_t z1,
+      int64_t x2, int64_t y2, int64_t z2);
+
+  // reads a cell's value at compile time, recording that dependent_pos must be
+  // recompiled if the cell's value changes
+  int16_t get_dependent_value(const Position& dependent_pos,
+      const Position& value_pos);
+  void clear_value_dependencies(const Position& pos, CompiledCell& cell);
 
   static void write_function_call(AMD64Assembler& as,
       const MemoryReference& function_ref, bool stack_aligned);
   static void write_function_call_unknown_alignment(AMD64Assembler& as,
       const MemoryReference& function_ref);
+  // returns the slot of the cell that jumps from current_pos to next_pos
+  // should go through, and records the jump
+  const typename CompiledCell::Slot* get_jump_slot(const Position& current_pos,
+      const Position& next_pos);
   void write_jump_to_cell(AMD64Assembler& as, const Position& current_pos,
       const Position& next_pos);
   void write_jump_to_cell_unknown_alignment(AMD64Assembler& as,
@@ -68,10 +270,49 @@ private:
   void write_jump_table(AMD64Assembler& as, const std::string& label_name,
       const Position& pos, const std::vector<Position>& positions);
 
+  // inline caches for opcodes whose targets depend on runtime values (j and
+  // x). the generated code compares the key (in r8, r9, and r10) against each
+  // entry and jumps directly to the cached target; misses fill an entry. the
+  // generated code reads keys and targets directly, so caches are stored in a
+  // map (whose nodes don't move) and are reset when their cell is recompiled
+  struct InlineCache {
+    static const size_t num_entries = 4;
+    int64_t keys[num_entries][3];
+    const void* targets[num_entries];
+
+    size_t num_filled;
+    size_t next_replace;
+
+    Position cell_pos;
+    // for j, the key is a distance along base_pos's delta; for x, the key is
+    // the new delta, applied at base_pos. the alignment is already correct
+    Position base_pos;
+    bool key_is_delta;
+
+    InlineCache();
+  };
+
+  void write_inline_cache_lookup(AMD64Assembler& as,
+      const std::string& label_prefix, const Position& cell_pos,
+      const Position& base_pos, bool key_is_delta, uint8_t key_count);
+  static const void* dispatch_inline_cache_miss(BefungeJITCompiler* c,
+      InlineCache* cache, int64_t key0, int64_t key1, int64_t key2);
+
+  // pushes the values in order. long strings are stored in the cell's code
+  // and pushed by a loop instead of one instruction per value
+  void write_push_string(AMD64Assembler& as,
+      const std::vector<int16_t>& values);
+
+  // steps the random generator inline and leaves a value in [0, count) in rax
+  void write_random_index(AMD64Assembler& as, uint8_t count);
+  std::vector<Position> random_direction_positions(const Position& pos) const;
+
   // the vector is [(reg, should_add_to_existing_value), ...]
   void write_load_storage_offset(AMD64Assembler& as,
       const std::vector<std::pair<MemoryReference, bool>>& target_regs);
   void write_throw_error(AMD64Assembler& as, const char* message);
+  // ends the program (or the current thread, in concurrent mode); this is @
+  void write_end_program(AMD64Assembler& as, bool stack_aligned);
 
   void add_common_object(const std::string& name, const void* o);
   MemoryReference common_object_reference(const std::string& name);
@@ -79,7 +320,6 @@ private:
   MemoryReference storage_offset_reference(uint8_t dimension);
   MemoryReference end_of_last_stack_reference();
 
-  static const void* dispatch_compile_cell(BefungeJITCompiler* c, const Position* pos);
   static const void* dispatch_get_cell_code(BefungeJITCompiler* c, const Position* pos);
 
   static int64_t dispatch_field_read(BefungeJITCompiler* c, int64_t x,
@@ -94,47 +334,311 @@ private:
   static void dispatch_print_state(const int64_t* stack_top, size_t count,
       const Position* pos, int64_t* storage_offset, int64_t dimensions);
 
+  // only cells with breakpoints call the debug hook, unless single-stepping,
+  // in which case all cells do. when single-stepping begins, all compiled cells
+  // are reset so they'll be recompiled with the hook
+  bool should_call_debug_hook(const Position& pos) const;
+  void write_debug_hook_call(AMD64Assembler& as, CompiledCell& cell,
+      const Position& pos);
+  void reset_all_cells();
   void interactive_debug_hook(const Position& current_pos, int64_t stack_top,
       int64_t r13, int64_t stack_end, const int64_t* storage_offset);
-  static void dispatch_interactive_debug_hook(BefungeJITCompiler* c,
-      const Position* current_pos, int64_t stack_top, int64_t r13,
+  static const void* dispatch_interactive_debug_hook(BefungeJITCompiler* c,
+      int64_t return_position_token, int64_t stack_top, int64_t r13,
       int64_t stack_end, const int64_t* storage_offset);
 
   static void dispatch_throw_error(const char* error_string);
 
-  struct SysinfoHL {
-    // this struct mirrors the actual layout on the stack of some of the fields
-    // returned by the 'y' opcode
-    int64_t least_point_z;
-    int64_t least_point_y;
-    int64_t least_point_x;
-    int64_t greatest_point_z;
-    int64_t greatest_point_y;
-    int64_t greatest_point_x;
+  // Concurrent Funge-98 support. each IP runs on its own native stack (the
+  // main IP uses the process stack; others use mapped regions), so switching
+  // IPs only requires saving and restoring rsp, rbp, and r13. the generated
+  // code yields at the beginning of every cell that takes a tick, and the
+  // yield function switches to the next IP in a circular list, so IPs run in
+  // round-robin order one instruction at a time
+  struct ThreadContext {
+    // the generated code accesses these fields directly; see the yield
+    // function in the constructor
+    void* stack_top; // rsp
+    void* frame; // rbp
+    void* stack_end; // r13
+    const void* resume; // where to continue executing when switched to
+    ThreadContext* next;
+    ThreadContext* prev;
+    // the lowest address the thread's Funge stack can grow to; see
+    // BefungeJITCompiler::stack_limit
+    const void* stack_limit;
+
+    int64_t id;
+    // if resume points to the resume_thread function, this is the cell to
+    // compile and resume at
+    Position resume_position;
+
+    void* stack_region;
+    size_t stack_region_size;
+
+    // each thread has its own fingerprint semantic stacks and HRTI mark, which
+    // children inherit from their parent when t creates them
+    std::vector<const FingerprintSemantic*> letter_semantics[26];
+    bool hrti_mark_set;
+    uint64_t hrti_mark;
+
+    ThreadContext(int64_t id, size_t stack_region_size);
+    ~ThreadContext();
+  };
 
-    int64_t day_info; // ((year - 1900) << 16) | (month << 8) | (day of month)
-    int64_t second_info; // (hour << 16) | (minute << 8) | (second)
-  } __attribute__((packed));
+  static bool field_contains_opcode(const Field& field, char opcode);
+  void warn_about_late_t(const Position& pos);
+  void relocate_suspended_threads(const Position& pos, const void* old_resume,
+      const void* new_resume);
+
+  void fork_thread(int64_t child_token, uint8_t* stack_top, uint8_t* stack_end,
+      uint8_t* frame);
+  static const void* dispatch_fork_thread(BefungeJITCompiler* c,
+      int64_t parent_token, int64_t child_token, uint8_t* stack_top,
+      uint8_t* stack_end, uint8_t* frame);
+  static const void* dispatch_fork_threads(BefungeJITCompiler* c,
+      int64_t parent_token, int64_t child_token, uint8_t* stack_top,
+      uint8_t* stack_end, uint8_t* frame, int64_t count);
+  static ThreadContext* dispatch_end_thread(BefungeJITCompiler* c);
+  static const void* dispatch_resume_thread(BefungeJITCompiler* c,
+      ThreadContext* thread);
+
+  // opcodes that manipulate the stacks in complex ways (the stack-of-stacks
+  // opcodes and non-inline fingerprint instructions) are implemented by C++
+  // functions that run on a separate stack, so they can push arbitrarily many
+  // values onto the Funge stack. they return the new stack top and the address
+  // of the cell to continue at, and leave the new stack end in
+  // helper_return_stack_end; the helper_return function installs all of
+  // these, since the calling cell may have been recompiled
+  struct HelperReturn {
+    int64_t* stack_top;
+    const void* next_code;
+  };
 
-  static void dispatch_get_sysinfo_hl(BefungeJITCompiler* c, SysinfoHL* si);
+  // if extra_arg is nonzero, it's passed as the dispatch function's seventh
+  // argument
+  void write_helper_call(AMD64Assembler& as, CompiledCell& cell,
+      const Position& pos, const char* dispatch_function_name,
+      int64_t extra_arg = 0);
+  HelperReturn make_helper_return(int64_t token, const FungeStackView& stack);
+  HelperReturn make_helper_return(const Position& next_pos,
+      const FungeStackView& stack);
+  void on_letter_semantics_changed(char letter);
+
+  // the slot trampoline calls this with the slot of a cell that has no code.
+  // it runs on the helper stack, like the native helpers
+  static HelperReturn dispatch_enter_slot(BefungeJITCompiler* c,
+      const typename CompiledCell::Slot* slot, int64_t* stack_top, int64_t* stack_end,
+      uint8_t* frame);
+
+  // in tiered mode, jumps to cells that haven't been compiled go to the
+  // interpreter instead of the compiler. it runs cells until it reaches one
+  // that's already compiled or that has run jit_threshold times in the same
+  // direction, then returns to compiled code at that cell. it only handles
+  // simple opcodes; cells containing anything else are compiled immediately.
+  // interpret_opcode returns false (leaving pos unchanged) for those
+  bool interpret_opcode(Position& pos, int16_t opcode, FungeStackView& stack,
+      uint8_t* frame);
+  Position interpret_cells(const Position& start_pos, FungeStackView& stack,
+      uint8_t* frame);
+
+  // cells that are rewritten often while they're being executed are volatile.
+  // instead of being compiled from their contents (and reset by every write),
+  // they're compiled once as a call to dispatch_volatile_cell, which reads the
+  // cell's current opcode and executes it. volatile cells are compiled
+  // normally again if they're found to contain an opcode it can't execute
+  static HelperReturn dispatch_volatile_cell(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token);
+
+  // the semantic stacks that ( and ) modify. in concurrent mode, these are
+  // the current thread's, and letter cells look up the current thread's
+  // semantic when they run instead of being compiled from it
+  std::vector<const FingerprintSemantic*>* active_letter_semantics();
+
+  // these return false if the instruction should reflect
+  bool call_fingerprint_function(FingerprintFunction fn, FungeStackView& stack,
+      uint8_t* frame);
+  bool execute_letter(char letter, FungeStackView& stack, uint8_t* frame);
+  bool load_fingerprint(FungeStackView& stack);
+  bool unload_fingerprint(FungeStackView& stack);
+
+  static HelperReturn dispatch_letter(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token, int64_t letter);
+
+  static HelperReturn dispatch_fingerprint(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token, FingerprintFunction fn);
+  static HelperReturn dispatch_load_fingerprint(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token);
+  static HelperReturn dispatch_unload_fingerprint(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token);
+
+  // the stack-of-stacks is segmented: each stack's end (r13) is followed by
+  // the previous stack's end and top pointers, and there may be unused space
+  // between those and the previous stack's top. this allows {, }, and u to
+  // move only the items they transfer
+  int64_t* storage_offset_pointer(uint8_t* frame, uint8_t dimension) const;
+  int64_t* stack_limit_pointer() const;
+  void open_block(FungeStackView& stack, uint8_t* frame,
+      const Position& next_pos);
+  bool close_block(FungeStackView& stack, uint8_t* frame);
+  bool stack_under_stack(FungeStackView& stack, uint8_t* frame);
+  static HelperReturn dispatch_open_block(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token);
+  static HelperReturn dispatch_close_block(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token);
+  static HelperReturn dispatch_stack_under_stack(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token);
+
+  // y's items are numbered from 1 (the flags cell on top of a full dump).
+  // get_sysinfo_item computes only the requested item; stack_top is the top of
+  // the stack after the argument was popped. items beyond the end of the
+  // sysinfo are read from the stack below it
+  int64_t get_sysinfo_item(int64_t index, const Position& pos,
+      const int64_t* stack_top, const int64_t* stack_end, uint8_t* frame);
+  static HelperReturn dispatch_sysinfo(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token);
+  static int64_t dispatch_get_sysinfo_item(BefungeJITCompiler* c,
+      int64_t index, const int64_t* stack_top, const int64_t* stack_end,
+      uint8_t* frame);
+
+  // if the cell after a digit is y, the digit's cell computes the selected
+  // item directly and skips the y. returns false if it doesn't apply
+  bool write_constant_sysinfo_item(AMD64Assembler& as, const Position& pos,
+      int64_t index);
+
+  // these do the same things as y and the code compiled for i, for use by
+  // helpers and iterated opcodes. read_file_from_stack returns false on failure
+  void push_sysinfo(FungeStackView& stack, const Position& pos, uint8_t* frame);
+  bool read_file_from_stack(FungeStackView& stack, uint8_t* frame);
+
+  // find_iterated_opcode moves pos onto the instruction k iterates (skipping
+  // spaces and ;-delimited regions) and returns it. execute_iterated_opcode
+  // runs it count times with the IP at ip; opcode_pos is where the opcode is,
+  // which matters only for k (whose target follows it)
+  int16_t find_iterated_opcode(Position& pos);
+  void execute_iterated_opcode(Position& ip, const Position& opcode_pos,
+      int16_t opcode, int64_t count, FungeStackView& stack, uint8_t* frame);
+
+  // k executes opcodes that modify the field, do I/O, change the stacks in
+  // complex ways, or whose results depend on every iteration (like x and j)
+  // with a single helper call. the compiled code pushes the count back onto
+  // the stack before calling these
+  static HelperReturn dispatch_iterated_opcode(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token, int64_t opcode);
+  static HelperReturn dispatch_iterated_fingerprint(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token, FingerprintFunction fn);
+  static HelperReturn dispatch_iterated_letter(BefungeJITCompiler* c,
+      int64_t* stack_top, int64_t* stack_end, uint8_t* frame,
+      int64_t next_token, int64_t reflect_token, int64_t letter);
+  static void dispatch_fill_stack(int64_t* dest, int64_t count, int64_t value);
 
-  uint8_t dimensions;
   uint64_t debug_flags;
   std::set<Position> breakpoint_positions;
 
+  uint64_t jit_threshold;
+  bool tiered;
+  bool precompile;
+  // (cell position, with alignment cleared) -> number of times interpreted
+  CellMap<uint64_t> interpreted_counts;
+  // while precompile_reachable_cells runs, write_jump_to_cell adds jump targets
+  // that haven't been compiled yet to this queue
+  std::vector<Position>* eager_compile_queue;
+
   Field field;
-  std::map<Position, CompiledCell> compiled_cells;
+  RandomGenerator random;
+  CellMap<CompiledCell> compiled_cells;
+  // cell coordinate (with zero delta) -> compiled positions that read its value
+  std::map<Position, std::set<Position>> value_dependents;
+  // cell coordinate (with zero delta) -> number of times its compiled code was
+  // reset by writes to it; and the coordinates of volatile cells
+  CellMap<uint64_t> rewrite_counts;
+  std::set<Position> volatile_cells;
+
+  // (cell position, resulting stack alignment) -> cache
+  std::map<std::pair<Position, uint8_t>, InlineCache> inline_caches;
+
+  // (opcode, direction and alignment with zero coordinates) -> template.
+  // while a template is being made, write_jump_to_cell records its exits
+  std::map<std::pair<int16_t, Position>, OpcodeTemplate> opcode_templates;
+  OpcodeTemplate* recording_template;
+  // the cold path assembler for the cell being compiled; see
+  // write_cold_path_jump
+  AMD64Assembler* cold_as;
+  size_t num_cold_paths;
 
   int64_t next_token;
   std::unordered_map<int64_t, Position> token_to_position;
+  std::vector<int64_t> retired_tokens;
+  std::vector<int64_t> free_tokens;
 
   std::vector<const void*> common_objects;
   std::unordered_map<std::string, size_t> common_object_index;
 
+  bool concurrent;
+  // threads are only set up if the program contains t when it's loaded. a t
+  // that appears later acts like r, and a warning is printed the first time
+  bool warned_about_late_t;
+  ThreadContext* current_thread;
+  void* main_thread_frame;
+  // the lowest address the current thread's Funge stack can grow to. this
+  // leaves some space at the bottom of the stack for native calls made by
+  // compiled code. opcodes that push a number of items given by the program
+  // check it before moving the stack pointer, so a huge count raises an error
+  // instead of moving the stack pointer past the guard page
+  const void* stack_limit;
+  int64_t next_thread_id;
+  std::unordered_map<int64_t, std::unique_ptr<ThreadContext>> threads;
+  std::vector<std::unique_ptr<ThreadContext>> dead_threads;
+
+  // semantic stacks for A-Z (the last item is the active semantic), and the
+  // compiled cells that were compiled from each letter's active semantic. in
+  // concurrent mode, the semantic stacks are in each ThreadContext instead
+  std::vector<const FingerprintSemantic*> letter_semantics[26];
+  std::set<Position> letter_cells[26];
+  FingerprintEnvironment fingerprint_env;
+  std::unique_ptr<uint8_t[]> helper_stack;
+  int64_t* helper_return_stack_end;
+
+  // cells' main code goes in buf; their cold paths go in cold_buf
   CodeBuffer buf;
+  CodeBuffer cold_buf;
+  CodeAllocator hot_code;
+  CodeAllocator cold_code;
+  size_t max_code_size;
+  size_t live_code_size;
+  typename CellMap<CompiledCell>::iterator eviction_clock_hand;
+  const void* yield_function;
+  const void* resume_thread_function;
+  const void* helper_return_function;
+  const void* inline_cache_miss_function;
+  const void* slot_trampoline_function;
   const void* jump_return_40;
   const void* jump_return_38;
   const void* jump_return_8;
   const void* jump_return_0;
   const void* compress_string_function;
+
+  bool speculative_compile;
+  std::recursive_mutex compiler_mutex;
+  std::condition_variable_any speculative_compile_cv;
+  // (position, speculation depth)
+  std::deque<std::pair<Position, size_t>> speculative_compile_queue;
+  // the depth of the cell being compiled, if it's being compiled speculatively;
+  // zero when compiling on the main thread
+  size_t current_speculation_depth;
+  bool defer_dependency_updates;
+  bool speculative_compile_thread_should_exit;
+  std::set<Position> deferred_dependency_updates;
+  std::thread speculative_compile_thread;
 };
@@ -11,15 +11,37 @@ using namespace std;
 
 
 
-static uint16_t crz(uint16_t x, uint16_t y) {
-  static const uint8_t table[9] = {1, 0, 0, 1, 0, 2, 2, 2, 1};
-  uint16_t result = 0;
-  for (size_t power = 1; power < 59049; power *= 3) {
-    uint8_t x_trit = (x / power) % 3;
-    uint8_t y_trit = (y / power) % 3;
-    result += table[y_trit * 3 + x_trit] * power;
+// crz operates on each trit independently, so it's done on 5 trits (one of
+// 243 values) at a time, using a table of the results for every pair of 5-trit
+// values. a word is 10 trits, so each crz is two lookups. the normalize table
+// gives (opcode + c) % 94 for printable opcodes, given c % 94
+struct MalbolgeTables {
+  uint8_t crz[243][243];
+  uint8_t normalize[127 + 94];
+
+  MalbolgeTables() {
+    static const uint8_t trit_table[9] = {1, 0, 0, 1, 0, 2, 2, 2, 1};
+    for (size_t x = 0; x < 243; x++) {
+      for (size_t y = 0; y < 243; y++) {
+        uint8_t result = 0;
+        for (size_t power = 1; power < 243; power *= 3) {
+          uint8_t x_trit = (x / power) % 3;
+          uint8_t y_trit = (y / power) % 3;
+          result += trit_table[y_trit * 3 + x_trit] * power;
+        }
+        this->crz[x][y] = result;
+      }
+    }
+    for (size_t x = 0; x < sizeof(this->normalize); x++) {
+      this->normalize[x] = x % 94;
+    }
   }
-  return result;
+};
+
+static const MalbolgeTables tables;
+
+static uint16_t crz(uint16_t x, uint16_t y) {
+  return tables.crz[x % 243][y % 243] + tables.crz[x / 243][y / 243] * 243;
 }
 
 void malbolge_interpret(const string& filename) {
@@ -40,13 +62,15 @@ void malbolge_interpret(const string& filename) {
   }
 
   size_t a = 0, c = 0, d = 0;
+  size_t c_mod_94 = 0;
   for (;;) {
     if (c >= memory.size()) {
       throw runtime_error("execution reached the end of memory");
     }
 
     uint16_t opcode = memory[c];
-    uint8_t normalized_opcode = (opcode + c) % 94;
+    uint8_t normalized_opcode = (opcode < 127) ?
+        tables.normalize[opcode + c_mod_94] : ((opcode + c) % 94);
 
     switch (normalized_opcode) {
       case 4:
@@ -55,6 +79,7 @@ void malbolge_interpret(const string& filename) {
           throw runtime_error("jump beyond end of memory");
         }
         opcode = memory[c]; // needed for reencryption later
+        c_mod_94 = c % 94;
         break;
       case 5:
         putc(a & 0xFF, stdout);
@@ -88,7 +113,14 @@ void malbolge_interpret(const string& filename) {
       memory[c] = encoding_table[opcode - 33];
     }
 
-    c = (c + 1) % 59049;
-    d = (d + 1) % 59049;
+    if (++c == 59049) {
+      c = 0;
+      c_mod_94 = 0;
+    } else if (++c_mod_94 == 94) {
+      c_mod_94 = 0;
+    }
+    if (++d == 59049) {
+      d = 0;
+    }
   }
 }
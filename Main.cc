@@ -39,6 +39,18 @@ enum class Language {
   Deadfish,
 };
 
+template <uint8_t Dimensions>
+static void befunge_execute(const char* filename, uint64_t debug_flags,
+    uint64_t seed, uint64_t jit_threshold, bool speculative_compile,
+    size_t max_code_size, bool precompile, const set<Position>& breakpoints) {
+  BefungeJITCompiler<Dimensions> c(filename, debug_flags, seed, jit_threshold,
+      speculative_compile, max_code_size, precompile);
+  for (const auto& pos : breakpoints) {
+    c.set_breakpoint(pos);
+  }
+  c.execute();
+}
+
 
 
 int main(int argc, char* argv[]) {
@@ -53,6 +65,12 @@ int main(int argc, char* argv[]) {
   bool single_step = false;
   set<Position> befunge_breakpoints;
   bool deadfish_ascii = false;
+  uint64_t befunge_seed = now();
+  uint64_t befunge_jit_threshold = 0;
+  bool befunge_speculative_compile = false;
+  size_t befunge_max_code_size = 0;
+  bool befunge_precompile = false;
+  size_t befunge_benchmark_iterations = 0;
   Behavior behavior = Behavior::Execute;
   const char* input_filename = NULL;
 
@@ -109,6 +127,18 @@ int main(int argc, char* argv[]) {
       befunge_breakpoints.emplace(x, y, z, 0, 0, 0);
     } else if (!strncmp(argv[x], "--dimensions=", 13)) {
       dimensions = atoi(&argv[x][13]);
+    } else if (!strncmp(argv[x], "--seed=", 7)) {
+      befunge_seed = strtoull(&argv[x][7], NULL, 0);
+    } else if (!strncmp(argv[x], "--jit-threshold=", 16)) {
+      befunge_jit_threshold = strtoull(&argv[x][16], NULL, 0);
+    } else if (!strcmp(argv[x], "--speculative-compile")) {
+      befunge_speculative_compile = true;
+    } else if (!strncmp(argv[x], "--max-code-size=", 16)) {
+      befunge_max_code_size = strtoull(&argv[x][16], NULL, 0);
+    } else if (!strcmp(argv[x], "--precompile")) {
+      befunge_precompile = true;
+    } else if (!strncmp(argv[x], "--benchmark-compilation=", 24)) {
+      befunge_benchmark_iterations = strtoull(&argv[x][24], NULL, 0);
 
     // deadfish options
     } else if (!strcmp(argv[x], "--ascii")) {
@@ -178,6 +208,33 @@ Funge-98-specific options:\n\
   --breakpoint=x[,y[,z]]\n\
       Enter interactive debugging when execution hits this location.\n\
       This option may be given multiple times.\n\
+  --seed=N\n\
+      Seed the random number generator used by the ? opcode, so runs are\n\
+      reproducible. By default, the seed is based on the current time.\n\
+  --jit-threshold=N\n\
+      In execute mode, interpret each cell the first N times it runs in each\n\
+      direction, and compile it only after that. This makes programs that run\n\
+      most of their code only a few times start faster. 0 (the default)\n\
+      compiles every cell the first time it runs. Ignored when debugging and\n\
+      for programs that use t.\n\
+  --speculative-compile\n\
+      In execute mode, compile cells the program is likely to reach soon on a\n\
+      background thread, so the program doesn\'t have to wait for them to be\n\
+      compiled. Ignored when debugging, with --jit-threshold, and for programs\n\
+      that use t.\n\
+  --max-code-size=N\n\
+      In execute mode, limit the compiled code to about N bytes. When the\n\
+      limit is exceeded, cells that haven\'t run recently are discarded, and\n\
+      are compiled again if they run again. 0 (the default) means no limit.\n\
+  --precompile\n\
+      In execute mode, compile the cells reachable from the start before running\n\
+      the program, up to the first cell that can modify the field. This doesn\'t\n\
+      make the compiled code any faster; it only moves compilation before the\n\
+      program starts. Ignored when debugging and with --jit-threshold.\n\
+  --benchmark-compilation=N\n\
+      Instead of running the program, compile a cell containing each opcode N\n\
+      times for each number of dimensions, and show how long it took. This\n\
+      overwrites the program\'s first two cells, so a small file works best.\n\
 \n\
 Malbolge runs only in interpret mode. There are no language-specific options.\n\
 \n\
@@ -189,8 +246,6 @@ Deadfish-specific options:\n\
     return 1;
   }
 
-  srand(time(NULL));
-
   if (language == Language::Automatic) {
     if (ends_with(input_filename, ".b")) {
       language = Language::Brainfuck;
@@ -223,17 +278,44 @@ Deadfish-specific options:\n\
 
     } else if (language == Language::Befunge) {
       if (behavior == Behavior::Interpret) {
-        BefungeInterpreter i(input_filename, dimensions);
-        i.execute();
+        if (dimensions == 1) {
+          BefungeInterpreter<1> i(input_filename, befunge_seed);
+          i.execute();
+        } else if (dimensions == 2) {
+          BefungeInterpreter<2> i(input_filename, befunge_seed);
+          i.execute();
+        } else if (dimensions == 3) {
+          BefungeInterpreter<3> i(input_filename, befunge_seed);
+          i.execute();
+        } else {
+          throw runtime_error("dimensions must be 1, 2, or 3");
+        }
+      } else if (befunge_benchmark_iterations) {
+        BefungeJITCompiler<1>(input_filename, debug_flags, befunge_seed)
+            .benchmark_compilation(befunge_benchmark_iterations);
+        BefungeJITCompiler<2>(input_filename, debug_flags, befunge_seed)
+            .benchmark_compilation(befunge_benchmark_iterations);
+        BefungeJITCompiler<3>(input_filename, debug_flags, befunge_seed)
+            .benchmark_compilation(befunge_benchmark_iterations);
       } else if (behavior == Behavior::Execute) {
         debug_flags |=
             (single_step ? (DebugFlag::InteractiveDebug | DebugFlag::SingleStep) : 0) |
             (befunge_breakpoints.empty() ? 0 : DebugFlag::InteractiveDebug);
-        BefungeJITCompiler c(input_filename, dimensions, debug_flags);
-        for (const auto& pos : befunge_breakpoints) {
-          c.set_breakpoint(pos);
+        if (dimensions == 1) {
+          befunge_execute<1>(input_filename, debug_flags, befunge_seed,
+              befunge_jit_threshold, befunge_speculative_compile,
+              befunge_max_code_size, befunge_precompile, befunge_breakpoints);
+        } else if (dimensions == 2) {
+          befunge_execute<2>(input_filename, debug_flags, befunge_seed,
+              befunge_jit_threshold, befunge_speculative_compile,
+              befunge_max_code_size, befunge_precompile, befunge_breakpoints);
+        } else if (dimensions == 3) {
+          befunge_execute<3>(input_filename, debug_flags, befunge_seed,
+              befunge_jit_threshold, befunge_speculative_compile,
+              befunge_max_code_size, befunge_precompile, befunge_breakpoints);
+        } else {
+          throw runtime_error("dimensions must be 1, 2, or 3");
         }
-        c.execute();
       }
 
     } else if (language == Language::Malbolge) {
@@ -0,0 +1,75 @@
+#!/bin/bash
+
+# Runs each given Funge-98 program through both the interpreter and the JIT and
+# compares their output. Options starting with -- (like --dimensions=3) are
+# passed to equinox for every program. If a file named like the program with
+# ".in" appended exists, it's used as standard input for both runs.
+#
+# Usage: tests/compare_befunge.sh [options] program.b98 [program.b98 ...]
+#
+# Both runs use the same --seed, so programs that use ? produce the same output
+# too. Only standard output is compared, since the two may word errors
+# differently; the exit statuses must match too. The exit status is 1 if any
+# program's results differed. `make check-befunge` runs this on the programs in
+# tests/befunge; Mycology's mycology.b98 is worth running through it as well.
+
+EQUINOX="${EQUINOX:-$(dirname "$0")/../equinox}"
+if [ ! -x "$EQUINOX" ]; then
+  echo "$EQUINOX is not executable; run make first or set EQUINOX" >&2
+  exit 1
+fi
+
+OPTIONS=(--seed=1)
+PROGRAMS=()
+for ARG in "$@"; do
+  if [[ "$ARG" == --* ]]; then
+    OPTIONS+=("$ARG")
+  else
+    PROGRAMS+=("$ARG")
+  fi
+done
+if [ ${#PROGRAMS[@]} -eq 0 ]; then
+  echo "usage: $0 [options] program.b98 [program.b98 ...]" >&2
+  exit 1
+fi
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+NUM_FAILED=0
+for PROGRAM in "${PROGRAMS[@]}"; do
+  INPUT=/dev/null
+  if [ -f "$PROGRAM.in" ]; then
+    INPUT="$PROGRAM.in"
+  fi
+
+  # programs may write files (e.g. with o), so each run starts in the program's
+  # directory, like it would if it were run by hand
+  PROGRAM_DIR=$(cd "$(dirname "$PROGRAM")" && pwd)
+  PROGRAM_NAME=$(basename "$PROGRAM")
+  EQUINOX_PATH=$(cd "$(dirname "$EQUINOX")" && pwd)/$(basename "$EQUINOX")
+
+  (cd "$PROGRAM_DIR" && "$EQUINOX_PATH" --interpret "${OPTIONS[@]}" \
+      "$PROGRAM_NAME" < "$INPUT" > "$WORK_DIR/interpret.txt" 2> /dev/null)
+  INTERPRET_STATUS=$?
+  (cd "$PROGRAM_DIR" && "$EQUINOX_PATH" "${OPTIONS[@]}" \
+      "$PROGRAM_NAME" < "$INPUT" > "$WORK_DIR/execute.txt" 2> /dev/null)
+  EXECUTE_STATUS=$?
+
+  if [ $INTERPRET_STATUS -ne $EXECUTE_STATUS ]; then
+    echo "FAIL: $PROGRAM (interpreter exited with $INTERPRET_STATUS; JIT exited with $EXECUTE_STATUS)"
+    NUM_FAILED=$((NUM_FAILED + 1))
+  elif ! diff -u --label interpret --label execute "$WORK_DIR/interpret.txt" \
+      "$WORK_DIR/execute.txt" > "$WORK_DIR/diff.txt"; then
+    echo "FAIL: $PROGRAM (output differs)"
+    cat "$WORK_DIR/diff.txt"
+    NUM_FAILED=$((NUM_FAILED + 1))
+  else
+    echo "ok: $PROGRAM"
+  fi
+done
+
+if [ $NUM_FAILED -ne 0 ]; then
+  echo "$NUM_FAILED of ${#PROGRAMS[@]} programs differed"
+  exit 1
+fi